@@ -0,0 +1,514 @@
+/*
+ * Daemon client
+ *
+ * DETAILS:
+ *   Submits a manifest to a running daemon through the shared memory rings.
+ *   Files are opened with O_PATH and handed over a ring's worth at a time:
+ *   their descriptors are registered at indexes 0 and up, all of them are
+ *   queued with a single release of the tail, and the eventfd is only
+ *   signaled if the daemon sleeps.  Indexes are reused once every
+ *   completion of the round is in.  Submissions carry their time so that
+ *   the daemon can keep latency counters, which -v prints at the end.
+ *
+ *   The runs following the leader of the host hand their entries over the
+ *   same way, with client_commit().
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct conn {
+	int		 sock;
+	int		 sqfd;
+	int		 cqfd;
+	struct shm_rings *rings;
+	size_t		 size;
+	/* The current round */
+	char		**paths;
+	int		*fds;
+	struct timespec	*targets;
+	uint64_t	*tags;		/* user data */
+	size_t		 n;
+	struct entry	*entries;	/* the tags index, if any */
+	size_t		 nentries;
+};
+
+/*
+ * Connects to the daemon & maps the rings, only complaining about a missing
+ * daemon if not quiet.  Returns 0 on success, -1 on error
+ */
+static int
+conn_open(struct conn *c, const char *path, int quiet)
+{
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	struct sockaddr_un sun;
+	struct shm_hello hello;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[3] = { -1, -1, -1 };
+	ssize_t r;
+
+	memset(c, 0, sizeof(*c));
+	c->sqfd = c->cqfd = -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+		return (-1);
+	}
+	strcpy(sun.sun_path, path);
+
+	if ((c->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket()");
+		return (-1);
+	}
+	if (connect(c->sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		if (!quiet)
+			perror(path);
+		return (-1);
+	}
+
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	while ((r = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC)) < 0 &&
+	    errno == EINTR)
+		;
+	if (r < 0) {
+		if (!quiet)
+			perror("recvmsg()");
+		return (-1);
+	}
+	if (CMSG_FIRSTHDR(&msg) != NULL &&
+	    cmsg.hdr.cmsg_type == SCM_RIGHTS &&
+	    cmsg.hdr.cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(&cmsg.hdr), sizeof(fds));
+	c->sqfd = fds[1];
+	c->cqfd = fds[2];
+
+	if (r != (ssize_t)sizeof(hello) || fds[0] < 0 ||
+	    memcmp(hello.magic, SHM_MAGIC, sizeof(hello.magic)) != 0 ||
+	    hello.version != SHM_VERSION ||
+	    hello.size != SHM_SIZE(hello.sq_entries, hello.cq_entries)) {
+		/* A leader going away closes the connection */
+		if (!quiet || r != 0)
+			fprintf(stderr, "%s: not a touch2 daemon\n", path);
+		if (fds[0] >= 0)
+			(void)close(fds[0]);
+		return (-1);
+	}
+
+	c->size = hello.size;
+	c->rings = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fds[0], 0);
+	(void)close(fds[0]);
+	if (c->rings == MAP_FAILED) {
+		perror("mmap()");
+		c->rings = NULL;
+		return (-1);
+	}
+
+	c->paths = calloc(hello.sq_entries, sizeof(*c->paths));
+	c->fds = calloc(hello.sq_entries, sizeof(*c->fds));
+	c->targets = calloc(hello.sq_entries, sizeof(*c->targets));
+	c->tags = calloc(hello.sq_entries, sizeof(*c->tags));
+	if (c->paths == NULL || c->fds == NULL || c->targets == NULL ||
+	    c->tags == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+conn_close(struct conn *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->n; i++) {
+		free(c->paths[i]);
+		(void)close(c->fds[i]);
+	}
+	free(c->paths);
+	free(c->fds);
+	free(c->targets);
+	free(c->tags);
+	if (c->rings != NULL)
+		(void)munmap(c->rings, c->size);
+	if (c->sqfd >= 0)
+		(void)close(c->sqfd);
+	if (c->cqfd >= 0)
+		(void)close(c->cqfd);
+	(void)close(c->sock);
+}
+
+/*
+ * Registers the descriptors of the round.  Returns 0 on success, -1 on
+ * error
+ */
+static int
+conn_register(struct conn *c)
+{
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(SHM_MAX_FDS * sizeof(int))];
+	} cmsg;
+	struct shm_register reg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t i;
+
+	for (i = 0; i < c->n; i += reg.count) {
+		reg.index = (uint32_t)i;
+		reg.count = (uint32_t)((c->n - i < SHM_MAX_FDS) ?
+		    c->n - i : SHM_MAX_FDS);
+
+		iov.iov_base = &reg;
+		iov.iov_len = sizeof(reg);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(reg.count * sizeof(int));
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(reg.count * sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), c->fds + i, reg.count * sizeof(int));
+
+		if (sendmsg(c->sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(reg)) {
+			/* A leader may go away, not a daemon */
+			if (c->entries == NULL)
+				perror("sendmsg()");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Submits the round & waits for its completions.  Returns the number of
+ * files that failed, or -1 on error
+ */
+static long
+conn_round(struct conn *c)
+{
+	struct shm_rings *r = c->rings;
+	struct shm_sqe *sqes = SHM_SQES(r);
+	struct shm_cqe *cqes = SHM_CQES(r, r->sq_entries);
+	struct pollfd pfd[2];
+	struct timespec now;
+	uint32_t tail, head;
+	uint64_t count, submitted;
+	size_t i, done = 0;
+	long nfailed = 0;
+
+	if (conn_register(c) < 0)
+		return (-1);
+
+	/* The round fits the submission ring, which is empty by now */
+	tail = atomic_load_explicit(&r->sq_tail, memory_order_relaxed);
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	submitted = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+	for (i = 0; i < c->n; i++) {
+		struct shm_sqe *sqe = &sqes[(tail + i) & (r->sq_entries - 1)];
+
+		sqe->index = (uint32_t)i;
+		sqe->sec = (int64_t)c->targets[i].tv_sec;
+		sqe->nsec = (uint32_t)c->targets[i].tv_nsec;
+		sqe->user_data = c->tags[i];
+		sqe->submitted = submitted;
+	}
+	atomic_store(&r->sq_tail, tail + (uint32_t)c->n);
+	if (atomic_load(&r->flags) & SHM_NEED_WAKEUP) {
+		count = 1;
+		if (write(c->sqfd, &count, sizeof(count)) < 0) {
+			perror("write(eventfd)");
+			return (-1);
+		}
+	}
+
+	pfd[0].fd = c->cqfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = c->sock;
+	pfd[1].events = 0;	/* only for POLLHUP */
+	head = atomic_load_explicit(&r->cq_head, memory_order_relaxed);
+	while (done < c->n) {
+		tail = atomic_load_explicit(&r->cq_tail, memory_order_acquire);
+		for (; head != tail; head++, done++) {
+			const struct shm_cqe *cqe =
+			    &cqes[head & (r->cq_entries - 1)];
+
+			if (c->entries != NULL) {
+				if (cqe->user_data < c->nentries)
+					c->entries[cqe->user_data].error =
+					    -cqe->res;
+			}
+			else if (cqe->res < 0 && cqe->user_data < c->n)
+				fprintf(stderr, "%s: %s\n",
+				    c->paths[cqe->user_data],
+				    strerror(-cqe->res));
+			if (cqe->res < 0)
+				nfailed++;
+		}
+		atomic_store_explicit(&r->cq_head, head, memory_order_release);
+		if (done == c->n)
+			break;
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll()");
+			return (-1);
+		}
+		if (pfd[1].revents & (POLLHUP | POLLERR)) {
+			if (c->entries == NULL)
+				fprintf(stderr, "touch2: the daemon went away\n");
+			return (-1);
+		}
+		(void)read(c->cqfd, &count, sizeof(count));
+	}
+
+	for (i = 0; i < c->n; i++) {
+		free(c->paths[i]);
+		(void)close(c->fds[i]);
+	}
+	c->n = 0;
+
+	return (nfailed);
+}
+
+static void
+conn_stats(const struct conn *c)
+{
+	const struct shm_stats *st = &c->rings->stats;
+	uint64_t n = st->completed + st->failed;
+
+	fprintf(stderr, "touch2: %ju files stamped, %ju failed, "
+	    "clock stepped %.3fs for them\n", (uintmax_t)st->completed,
+	    (uintmax_t)st->failed, st->stepped_ns / 1e9);
+	fprintf(stderr, "touch2: latency avg %.0fus, max %.0fus\n",
+	    n ? st->latency_ns / 1e3 / n : 0.0, st->latency_max_ns / 1e3);
+}
+
+/*
+ * Submits every file listed in the manifest ("-" for stdin) to the daemon
+ * at sockpath with the given weight, which only counts for root.
+ * Returns 0 on success, -1 on error
+ */
+int
+client_submit(const char *sockpath, const char *file, int sep,
+    unsigned weight, int verbose)
+{
+	struct timespec target;
+	struct conn c;
+	const char *name;
+	char *line = NULL;
+	size_t size = 0, lineno = 0;
+	ssize_t len;
+	long nfailed = 0;
+	FILE *fp;
+	int fd, status = 0;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		return (-1);
+	}
+	if (conn_open(&c, sockpath, 0) < 0) {
+		conn_close(&c);
+		if (fp != stdin)
+			(void)fclose(fp);
+		return (-1);
+	}
+	c.rings->weight = weight;
+
+	while ((len = getdelim(&line, &size, sep, fp)) > 0) {
+		lineno++;
+		if (line[len - 1] == sep)
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		if (manifest_parse(line, &target, &name) < 0) {
+			fprintf(stderr, "%s:%zu: malformed line\n", file, lineno);
+			status = -1;
+			continue;
+		}
+		while ((fd = open(name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0 &&
+		    errno == EINTR)
+			;
+		if (fd < 0) {
+			perror(name);
+			status = -1;
+			continue;
+		}
+		if ((c.paths[c.n] = strdup(name)) == NULL) {
+			perror("strdup()");
+			(void)close(fd);
+			status = -1;
+			break;
+		}
+		c.fds[c.n] = fd;
+		c.targets[c.n] = target;
+		c.tags[c.n] = c.n;
+		if (++c.n == c.rings->sq_entries &&
+		    (nfailed = conn_round(&c)) != 0) {
+			status = -1;
+			if (nfailed < 0)
+				break;
+		}
+	}
+	if (ferror(fp)) {
+		perror(file);
+		status = -1;
+	}
+	if (nfailed >= 0 && c.n > 0 && conn_round(&c) != 0)
+		status = -1;
+	if (verbose)
+		conn_stats(&c);
+
+	free(line);
+	conn_close(&c);
+	if (fp != stdin)
+		(void)fclose(fp);
+
+	return (status);
+}
+
+/*
+ * Connects to the leader of the host's runs at path.  Returns the
+ * connection, or NULL if there's no leader there
+ */
+struct conn *
+client_connect(const char *path)
+{
+	struct conn *c;
+
+	if ((c = malloc(sizeof(*c))) == NULL) {
+		perror("malloc()");
+		return (NULL);
+	}
+	if (conn_open(c, path, 1) < 0) {
+		conn_close(c);
+		free(c);
+		return (NULL);
+	}
+
+	return (c);
+}
+
+/*
+ * Has the leader stamp n entries, a ring's worth at a time, setting their
+ * error.  Returns 0 on success, or -1 if the leader went away, leaving
+ * EINPROGRESS as the error of the entries not answered
+ */
+int
+client_commit(const struct engine *eng, struct conn *c, struct entry *v,
+    size_t n)
+{
+	size_t i;
+	int fd;
+
+	for (i = 0; i < n; i++)
+		v[i].error = EINPROGRESS;
+	c->entries = v;
+	c->nentries = n;
+
+	for (i = 0; i < n; i++) {
+		while ((fd = mountns_open(eng, v[i].path,
+		    O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0 && errno == EINTR)
+			;
+		if (fd < 0) {
+			v[i].error = errno;
+			continue;
+		}
+		c->paths[c->n] = NULL;
+		c->fds[c->n] = fd;
+		c->targets[c->n] = v[i].target;
+		c->tags[c->n] = i;
+		if (++c->n == c->rings->sq_entries && conn_round(c) < 0)
+			return (-1);
+	}
+	if (c->n > 0 && conn_round(c) < 0)
+		return (-1);
+
+	return (0);
+}
+
+void
+client_close(struct conn *c)
+{
+	if (c == NULL)
+		return;
+	conn_close(c);
+	free(c);
+}
+
+#else /* !__linux__ */
+
+int
+client_submit(const char *sockpath, const char *file, int sep,
+    unsigned weight, int verbose)
+{
+	(void)file;
+	(void)sep;
+	(void)weight;
+	(void)verbose;
+	fprintf(stderr, "%s: the daemon needs Linux\n", sockpath);
+	return (-1);
+}
+
+struct conn *
+client_connect(const char *path)
+{
+	(void)path;
+	return (NULL);
+}
+
+int
+client_commit(const struct engine *eng, struct conn *c, struct entry *v,
+    size_t n)
+{
+	(void)eng;
+	(void)c;
+	(void)v;
+	(void)n;
+	return (-1);
+}
+
+void
+client_close(struct conn *c)
+{
+	(void)c;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,662 @@
+/*
+ * Copy mode
+ *
+ * DETAILS:
+ *   touch2 cp copies trees like cp -a & gives the copies the ctimes of the
+ *   originals in the same run, instead of walking & stat'ing them again
+ *   afterwards.  A copier thread walks the sources with fts(3), copies each
+ *   file (a reflink where the filesystem can, else copy_file_range(2) or
+ *   read/write), sets its owner, mode & times, & pushes it into the ring
+ *   with the source's ctime as its target, so that the committer stamps
+ *   batches while the next ones are being copied.  Anything done to a
+ *   file changes its ctime, so it's only queued once it's complete:
+ *   directories in postorder, after the last file is created in them.
+ *   Hard links are recreated, & since making a link changes the ctime,
+ *   linked files are held back & stamped once everything is copied.
+ *   Sources are read with O_NOATIME where we may, as the clock may be
+ *   stepped meanwhile; the directories read by fts(3) & the symlinks
+ *   read still have their atimes updated as the mount options say.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* copy_file_range(2) */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <fts.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "touch2.h"
+
+#ifndef O_NOATIME
+#define O_NOATIME	0
+#endif
+
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE		_IOW(0x94, 9, int)
+#endif
+
+/* read/write buffer */
+#define COPY_BUFSIZE	(1 << 17)
+
+/* fts_number of directories not copied, whose postorder visit is ignored */
+#define SKIPPED		1
+
+/* A file with other links, by source inode */
+struct link {
+	dev_t		 dev;
+	ino_t		 ino;
+	char		*path;		/* NULL if free; its first copy */
+};
+
+struct copier {
+	pthread_t	 thread;
+	char		**srcs;
+	char		**dsts;
+	struct ring	*ring;
+	struct engine	*eng;
+	char		*buf;
+	char		*path;		/* of the copy being made */
+	size_t		 size;
+	/* Files with other links */
+	struct link	*links;
+	size_t		 nlinks;
+	size_t		 nslots;	/* a power of 2 */
+	/* Results */
+	size_t		 nerrors;
+	size_t		 ncopied;
+	size_t		 nlinked;
+	uint64_t	 bytes;
+	long		 usecs;
+};
+
+static size_t
+link_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t)ino ^ ((uint64_t)dev << 32);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return ((size_t)h);
+}
+
+/*
+ * Returns the slot of the source inode, free if it wasn't seen, or NULL on
+ * error
+ */
+static struct link *
+link_find(struct copier *c, const struct stat *st)
+{
+	struct link *v;
+	size_t i, k, nslots;
+
+	if (2 * (c->nlinks + 1) > c->nslots) {
+		nslots = c->nslots ? c->nslots * 2 : 1024;
+		if ((v = calloc(nslots, sizeof(*v))) == NULL) {
+			perror("calloc()");
+			return (NULL);
+		}
+		for (i = 0; i < c->nslots; i++) {
+			if (c->links[i].path == NULL)
+				continue;
+			k = link_hash(c->links[i].dev, c->links[i].ino) & (nslots - 1);
+			while (v[k].path != NULL)
+				k = (k + 1) & (nslots - 1);
+			v[k] = c->links[i];
+		}
+		free(c->links);
+		c->links = v;
+		c->nslots = nslots;
+	}
+
+	for (k = link_hash(st->st_dev, st->st_ino) & (c->nslots - 1);
+	    c->links[k].path != NULL; k = (k + 1) & (c->nslots - 1))
+		if (c->links[k].dev == st->st_dev && c->links[k].ino == st->st_ino)
+			break;
+
+	return (&c->links[k]);
+}
+
+/*
+ * Copies the data of in to out.  Returns 0 on success, -1 on error
+ */
+static int
+copy_data(struct copier *c, int in, int out)
+{
+	ssize_t r, w, off;
+
+#ifdef __linux__
+	if (ioctl(out, FICLONE, in) == 0)
+		return (0);
+	/* Moves both file offsets, so read(2) can take over at any point */
+	while ((r = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+		;
+	if (r == 0)
+		return (0);
+	if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+	    errno != EOPNOTSUPP)
+		return (-1);
+#endif
+	for (;;) {
+		if ((r = read(in, c->buf, COPY_BUFSIZE)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (r == 0)
+			return (0);
+		for (off = 0; off < r; off += w) {
+			if ((w = write(out, c->buf + off, (size_t)(r - off))) < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				return (-1);
+			}
+		}
+	}
+}
+
+/*
+ * Gives the copy at path the owner, mode & times of st, through fd if not
+ * -1.  Returns 0 on success, -1 on error
+ */
+static int
+copy_attrs(const char *path, int fd, const struct stat *st)
+{
+	struct timespec times[2];
+
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+
+	/* Only root can give files away, like cp -a */
+	if ((fd >= 0 ? fchown(fd, st->st_uid, st->st_gid) :
+	    lchown(path, st->st_uid, st->st_gid)) < 0 && errno != EPERM)
+		return (-1);
+	/* After chown(2), which clears set-user-ID */
+	if (!S_ISLNK(st->st_mode) &&
+	    (fd >= 0 ? fchmod(fd, st->st_mode & 07777) :
+	    chmod(path, st->st_mode & 07777)) < 0)
+		return (-1);
+	if ((fd >= 0 ? futimens(fd, times) :
+	    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW)) < 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Opens the regular file src for reading without updating its atime, which
+ * would get the stepped time if read inside a window.  Only the owner (or
+ * CAP_FOWNER) may ask for that.  Returns the descriptor, or -1 on error
+ */
+static int
+open_source(const char *src)
+{
+	int fd;
+
+	if ((fd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOATIME)) < 0 &&
+	    errno == EPERM && O_NOATIME != 0)
+		fd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+	return (fd);
+}
+
+/*
+ * Copies the non-directory src to path.  Returns the copy's descriptor for
+ * regular files, -2 for others, or -1 on error
+ */
+static int
+copy_file(struct copier *c, const char *src, const struct stat *st)
+{
+	char target[4096];
+	ssize_t len;
+	int in, out;
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFREG:
+		if ((in = open_source(src)) < 0) {
+			perror(src);
+			return (-1);
+		}
+		out = open(c->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+		    O_CLOEXEC, 0600);
+		if (out < 0) {
+			perror(c->path);
+			(void)close(in);
+			return (-1);
+		}
+		if (copy_data(c, in, out) < 0) {
+			perror(c->path);
+			(void)close(in);
+			(void)close(out);
+			return (-1);
+		}
+		(void)close(in);
+		c->bytes += (uint64_t)st->st_size;
+		return (out);
+	case S_IFLNK:
+		if ((len = readlink(src, target, sizeof(target) - 1)) < 0) {
+			perror(src);
+			return (-1);
+		}
+		target[len] = '\0';
+		if (symlink(target, c->path) < 0) {
+			perror(c->path);
+			return (-1);
+		}
+		return (-2);
+	default:
+		if (mknod(c->path, st->st_mode, st->st_rdev) < 0) {
+			perror(c->path);
+			return (-1);
+		}
+		return (-2);
+	}
+}
+
+/*
+ * Queues the copy at c->path, whose own inode is in st, for the ctime of
+ * the source
+ */
+static void
+queue(struct copier *c, const struct stat *st, const struct timespec *target)
+{
+	struct entry e;
+
+	if ((e.path = strdup(c->path)) == NULL) {
+		perror("strdup()");
+		c->nerrors++;
+		return;
+	}
+	e.target = *target;
+	e.mode = st->st_mode;
+	e.dev = st->st_dev;
+	e.ino = st->st_ino;
+	e.oldctime = st->st_ctim;
+	e.fd = -1;
+	e.error = 0;
+	e.tag = 0;
+		(void)fdcache_open(c->eng, &e);
+
+	ring_push(c->ring, &e);
+}
+
+/*
+ * Puts the path of the copy of p, from the tree at root copied to dst, in
+ * c->path.  Returns 0 on success, -1 on error
+ */
+static int
+dst_path(struct copier *c, const FTSENT *p, const char *root, const char *dst)
+{
+	const char *rel = p->fts_path + strlen(root);
+	size_t need;
+
+	while (*rel == '/')
+		rel++;
+	need = strlen(dst) + strlen(rel) + 2;
+	if (need > c->size) {
+		char *s;
+
+		if ((s = realloc(c->path, need)) == NULL) {
+			perror("realloc()");
+			return (-1);
+		}
+		c->path = s;
+		c->size = need;
+	}
+	if (*rel == '\0')
+		strcpy(c->path, dst);
+	else
+		(void)snprintf(c->path, c->size, "%s/%s", dst, rel);
+
+	return (0);
+}
+
+/*
+ * Copies the tree at root to dst, counting errors in c
+ */
+static void
+copy_tree(struct copier *c, char *root, const char *dst)
+{
+	char *roots[2] = { root, NULL };
+	struct stat st, dstroot;
+	struct link *l;
+	FTSENT *p;
+	FTS *fts;
+	char *s;
+	int fd;
+
+	memset(&dstroot, 0, sizeof(dstroot));
+	if ((fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL) {
+		perror("fts_open()");
+		c->nerrors++;
+		return;
+	}
+
+	for (;;) {
+		errno = 0;
+		if ((p = fts_read(fts)) == NULL) {
+			if (errno != 0) {
+				perror("fts_read()");
+				c->nerrors++;
+			}
+			break;
+		}
+
+		switch (p->fts_info) {
+		case FTS_DC:
+			fprintf(stderr, "%s: directory cycle\n", p->fts_path);
+			c->nerrors++;
+			continue;
+		case FTS_ERR:
+		case FTS_NS:
+			fprintf(stderr, "%s: %s\n", p->fts_path,
+			    strerror(p->fts_errno));
+			c->nerrors++;
+			continue;
+		default:
+			break;
+		}
+		if (dst_path(c, p, root, dst) < 0) {
+			c->nerrors++;
+			break;
+		}
+
+		switch (p->fts_info) {
+		case FTS_D:
+			/* Don't copy the copy into itself */
+			if (p->fts_level > 0 &&
+			    p->fts_statp->st_dev == dstroot.st_dev &&
+			    p->fts_statp->st_ino == dstroot.st_ino) {
+				p->fts_number = SKIPPED;
+				(void)fts_set(fts, p, FTS_SKIP);
+				continue;
+			}
+			/* Writable until its postorder visit */
+			if (mkdir(c->path, 0700) < 0 &&
+			    (errno != EEXIST || lstat(c->path, &st) < 0 ||
+			    !S_ISDIR(st.st_mode))) {
+				perror(c->path);
+				c->nerrors++;
+				p->fts_number = SKIPPED;
+				(void)fts_set(fts, p, FTS_SKIP);
+				continue;
+			}
+			if (p->fts_level == 0)
+				(void)lstat(c->path, &dstroot);
+			continue;
+		case FTS_DNR:
+			fprintf(stderr, "%s: %s\n", p->fts_path,
+			    strerror(p->fts_errno));
+			c->nerrors++;
+			/* FALLTHROUGH */
+		case FTS_DP:
+			if (p->fts_number == SKIPPED)
+				continue;
+			if (copy_attrs(c->path, -1, p->fts_statp) < 0 ||
+			    lstat(c->path, &st) < 0) {
+				perror(c->path);
+				c->nerrors++;
+				continue;
+			}
+			queue(c, &st, &p->fts_statp->st_ctim);
+			c->ncopied++;
+			continue;
+		default:
+			break;
+		}
+
+		if (p->fts_statp->st_nlink > 1) {
+			if ((l = link_find(c, p->fts_statp)) == NULL) {
+				c->nerrors++;
+				continue;
+			}
+			if (l->path != NULL) {
+				if (link(l->path, c->path) < 0) {
+					perror(c->path);
+					c->nerrors++;
+				} else
+					c->nlinked++;
+				continue;
+			}
+		} else
+			l = NULL;
+
+		if ((fd = copy_file(c, p->fts_path, p->fts_statp)) == -1) {
+			c->nerrors++;
+			continue;
+		}
+		if (copy_attrs(c->path, (fd >= 0) ? fd : -1, p->fts_statp) < 0 ||
+		    (fd >= 0 ? fstat(fd, &st) : lstat(c->path, &st)) < 0) {
+			perror(c->path);
+			c->nerrors++;
+			if (fd >= 0)
+				(void)close(fd);
+			continue;
+		}
+		if (fd >= 0)
+			(void)close(fd);
+		c->ncopied++;
+
+		if (l != NULL) {
+			/* Stamped by engine_run() once all its links are made */
+			if ((l->path = strdup(c->path)) == NULL ||
+			    (s = strdup(c->path)) == NULL) {
+				perror("strdup()");
+				c->nerrors++;
+				continue;
+			}
+			l->dev = p->fts_statp->st_dev;
+			l->ino = p->fts_statp->st_ino;
+			c->nlinks++;
+			/*
+			 * Added from this thread while the committer runs, which
+			 * is only safe as engine_commit() never touches
+			 * eng->entries or eng->nforeign: they are only used by
+			 * engine_run() once the copier is joined
+			 */
+			if (engine_add(c->eng, s, &p->fts_statp->st_ctim) < 0) {
+				free(s);
+				c->nerrors++;
+			}
+			continue;
+		}
+		queue(c, &st, &p->fts_statp->st_ctim);
+	}
+	(void)fts_close(fts);
+}
+
+static void *
+copy_thread(void *arg)
+{
+	struct copier *c = arg;
+	struct timespec start, end;
+	uint64_t t;
+	size_t i;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	trace_thread(c->eng, "copier");
+	t = trace_now(c->eng);
+
+	for (i = 0; c->srcs[i] != NULL; i++)
+		copy_tree(c, c->srcs[i], c->dsts[i]);
+	ring_close(c->ring);
+	trace_span(c->eng, "copy", t, c->ncopied);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	c->usecs = tsdiff_usec(&start, &end);
+
+	return (NULL);
+}
+
+/*
+ * Sets up the destination of each source: dst itself, or dst/name if dst
+ * is a directory, which it must be for several sources.
+ * Returns 0 on success, -1 on error
+ */
+static int
+copy_dsts(struct copier *c, char **srcs, int nsrcs, const char *dst)
+{
+	struct stat st;
+	const char *name;
+	size_t len;
+	int i, isdir;
+
+	isdir = (stat(dst, &st) == 0 && S_ISDIR(st.st_mode));
+	if (nsrcs > 1 && !isdir) {
+		fprintf(stderr, "%s: %s\n", dst, strerror(ENOTDIR));
+		return (-1);
+	}
+	if ((c->dsts = calloc((size_t)nsrcs + 1, sizeof(*c->dsts))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	for (i = 0; i < nsrcs; i++) {
+		if (!isdir) {
+			c->dsts[i] = strdup(dst);
+		} else {
+			/* The last component of the source, like cp(1) */
+			len = strlen(srcs[i]);
+			while (len > 1 && srcs[i][len - 1] == '/')
+				len--;
+			for (name = srcs[i] + len; name > srcs[i] && name[-1] != '/';
+			    name--)
+				;
+			if (asprintf(&c->dsts[i], "%s/%.*s", dst,
+			    (int)(srcs[i] + len - name), name) < 0)
+				c->dsts[i] = NULL;
+		}
+		if (c->dsts[i] == NULL) {
+			perror("strdup()");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+static void
+copier_free(struct copier *c)
+{
+	size_t i;
+
+	for (i = 0; c->dsts != NULL && c->dsts[i] != NULL; i++)
+		free(c->dsts[i]);
+	free(c->dsts);
+	for (i = 0; i < c->nslots; i++)
+		free(c->links[i].path);
+	free(c->links);
+	free(c->path);
+	free(c->buf);
+}
+
+/*
+ * Copies the sources to dst, stamping the copies with the ctimes of the
+ * sources as they are made.
+ * Returns 0 on success, -1 if any file could not be copied or stamped
+ */
+int
+copy_run(struct engine *eng, char **srcs, int nsrcs, const char *dst)
+{
+	struct timespec start, end;
+	struct copier c;
+	struct ring ring;
+	struct entry *batch;
+	sigset_t oldmask;
+	size_t i, n;
+	int failed = 0, error, status;
+	uint64_t t;
+
+	memset(&c, 0, sizeof(c));
+	if (copy_dsts(&c, srcs, nsrcs, dst) < 0) {
+		copier_free(&c);
+		return (-1);
+	}
+	/* The list of sources ends where the destination is */
+	srcs[nsrcs] = NULL;
+	c.srcs = srcs;
+	c.ring = &ring;
+	c.eng = eng;
+	if ((c.buf = malloc(COPY_BUFSIZE)) == NULL ||
+	    (batch = malloc(BATCH_SIZE * sizeof(*batch))) == NULL) {
+		perror("malloc()");
+		copier_free(&c);
+		return (-1);
+	}
+	if (ring_init(&ring, RING_SIZE) < 0) {
+		free(batch);
+		copier_free(&c);
+		return (-1);
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Signals only go to the committer, like for the walker */
+	if (block_signals(&oldmask) < 0) {
+		ring_free(&ring);
+		free(batch);
+		copier_free(&c);
+		return (-1);
+	}
+	error = pthread_create(&c.thread, NULL, copy_thread, &c);
+	(void)unblock_signals(&oldmask);
+	if (error != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+		ring_free(&ring);
+		free(batch);
+		copier_free(&c);
+		return (-1);
+	}
+
+	for (;;) {
+		t = trace_now(eng);
+		if ((n = ring_pop(&ring, batch, BATCH_SIZE)) == 0)
+			break;
+		trace_span(eng, "wait", t, n);
+		trace_counter(eng, "queue", ring_count(&ring));
+		/* Keep draining after a failure so the copier can finish */
+		if (!failed && engine_commit(eng, batch, n) < 0)
+			failed = 1;
+		else if (failed)
+			eng->nerrors += n;
+		for (i = 0; i < n; i++) {
+			fdcache_close(eng, &batch[i]);
+			free(batch[i].path);
+		}
+	}
+	(void)pthread_join(c.thread, NULL);
+	eng->nerrors += c.nerrors;
+
+	/* The held back files with several links, then the final sync */
+	status = engine_run(eng);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	if (eng->verbose)
+		fprintf(stderr, "touch2: copied %zu files (%.1f MiB) & %zu links "
+		    "in %.3fs, total %.3fs\n", c.ncopied, c.bytes / 1048576.0,
+		    c.nlinked, c.usecs / 1e6,
+		    ((end.tv_sec - start.tv_sec) * 1000000L +
+		    (end.tv_nsec - start.tv_nsec) / 1000) / 1e6);
+
+	ring_free(&ring);
+	free(batch);
+	copier_free(&c);
+
+	return ((status < 0 || failed) ? -1 : 0);
+}
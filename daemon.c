@@ -0,0 +1,984 @@
+/*
+ * Daemon
+ *
+ * DETAILS:
+ *   Serves local clients that stamp files at a high rate, like build
+ *   systems.  Every client gets its own pair of rings in shared memory: it
+ *   queues (file index, ctime) submissions on one and the daemon posts the
+ *   results on the other, so that no system call is made per file.  The
+ *   daemon drains the submission rings of all the clients into one batch,
+ *   commits it window by window like any other run, and signals each
+ *   client's completion eventfd once per batch.  While it has nothing to
+ *   do it sets SHM_NEED_WAKEUP and sleeps in epoll_wait(2), and only then
+ *   do clients signal its eventfd.
+ *
+ *   Clients are served by deficit round robin: every round each client
+ *   with submissions may add up to DRR_QUANTUM times its weight to the
+ *   batch, so a bulk job can't starve a client stamping a few files.  A
+ *   round is sized from the measured cost of an entry to last about
+ *   ROUND_USECS, which bounds how long a new submission waits.  The time
+ *   the clock spent stepped is charged to the clients by their share of
+ *   each batch, and their counters are kept in their shared memory &
+ *   printed on SIGUSR1.
+ *
+ *   Files are registered by passing their descriptors on the socket.  A
+ *   file may only be stamped by its owner or by root, as told by the
+ *   client's credentials.
+ *
+ *   The serving is done by a struct server, which the leader of the host's
+ *   runs also uses between its chains to stamp the files of the other runs
+ *   (see host.c).
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_EVENTS	64
+
+/* Sockets a server listens on: its own & the host's */
+#define SERVER_MAX_SOCKETS 2
+
+/* Most files a client may register */
+#define MAX_FILES	(1 << 20)
+
+/* Entries per unit of weight a client may add to a round */
+#define DRR_QUANTUM	64
+
+/* How long a round should take */
+#define ROUND_USECS	500
+
+struct client {
+	unsigned	 id;
+	pid_t		 pid;
+	int		 sock;
+	int		 sqfd;		/* signaled by the client */
+	int		 cqfd;		/* signaled by the daemon */
+	uid_t		 uid;
+	struct shm_rings *rings;
+	size_t		 size;
+	struct shm_sqe	*sqes;		/* SHM_SQ_ENTRIES, in rings */
+	struct shm_cqe	*cqes;		/* SHM_CQ_ENTRIES, in rings */
+	uint32_t	 cq_tail;	/* completions posted, not published */
+	uint32_t	 sq_tail;	/* submissions seen this round */
+	unsigned	 weight;
+	size_t		 deficit;	/* entries it may still add */
+	size_t		 nbatched;	/* entries in the current batch */
+	/* Registered files */
+	int		*fds;
+	char		**names;	/* for messages */
+	size_t		 nfiles;
+	int		 dead;
+	struct client	*next;
+};
+
+/* The client & user data of each entry of a batch, by entry tag */
+struct request {
+	struct client	*client;
+	uint64_t	 user_data;
+	uint64_t	 submitted;
+};
+
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t dump;
+
+static void
+on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		dump = 1;
+	else
+		quit = 1;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Returns the upper bound in usecs of a latency histogram bucket
+ */
+static uint64_t
+bucket_usecs(int b)
+{
+	return ((uint64_t)1 << b);
+}
+
+/*
+ * Returns the smallest bucket bound under which fraction q of the
+ * latencies are
+ */
+static uint64_t
+quantile_usecs(const struct shm_stats *st, double q)
+{
+	uint64_t n = st->completed + st->failed, seen = 0;
+	int b;
+
+	for (b = 0; b < SHM_LATENCY_BUCKETS; b++) {
+		seen += st->latency[b];
+		if (seen >= q * n)
+			break;
+	}
+
+	return (bucket_usecs((b < SHM_LATENCY_BUCKETS) ? b : b - 1));
+}
+
+static void
+client_print(const struct client *c)
+{
+	const struct shm_stats *st = &c->rings->stats;
+	uint64_t n = st->completed + st->failed;
+
+	fprintf(stderr, "touch2: client %u (pid %ld, uid %ld, weight %u): "
+	    "%ju done, %ju failed, stepped %.3fs, latency avg %.0fus "
+	    "p99 <%juus max %.0fus\n", c->id, (long)c->pid, (long)c->uid,
+	    c->weight, (uintmax_t)st->completed, (uintmax_t)st->failed,
+	    st->stepped_ns / 1e9, n ? st->latency_ns / 1e3 / n : 0.0,
+	    (uintmax_t)quantile_usecs(st, 0.99), st->latency_max_ns / 1e3);
+}
+
+static void
+client_free(struct client *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nfiles; i++) {
+		if (c->fds[i] >= 0)
+			(void)close(c->fds[i]);
+		free(c->names[i]);
+	}
+	free(c->fds);
+	free(c->names);
+	if (c->rings != NULL)
+		(void)munmap(c->rings, c->size);
+	if (c->sqfd >= 0)
+		(void)close(c->sqfd);
+	if (c->cqfd >= 0)
+		(void)close(c->cqfd);
+	(void)close(c->sock);
+	free(c);
+}
+
+/*
+ * Sends the hello with the descriptors.  Returns 0 on success, -1 on error
+ */
+static int
+send_hello(struct client *c, int memfd)
+{
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	struct shm_hello hello;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[3];
+
+	memset(&hello, 0, sizeof(hello));
+	memcpy(hello.magic, SHM_MAGIC, sizeof(hello.magic));
+	hello.version = SHM_VERSION;
+	hello.sq_entries = SHM_SQ_ENTRIES;
+	hello.cq_entries = SHM_CQ_ENTRIES;
+	hello.size = (uint32_t)c->size;
+
+	fds[0] = memfd;
+	fds[1] = c->sqfd;
+	fds[2] = c->cqfd;
+
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	cmsg.hdr.cmsg_level = SOL_SOCKET;
+	cmsg.hdr.cmsg_type = SCM_RIGHTS;
+	cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(&cmsg.hdr), fds, sizeof(fds));
+
+	if (sendmsg(c->sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+		perror("sendmsg()");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Accepts a client & sets up its rings.  Returns it, or NULL
+ */
+static struct client *
+client_accept(int lsock, int epfd)
+{
+	struct epoll_event ev;
+	struct client *c;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int sock, memfd;
+
+	if ((sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("accept()");
+		return (NULL);
+	}
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		perror("calloc()");
+		(void)close(sock);
+		return (NULL);
+	}
+	c->sock = sock;
+	c->sqfd = c->cqfd = -1;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		perror("getsockopt()");
+		goto fail;
+	}
+	c->uid = cred.uid;
+	c->pid = cred.pid;
+	c->weight = 1;
+
+	c->size = SHM_SIZE(SHM_SQ_ENTRIES, SHM_CQ_ENTRIES);
+	if ((memfd = memfd_create("touch2", MFD_CLOEXEC)) < 0) {
+		perror("memfd_create()");
+		goto fail;
+	}
+	if (ftruncate(memfd, (off_t)c->size) < 0) {
+		perror("ftruncate()");
+		(void)close(memfd);
+		goto fail;
+	}
+	c->rings = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    memfd, 0);
+	if (c->rings == MAP_FAILED) {
+		perror("mmap()");
+		c->rings = NULL;
+		(void)close(memfd);
+		goto fail;
+	}
+	memcpy(c->rings->magic, SHM_MAGIC, sizeof(c->rings->magic));
+	c->rings->version = SHM_VERSION;
+	c->rings->sq_entries = SHM_SQ_ENTRIES;
+	c->rings->cq_entries = SHM_CQ_ENTRIES;
+	c->sqes = SHM_SQES(c->rings);
+	c->cqes = SHM_CQES(c->rings, SHM_SQ_ENTRIES);
+
+	if ((c->sqfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+	    (c->cqfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		perror("eventfd()");
+		(void)close(memfd);
+		goto fail;
+	}
+	if (send_hello(c, memfd) < 0) {
+		(void)close(memfd);
+		goto fail;
+	}
+	(void)close(memfd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev) < 0 ||
+	    epoll_ctl(epfd, EPOLL_CTL_ADD, c->sqfd, &ev) < 0) {
+		perror("epoll_ctl()");
+		goto fail;
+	}
+
+	return (c);
+
+fail:
+	client_free(c);
+	return (NULL);
+}
+
+/*
+ * Stores the descriptors of a shm_register.  Returns 0 on success, -1 on
+ * a protocol error
+ */
+static int
+client_register(struct client *c, const struct shm_register *reg,
+    const int *fds, size_t nfds)
+{
+	char link[64], name[4096];
+	size_t i, size;
+	ssize_t len;
+
+	if (reg->count != nfds || reg->index > MAX_FILES - nfds)
+		return (-1);
+
+	if (reg->index + nfds > c->nfiles) {
+		int *v;
+		char **names;
+
+		size = reg->index + nfds;
+		if ((v = realloc(c->fds, size * sizeof(*v))) == NULL)
+			return (-1);
+		c->fds = v;
+		if ((names = realloc(c->names, size * sizeof(*names))) == NULL)
+			return (-1);
+		c->names = names;
+		for (i = c->nfiles; i < size; i++) {
+			c->fds[i] = -1;
+			c->names[i] = NULL;
+		}
+		c->nfiles = size;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		size_t k = reg->index + i;
+
+		if (c->fds[k] >= 0)
+			(void)close(c->fds[k]);
+		free(c->names[k]);
+		c->fds[k] = fds[i];
+
+		(void)snprintf(link, sizeof(link), "/proc/self/fd/%d", fds[i]);
+		if ((len = readlink(link, name, sizeof(name) - 1)) < 0)
+			len = snprintf(name, sizeof(name), "fd %d", fds[i]);
+		name[len] = '\0';
+		c->names[k] = strdup(name);
+		if (c->names[k] == NULL)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Reads the pending messages of a client.  Marks it dead when it's gone
+ */
+static void
+client_recv(struct client *c)
+{
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(SHM_MAX_FDS * sizeof(int))];
+	} cmsg;
+	struct shm_register reg;
+	struct cmsghdr *h;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[SHM_MAX_FDS];
+	size_t nfds, i;
+	ssize_t r;
+
+	while (!c->dead) {
+		iov.iov_base = &reg;
+		iov.iov_len = sizeof(reg);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+
+		if ((r = recvmsg(c->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->dead = 1;
+			return;
+		}
+		if (r == 0) {
+			c->dead = 1;
+			return;
+		}
+
+		nfds = 0;
+		for (h = CMSG_FIRSTHDR(&msg); h != NULL; h = CMSG_NXTHDR(&msg, h)) {
+			if (h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS)
+				continue;
+			i = (h->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (nfds + i > SHM_MAX_FDS)
+				i = SHM_MAX_FDS - nfds;
+			memcpy(fds + nfds, CMSG_DATA(h), i * sizeof(int));
+			nfds += i;
+		}
+
+		if (r != (ssize_t)sizeof(reg) || (msg.msg_flags & MSG_CTRUNC) ||
+		    client_register(c, &reg, fds, nfds) < 0) {
+			fprintf(stderr, "touch2: dropping a client: bad message\n");
+			for (i = 0; i < nfds; i++)
+				if (reg.index + i >= c->nfiles ||
+				    c->fds[reg.index + i] != fds[i])
+					(void)close(fds[i]);
+			c->dead = 1;
+		}
+	}
+}
+
+/*
+ * Posts a completion, published by client_flush(), & accounts for it
+ */
+static void
+client_post(struct client *c, uint64_t user_data, int res, uint64_t submitted,
+    uint64_t now)
+{
+	struct shm_stats *st = &c->rings->stats;
+	struct shm_cqe *cqe;
+
+	cqe = &c->cqes[c->cq_tail & (SHM_CQ_ENTRIES - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	cqe->pad = 0;
+	c->cq_tail++;
+
+	if (res < 0)
+		st->failed++;
+	else
+		st->completed++;
+	if (submitted != 0 && submitted <= now) {
+		uint64_t ns = now - submitted, usecs = ns / 1000;
+		int b = 0;
+
+		while (b < SHM_LATENCY_BUCKETS - 1 && bucket_usecs(b) <= usecs)
+			b++;
+		st->latency[b]++;
+		st->latency_ns += ns;
+		if (ns > st->latency_max_ns)
+			st->latency_max_ns = ns;
+	}
+}
+
+static void
+client_flush(struct client *c)
+{
+	uint64_t one = 1;
+
+	if (c->cq_tail == atomic_load_explicit(&c->rings->cq_tail,
+	    memory_order_relaxed))
+		return;
+	atomic_store_explicit(&c->rings->cq_tail, c->cq_tail,
+	    memory_order_release);
+	if (write(c->cqfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write(eventfd)");
+}
+
+/*
+ * Notes the submissions of a client & reads its registrations, which were
+ * sent before the submissions using them
+ */
+static void
+client_poll(struct client *c)
+{
+	uint32_t w;
+
+	c->sq_tail = atomic_load_explicit(&c->rings->sq_tail,
+	    memory_order_acquire);
+	client_recv(c);
+
+	w = c->rings->weight;
+	if (w < 1 || c->uid != 0)
+		w = 1;
+	c->weight = (w > SHM_MAX_WEIGHT) ? SHM_MAX_WEIGHT : w;
+}
+
+/*
+ * Moves up to max - n of the submissions noted by client_poll() into v.
+ * Returns the new n
+ */
+static size_t
+client_drain(struct client *c, struct entry *v, struct request *req,
+    size_t n, size_t max)
+{
+	struct shm_rings *r = c->rings;
+	uint32_t head, room;
+	uint64_t now = 0;
+	struct stat st;
+
+	head = atomic_load_explicit(&r->sq_head, memory_order_relaxed);
+	/* A bogus cq_head only costs the client its own completions */
+	room = c->cq_tail - atomic_load_explicit(&r->cq_head,
+	    memory_order_acquire);
+	room = (room > SHM_CQ_ENTRIES) ? 0 : SHM_CQ_ENTRIES - room;
+
+	for (; head != c->sq_tail && n < max && room > 0; head++, room--) {
+		struct shm_sqe sqe = c->sqes[head & (SHM_SQ_ENTRIES - 1)];
+		struct entry *e = &v[n];
+		int fd, error = 0;
+
+		if (sqe.index >= c->nfiles || (fd = c->fds[sqe.index]) < 0)
+			error = EBADF;
+		else if (sqe.nsec >= 1000000000U)
+			error = EINVAL;
+		else if (fstat(fd, &st) < 0)
+			error = errno;
+		else if (c->uid != 0 && st.st_uid != c->uid)
+			error = EPERM;
+		if (error != 0) {
+			if (now == 0)
+				now = now_ns();
+			client_post(c, sqe.user_data, -error, sqe.submitted, now);
+			continue;
+		}
+
+		e->path = c->names[sqe.index];
+		e->target.tv_sec = (time_t)sqe.sec;
+		e->target.tv_nsec = (long)sqe.nsec;
+		e->mode = st.st_mode;
+		e->dev = st.st_dev;
+		e->ino = st.st_ino;
+		e->oldctime = st.st_ctim;
+		e->fd = fd;
+		e->error = 0;
+		e->tag = n;
+		req[n].client = c;
+		req[n].user_data = sqe.user_data;
+		req[n].submitted = sqe.submitted;
+		c->nbatched++;
+		n++;
+	}
+	atomic_store_explicit(&r->sq_head, head, memory_order_release);
+
+	return (n);
+}
+
+/*
+ * Fills a batch of up to max entries by deficit round robin, starting
+ * with *next.  Returns the number of entries
+ */
+static size_t
+fill_batch(struct client *clients, struct client **next, struct entry *v,
+    struct request *req, size_t max)
+{
+	struct client *c, *first;
+	size_t n = 0, before;
+	int progress;
+
+	for (c = clients; c != NULL; c = c->next) {
+		client_poll(c);
+		c->nbatched = 0;
+	}
+	if (clients == NULL)
+		return (0);
+
+	first = (*next != NULL) ? *next : clients;
+	do {
+		progress = 0;
+		c = first;
+		do {
+			if (c->dead ||
+			    atomic_load_explicit(&c->rings->sq_head,
+			    memory_order_relaxed) == c->sq_tail) {
+				/* Idle clients don't save up */
+				c->deficit = 0;
+			} else {
+				if (c->deficit == 0)
+					c->deficit = (size_t)DRR_QUANTUM * c->weight;
+				before = n;
+				n = client_drain(c, v, req, n,
+				    (n + c->deficit < max) ? n + c->deficit : max);
+				c->deficit -= n - before;
+				if (n > before)
+					progress = 1;
+			}
+			if ((c = c->next) == NULL)
+				c = clients;
+			if (n == max) {
+				/* Whoever is next starts the next round */
+				*next = c;
+				return (n);
+			}
+		} while (c != first);
+	} while (progress && n < max);
+	*next = NULL;
+
+	return (n);
+}
+
+/*
+ * Returns whether a client has submissions not taken yet
+ */
+static int
+client_pending(const struct client *c)
+{
+	return (atomic_load(&c->rings->sq_tail) !=
+	    atomic_load_explicit(&c->rings->sq_head, memory_order_relaxed));
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int sock;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+		return (-1);
+	}
+	strcpy(sun.sun_path, path);
+
+	/* A socket left behind by a previous daemon */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		(void)unlink(path);
+
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC |
+	    SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket()");
+		return (-1);
+	}
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(sock, SOMAXCONN) < 0) {
+		perror(path);
+		(void)close(sock);
+		return (-1);
+	}
+
+	return (sock);
+}
+
+/* A set of clients & the sockets they connect to */
+struct server {
+	int		 lsocks[SERVER_MAX_SOCKETS];
+	char		*paths[SERVER_MAX_SOCKETS];
+	size_t		 nsocks;
+	int		 epfd;
+	struct client	*clients;
+	struct client	*next;		/* first of the next round */
+	unsigned	 nclients;	/* ever accepted */
+	struct entry	*v;
+	struct request	*req;
+	size_t		 max;		/* entries per round */
+	double		 cost;		/* nsecs per entry, averaged */
+	int		 busy;		/* in server_round() */
+};
+
+/*
+ * Returns a server with no socket yet, or NULL on error
+ */
+struct server *
+server_new(void)
+{
+	struct server *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		perror("calloc()");
+		return (NULL);
+	}
+	s->max = BATCH_SIZE;
+	s->v = malloc(BATCH_SIZE * sizeof(*s->v));
+	s->req = malloc(BATCH_SIZE * sizeof(*s->req));
+	if (s->v == NULL || s->req == NULL) {
+		perror("malloc()");
+		free(s->v);
+		free(s->req);
+		free(s);
+		return (NULL);
+	}
+	if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1()");
+		free(s->v);
+		free(s->req);
+		free(s);
+		return (NULL);
+	}
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	return (s);
+}
+
+/*
+ * Accepts clients on the socket at path too.  Returns 0 on success, -1 on
+ * error
+ */
+int
+server_listen(struct server *s, const char *path)
+{
+	struct epoll_event ev;
+	int lsock;
+
+	if (s->nsocks == SERVER_MAX_SOCKETS) {
+		fprintf(stderr, "%s: %s\n", path, strerror(EMFILE));
+		return (-1);
+	}
+	if ((lsock = listen_on(path)) < 0)
+		return (-1);
+	ev.events = EPOLLIN;
+	/* Listening sockets are told apart from clients by their index */
+	ev.data.u64 = s->nsocks;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, lsock, &ev) < 0 ||
+	    (s->paths[s->nsocks] = strdup(path)) == NULL) {
+		perror(path);
+		(void)close(lsock);
+		(void)unlink(path);
+		return (-1);
+	}
+	s->lsocks[s->nsocks++] = lsock;
+
+	return (0);
+}
+
+/*
+ * Stops accepting clients, removing the sockets
+ */
+void
+server_unlisten(struct server *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->nsocks; i++) {
+		(void)close(s->lsocks[i]);
+		(void)unlink(s->paths[i]);
+		free(s->paths[i]);
+	}
+	s->nsocks = 0;
+}
+
+/*
+ * Returns whether a client has submissions not answered yet
+ */
+int
+server_pending(const struct server *s)
+{
+	const struct client *c;
+
+	for (c = s->clients; c != NULL; c = c->next)
+		if (!c->dead && (client_pending(c) || c->cq_tail !=
+		    atomic_load_explicit(&c->rings->cq_tail, memory_order_relaxed)))
+			return (1);
+
+	return (0);
+}
+
+/*
+ * Returns the number of clients ever accepted
+ */
+unsigned
+server_clients(const struct server *s)
+{
+	return (s->nclients);
+}
+
+/*
+ * Prints the counters of the clients
+ */
+void
+server_print(const struct server *s)
+{
+	const struct client *c;
+
+	for (c = s->clients; c != NULL; c = c->next)
+		client_print(c);
+}
+
+/*
+ * Commits a round of what the clients queued, by their weights, then takes
+ * in new clients & messages, sleeping first if there's nothing to do &
+ * wait is set.  Calls from within a round do nothing.
+ * Returns the number of entries committed, or -1 on error
+ */
+int
+server_round(struct server *s, struct engine *eng, int wait)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct client *c, **cp;
+	struct entry *v = s->v;
+	size_t n, i;
+	int nev, k, borrowed;
+	uint64_t count, start, now;
+	long stepped;
+
+	if (s->busy)
+		return (0);
+	s->busy = 1;
+
+	/* Descriptors are registered by the clients, not cached */
+	borrowed = eng->borrowed_fds;
+	eng->borrowed_fds = 1;
+
+	/* Take what the clients queued, by their weights */
+	n = fill_batch(s->clients, &s->next, v, s->req, s->max);
+
+	if (n > 0) {
+		start = now_ns();
+		stepped = eng->stepped_usecs;
+		(void)engine_commit(eng, v, n);
+		now = now_ns();
+
+		/* Keep rounds short enough for new submissions */
+		s->cost = (s->cost == 0) ? (double)(now - start) / n :
+		    0.8 * s->cost + 0.2 * (double)(now - start) / n;
+		s->max = (size_t)(ROUND_USECS * 1000.0 / s->cost);
+		if (s->max < DRR_QUANTUM)
+			s->max = DRR_QUANTUM;
+		else if (s->max > BATCH_SIZE)
+			s->max = BATCH_SIZE;
+
+		/* Charge the skew by share of the batch */
+		stepped = eng->stepped_usecs - stepped;
+		for (c = s->clients; c != NULL; c = c->next)
+			if (c->nbatched > 0)
+				c->rings->stats.stepped_ns +=
+				    (uint64_t)stepped * 1000 * c->nbatched / n;
+
+		for (i = 0; i < n; i++) {
+			struct request *r = &s->req[v[i].tag];
+
+			client_post(r->client, r->user_data, -v[i].error,
+			    r->submitted, now);
+		}
+	}
+	eng->borrowed_fds = borrowed;
+	for (c = s->clients; c != NULL; c = c->next)
+		client_flush(c);
+
+	/* Sleep if there's nothing left, telling the clients */
+	k = 0;
+	if (n == 0 && wait) {
+		for (c = s->clients; c != NULL; c = c->next)
+			(void)atomic_fetch_or(&c->rings->flags,
+			    SHM_NEED_WAKEUP);
+		k = -1;
+		for (c = s->clients; c != NULL; c = c->next)
+			if (client_pending(c))
+				k = 0;
+	}
+	nev = epoll_wait(s->epfd, events, MAX_EVENTS, k);
+	for (c = s->clients; c != NULL; c = c->next)
+		(void)atomic_fetch_and(&c->rings->flags, ~SHM_NEED_WAKEUP);
+	if (nev < 0) {
+		s->busy = 0;
+		if (errno == EINTR)
+			return ((int)n);
+		perror("epoll_wait()");
+		return (-1);
+	}
+
+	for (k = 0; k < nev; k++) {
+		if (events[k].data.u64 < SERVER_MAX_SOCKETS) {
+			if (events[k].data.u64 < s->nsocks &&
+			    (c = client_accept(s->lsocks[events[k].data.u64],
+			    s->epfd)) != NULL) {
+				c->id = ++s->nclients;
+				c->next = s->clients;
+				s->clients = c;
+			}
+			continue;
+		}
+		c = events[k].data.ptr;
+		/* Submissions are picked up by the next round anyway */
+		(void)read(c->sqfd, &count, sizeof(count));
+		client_recv(c);
+	}
+
+	for (cp = &s->clients; (c = *cp) != NULL;) {
+		if (c->dead) {
+			if (eng->verbose)
+				client_print(c);
+			if (s->next == c)
+				s->next = c->next;
+			*cp = c->next;
+			client_free(c);
+		} else
+			cp = &c->next;
+	}
+	s->busy = 0;
+
+	return ((int)n);
+}
+
+void
+server_free(struct server *s)
+{
+	struct client *c;
+
+	if (s == NULL)
+		return;
+	server_unlisten(s);
+	while ((c = s->clients) != NULL) {
+		s->clients = c->next;
+		client_free(c);
+	}
+	(void)close(s->epfd);
+	free(s->v);
+	free(s->req);
+	free(s);
+}
+
+/*
+ * Serves clients on the socket at path until SIGINT or SIGTERM, printing
+ * their counters on SIGUSR1.  Returns 0 on success, -1 on error
+ */
+int
+daemon_run(struct engine *eng, const char *path)
+{
+	struct server *s, *own = NULL;
+	struct sigaction sa;
+	int status = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	(void)sigemptyset(&sa.sa_mask);
+	/* No SA_RESTART, so that epoll_wait(2) returns */
+	if (sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0 ||
+	    sigaction(SIGUSR1, &sa, NULL) < 0) {
+		perror("sigaction()");
+		return (-1);
+	}
+
+	/* Other runs on the host hand their files to the daemon too */
+	if ((s = host_server(eng)) == NULL && (s = own = server_new()) == NULL)
+		return (-1);
+	if (server_listen(s, path) < 0) {
+		server_free(own);
+		return (-1);
+	}
+
+	while (!quit) {
+		if (dump) {
+			dump = 0;
+			server_print(s);
+		}
+		if (server_round(s, eng, 1) < 0) {
+			status = -1;
+			break;
+		}
+	}
+
+	if (eng->durable && durable_sync(eng, 1) < 0)
+		status = -1;
+	if (eng->verbose)
+		engine_stats(eng);
+	server_free(own);
+
+	return (status);
+}
+
+#else /* !__linux__ */
+
+int
+daemon_run(struct engine *eng, const char *path)
+{
+	(void)eng;
+	fprintf(stderr, "%s: the daemon needs Linux\n", path);
+	return (-1);
+}
+
+#endif /* __linux__ */
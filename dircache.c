@@ -0,0 +1,641 @@
+/*
+ * Directory change cache
+ *
+ * DETAILS:
+ *   --cache keeps, for every directory of a successful tree run, its
+ *   device & inode number, mtime, the ctime it was left with, how many
+ *   files were stamped in it & which of its subdirectories have records.
+ *   The next run maps the cache & skips a directory without reading it
+ *   when it & every directory below it are still as recorded: any file
+ *   created, removed or renamed changes the mtime of its directory, & a
+ *   chmod, chown or rename of a directory changes its ctime.  As the
+ *   mtime of a directory doesn't change with its subdirectories, a
+ *   subtree is only skipped once all the directories in it have been
+ *   checked, with one lstat(2) each, which is still far fewer calls than
+ *   reading them & stat'ing their files.  Files written in place are not
+ *   noticed.  The records of skipped subtrees are carried over, & the new
+ *   cache replaces the old one only if the run had no error.
+ *
+ *   The file is a header, an open addressing hash table of record
+ *   numbers by (device, inode), the records, children first, & a pool
+ *   of (record number, name) pairs for the subdirectories of each record,
+ *   in host byte order like the undo log.  A cache made with other
+ *   targets, filters or shards is ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#define DIRCACHE_MAGIC	"touch2d\n"
+#define DIRCACHE_VERSION 1
+#define DIRCACHE_BOM	0x01020304	/* written in host byte order */
+
+/* Leeway on the ctime of a stamped directory, a clock tick at HZ=100 */
+#define DIRCACHE_SLACK	10000000L
+
+struct dircache_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 bom;
+	uint64_t	 key;		/* of the options */
+	uint32_t	 nrecords;
+	uint32_t	 nslots;	/* a power of 2 */
+	uint64_t	 poolsize;
+	/* uint32_t slots[nslots], record number + 1 or 0, padded to 8 bytes */
+	/* struct dircache_record records[nrecords] */
+	/* char pool[poolsize] */
+};
+
+struct dircache_record {
+	uint64_t	 dev;
+	uint64_t	 ino;
+	int64_t		 mtime;
+	int64_t		 ctime;
+	int32_t		 mtime_nsec;
+	int32_t		 ctime_nsec;	/* as left by the run */
+	uint32_t	 nfiles;	/* non-directories stamped in it */
+	uint32_t	 nsubdirs;
+	uint64_t	 subdirs;	/* offset of (uint32_t, name) pairs */
+};
+
+/* A directory being walked, hung on its FTSENT */
+struct dirstate {
+	struct timespec	 ctime;		/* its target if it's stamped */
+	uint32_t	 nfiles;
+	uint32_t	 nsubdirs;
+	char		*subdirs;	/* (uint32_t, name) pairs */
+	size_t		 len;
+	size_t		 size;
+};
+
+/* Results of checking the subtree of a record of the old cache */
+#define UNCHECKED	0
+#define UNCHANGED	1
+#define CHANGED		2
+
+struct dircache {
+	const char	*file;
+	uint64_t	 key;
+	long		 slack;		/* nsecs */
+	int		 failed;
+	/* The old cache, mapped, if any */
+	void		*map;
+	size_t		 maplen;
+	const uint32_t	*slots;
+	uint32_t	 nslots;
+	const struct dircache_record *records;
+	uint32_t	 nrecords;
+	const char	*pool;
+	size_t		 poolsize;
+	unsigned char	*checked;	/* by record */
+	/* The new cache */
+	struct dircache_record *v;
+	size_t		 n;
+	size_t		 size;
+	char		*newpool;
+	size_t		 newlen;
+	size_t		 newsize;
+	/* lstat(2) path of the subtrees being checked */
+	char		 path[PATH_MAX];
+	/* Statistics */
+	size_t		 nunchanged;	/* directories skipped */
+	size_t		 nfiles;	/* files in them */
+	size_t		 nchecked;	/* directories checked */
+};
+
+/*
+ * Adds s[0, len) to the FNV-1a hash h, which starts at DIRCACHE_SEED
+ */
+uint64_t
+dircache_hash(uint64_t h, const void *s, size_t len)
+{
+	const unsigned char *p = s;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	return (h);
+}
+
+static size_t
+slot_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = ino ^ (dev << 32 | dev >> 32);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return ((size_t)h);
+}
+
+/*
+ * Appends len bytes to the buffer *buf of *size bytes holding *n.
+ * Returns 0 on success, -1 on error
+ */
+static int
+append(char **buf, size_t *n, size_t *size, const void *p, size_t len)
+{
+	char *v;
+	size_t want;
+
+	if (*n + len > *size) {
+		for (want = *size ? *size * 2 : 4096; want < *n + len; want *= 2)
+			;
+		if ((v = realloc(*buf, want)) == NULL)
+			return (-1);
+		*buf = v;
+		*size = want;
+	}
+	memcpy(*buf + *n, p, len);
+	*n += len;
+
+	return (0);
+}
+
+/*
+ * Maps the old cache, if it's for the same options.  Returns 0 on success,
+ * -1 on error
+ */
+static int
+map_old(struct dircache *c, int verbose)
+{
+	const struct dircache_header *h;
+	struct stat st;
+	size_t off, len;
+	int fd;
+
+	if ((fd = open(c->file, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			return (0);
+		perror(c->file);
+		return (-1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(c->file);
+		(void)close(fd);
+		return (-1);
+	}
+	if ((size_t)st.st_size < sizeof(*h))
+		goto bad;
+	c->maplen = (size_t)st.st_size;
+	c->map = mmap(NULL, c->maplen, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	fd = -1;
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		perror(c->file);
+		return (-1);
+	}
+
+	h = c->map;
+	if (memcmp(h->magic, DIRCACHE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != DIRCACHE_VERSION || h->bom != DIRCACHE_BOM ||
+	    h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0 ||
+	    h->nslots < h->nrecords)
+		goto bad;
+	off = (sizeof(*h) + (size_t)h->nslots * sizeof(uint32_t) + 7) & ~(size_t)7;
+	len = (size_t)h->nrecords * sizeof(struct dircache_record);
+	if (off + len > c->maplen || h->poolsize != c->maplen - off - len)
+		goto bad;
+	if (h->key != c->key) {
+		if (verbose)
+			fprintf(stderr, "touch2: %s was made with other options, "
+			    "starting afresh\n", c->file);
+		(void)munmap(c->map, c->maplen);
+		c->map = NULL;
+		return (0);
+	}
+
+	c->slots = (const uint32_t *)(h + 1);
+	c->nslots = h->nslots;
+	c->records = (const struct dircache_record *)((char *)c->map + off);
+	c->nrecords = h->nrecords;
+	c->pool = (const char *)c->records + len;
+	c->poolsize = (size_t)h->poolsize;
+	if ((c->checked = calloc(c->nrecords ? c->nrecords : 1, 1)) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+
+	return (0);
+
+bad:
+	fprintf(stderr, "%s: not a touch2 cache, starting afresh\n", c->file);
+	if (c->map != NULL)
+		(void)munmap(c->map, c->maplen);
+	c->map = NULL;
+	if (fd >= 0)
+		(void)close(fd);
+	return (0);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+int
+dircache_open(struct engine *eng, const char *file, uint64_t filterkey)
+{
+	struct dircache *c;
+	uint64_t key = DIRCACHE_SEED;
+	int64_t v[6];
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	c->file = file;
+	c->slack = eng->budget * 1000 + DIRCACHE_SLACK;
+
+	v[0] = (int64_t)eng->reftime;
+	v[1] = (int64_t)eng->target.tv_sec;
+	v[2] = (int64_t)eng->target.tv_nsec;
+	v[3] = (int64_t)eng->shard;
+	v[4] = (int64_t)eng->nshards;
+	v[5] = (int64_t)filterkey;
+	c->key = dircache_hash(key, v, sizeof(v));
+
+	if (map_old(c, eng->verbose) < 0) {
+		if (c->map != NULL)
+			(void)munmap(c->map, c->maplen);
+		free(c);
+		return (-1);
+	}
+	eng->dircache = c;
+
+	return (0);
+}
+
+/*
+ * Returns the number of the record of the old cache for st, or -1
+ */
+static int64_t
+lookup(const struct dircache *c, const struct stat *st)
+{
+	const struct dircache_record *r;
+	size_t k;
+	uint32_t i;
+
+	if (c->map == NULL)
+		return (-1);
+	for (k = slot_hash((uint64_t)st->st_dev, (uint64_t)st->st_ino) &
+	    (c->nslots - 1); (i = c->slots[k]) != 0; k = (k + 1) & (c->nslots - 1)) {
+		if (i > c->nrecords)
+			return (-1);
+		r = &c->records[i - 1];
+		if (r->dev == (uint64_t)st->st_dev && r->ino == (uint64_t)st->st_ino)
+			return (i - 1);
+	}
+
+	return (-1);
+}
+
+/*
+ * Returns whether the directory st is as in record i
+ */
+static int
+same(const struct dircache *c, uint32_t i, const struct stat *st)
+{
+	const struct dircache_record *r = &c->records[i];
+	int64_t d;
+
+	if (!S_ISDIR(st->st_mode) || r->dev != (uint64_t)st->st_dev ||
+	    r->ino != (uint64_t)st->st_ino || r->mtime != st->st_mtim.tv_sec ||
+	    r->mtime_nsec != st->st_mtim.tv_nsec)
+		return (0);
+	d = (st->st_ctim.tv_sec - r->ctime) * 1000000000LL +
+	    (st->st_ctim.tv_nsec - r->ctime_nsec);
+
+	return (d >= -c->slack && d <= c->slack);
+}
+
+/*
+ * Returns whether the subdirectories of record i, whose directory is at
+ * c->path[0, len), are all as recorded, down to the leaves
+ */
+static int
+check(struct dircache *c, uint32_t i, size_t len)
+{
+	const struct dircache_record *r = &c->records[i];
+	struct stat st;
+	uint64_t off = r->subdirs;
+	uint32_t k, child;
+	size_t namelen;
+	const char *name;
+
+	if (c->checked[i] != UNCHECKED)
+		return (c->checked[i] == UNCHANGED);
+	c->checked[i] = CHANGED;
+
+	for (k = 0; k < r->nsubdirs; k++) {
+		if (off + sizeof(child) >= c->poolsize)
+			return (0);
+		memcpy(&child, c->pool + off, sizeof(child));
+		name = c->pool + off + sizeof(child);
+		namelen = strnlen(name, c->poolsize - off - sizeof(child));
+		off += sizeof(child) + namelen + 1;
+		/* Children come first, which rules out cycles */
+		if (child >= i || off > c->poolsize ||
+		    len + 1 + namelen >= sizeof(c->path))
+			return (0);
+
+		c->path[len] = '/';
+		memcpy(c->path + len + 1, name, namelen + 1);
+		c->nchecked++;
+		if (lstat(c->path, &st) < 0 || !same(c, child, &st) ||
+		    !check(c, child, len + 1 + namelen))
+			return (0);
+	}
+	c->checked[i] = UNCHANGED;
+
+	return (1);
+}
+
+/*
+ * Adds a record to the new cache, with the subdirectories in the pool.
+ * Returns its number, or -1 on error
+ */
+static int64_t
+add_record(struct dircache *c, const struct dircache_record *r,
+    const char *subdirs, size_t len)
+{
+	struct dircache_record *v;
+
+	if (c->n == UINT32_MAX)
+		return (-1);
+	if (c->n == c->size) {
+		c->size = c->size ? c->size * 2 : 1024;
+		if ((v = realloc(c->v, c->size * sizeof(*v))) == NULL)
+			return (-1);
+		c->v = v;
+	}
+	c->v[c->n] = *r;
+	c->v[c->n].subdirs = c->newlen;
+	if (append(&c->newpool, &c->newlen, &c->newsize, subdirs, len) < 0)
+		return (-1);
+
+	return ((int64_t)c->n++);
+}
+
+static int
+add_subdir(struct dirstate *d, uint32_t i, const char *name)
+{
+	if (append(&d->subdirs, &d->len, &d->size, &i, sizeof(i)) < 0 ||
+	    append(&d->subdirs, &d->len, &d->size, name, strlen(name) + 1) < 0)
+		return (-1);
+	d->nsubdirs++;
+
+	return (0);
+}
+
+/*
+ * Copies record i of the old cache & its subtree to the new one.
+ * Returns its new number, or -1 on error
+ */
+static int64_t
+carry(struct dircache *c, uint32_t i)
+{
+	const struct dircache_record *r = &c->records[i];
+	struct dirstate d;
+	uint64_t off = r->subdirs;
+	int64_t n = -1, child;
+	uint32_t k, old;
+	const char *name;
+
+	memset(&d, 0, sizeof(d));
+	/* check() made sure the pool is sound */
+	for (k = 0; k < r->nsubdirs; k++) {
+		memcpy(&old, c->pool + off, sizeof(old));
+		name = c->pool + off + sizeof(old);
+		off += sizeof(old) + strlen(name) + 1;
+		if ((child = carry(c, old)) < 0 ||
+		    add_subdir(&d, (uint32_t)child, name) < 0)
+			goto end;
+	}
+	n = add_record(c, r, d.subdirs, d.len);
+	c->nunchanged++;
+	c->nfiles += r->nfiles;
+
+end:
+	free(d.subdirs);
+	return (n);
+}
+
+static void
+dircache_fail(struct dircache *c)
+{
+	if (!c->failed)
+		fprintf(stderr, "%s: %s, not updated\n", c->file, strerror(ENOMEM));
+	c->failed = 1;
+}
+
+/*
+ * Called by the walker on the preorder visit of a directory.  Returns 1 if
+ * its subtree is unchanged since the last run & is to be skipped, else 0
+ */
+int
+dircache_enter(struct engine *eng, FTSENT *p)
+{
+	struct dircache *c = eng->dircache;
+	struct dirstate *d, *parent;
+	size_t len = p->fts_pathlen;
+	int64_t i, n;
+
+	p->fts_pointer = NULL;
+	if (c->failed)
+		return (0);
+
+	if ((i = lookup(c, p->fts_statp)) >= 0 &&
+	    same(c, (uint32_t)i, p->fts_statp) && len < sizeof(c->path)) {
+		memcpy(c->path, p->fts_path, len + 1);
+		if (check(c, (uint32_t)i, len)) {
+			parent = (p->fts_level > 0) ? p->fts_parent->fts_pointer :
+			    NULL;
+			if ((n = carry(c, (uint32_t)i)) < 0 || (parent != NULL &&
+			    add_subdir(parent, (uint32_t)n, p->fts_name) < 0))
+				dircache_fail(c);
+			return (1);
+		}
+	}
+
+	if ((d = calloc(1, sizeof(*d))) == NULL) {
+		dircache_fail(c);
+		return (0);
+	}
+	d->ctime = p->fts_statp->st_ctim;
+	p->fts_pointer = d;
+
+	return (0);
+}
+
+/*
+ * Called by the walker for every entry queued, with its target
+ */
+void
+dircache_note(struct engine *eng, FTSENT *p, const struct timespec *target)
+{
+	struct dirstate *d;
+
+	(void)eng;
+	if (p->fts_info == FTS_D) {
+		if ((d = p->fts_pointer) != NULL)
+			d->ctime = *target;
+	} else if (p->fts_level > 0 &&
+	    (d = p->fts_parent->fts_pointer) != NULL)
+		d->nfiles++;
+}
+
+/*
+ * Called by the walker on the postorder visit of a directory, or when it
+ * can't be read
+ */
+void
+dircache_leave(struct engine *eng, FTSENT *p)
+{
+	struct dircache *c = eng->dircache;
+	struct dircache_record r;
+	struct dirstate *d = p->fts_pointer, *parent;
+	int64_t n;
+
+	if (d == NULL)
+		return;
+	p->fts_pointer = NULL;
+
+	if (p->fts_info == FTS_DP && !c->failed) {
+		memset(&r, 0, sizeof(r));
+		r.dev = (uint64_t)p->fts_statp->st_dev;
+		r.ino = (uint64_t)p->fts_statp->st_ino;
+		r.mtime = p->fts_statp->st_mtim.tv_sec;
+		r.mtime_nsec = (int32_t)p->fts_statp->st_mtim.tv_nsec;
+		r.ctime = d->ctime.tv_sec;
+		r.ctime_nsec = (int32_t)d->ctime.tv_nsec;
+		r.nfiles = d->nfiles;
+		r.nsubdirs = d->nsubdirs;
+		parent = (p->fts_level > 0) ? p->fts_parent->fts_pointer : NULL;
+		if ((n = add_record(c, &r, d->subdirs, d->len)) < 0 ||
+		    (parent != NULL &&
+		    add_subdir(parent, (uint32_t)n, p->fts_name) < 0))
+			dircache_fail(c);
+	}
+	free(d->subdirs);
+	free(d);
+}
+
+/*
+ * Writes the new cache next to the file & renames it over.
+ * Returns 0 on success, -1 on error
+ */
+static int
+write_new(struct dircache *c, int durable)
+{
+	static const char pad[8];
+	struct dircache_header h;
+	uint32_t *slots;
+	size_t nslots, i, k, padlen;
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int status = 0;
+
+	for (nslots = 1024; nslots < 2 * c->n; nslots *= 2)
+		;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	for (i = 0; i < c->n; i++) {
+		for (k = slot_hash(c->v[i].dev, c->v[i].ino) & (nslots - 1);
+		    slots[k] != 0; k = (k + 1) & (nslots - 1))
+			;
+		slots[k] = (uint32_t)i + 1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DIRCACHE_MAGIC, sizeof(h.magic));
+	h.version = DIRCACHE_VERSION;
+	h.bom = DIRCACHE_BOM;
+	h.key = c->key;
+	h.nrecords = (uint32_t)c->n;
+	h.nslots = (uint32_t)nslots;
+	h.poolsize = c->newlen;
+	padlen = ((sizeof(h) + nslots * sizeof(*slots) + 7) & ~(size_t)7) -
+	    (sizeof(h) + nslots * sizeof(*slots));
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", c->file) >= sizeof(tmp)) {
+		fprintf(stderr, "%s: %s\n", c->file, strerror(ENAMETOOLONG));
+		free(slots);
+		return (-1);
+	}
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		perror(tmp);
+		free(slots);
+		return (-1);
+	}
+	if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+	    fwrite(slots, sizeof(*slots), nslots, fp) != nslots ||
+	    fwrite(pad, 1, padlen, fp) != padlen ||
+	    fwrite(c->v, sizeof(*c->v), c->n, fp) != c->n ||
+	    fwrite(c->newpool, 1, c->newlen, fp) != c->newlen ||
+	    fflush(fp) != 0 || (durable && fsync(fileno(fp)) < 0)) {
+		perror(tmp);
+		status = -1;
+	}
+	if (fclose(fp) != 0 && status == 0) {
+		perror(tmp);
+		status = -1;
+	}
+	if (status == 0 && rename(tmp, c->file) < 0) {
+		perror(c->file);
+		status = -1;
+	}
+	if (status < 0)
+		(void)unlink(tmp);
+	free(slots);
+
+	return (status);
+}
+
+void
+dircache_stats(const struct engine *eng)
+{
+	const struct dircache *c = eng->dircache;
+
+	fprintf(stderr, "touch2: %zu directories & %zu files unchanged "
+	    "since the last run, %zu directories checked\n", c->nunchanged,
+	    c->nfiles, c->nchecked);
+}
+
+/*
+ * Replaces the cache with the records of this run if it succeeded, & frees
+ * it.  Returns 0 on success, -1 on error
+ */
+int
+dircache_close(struct engine *eng, int success)
+{
+	struct dircache *c = eng->dircache;
+	int status = 0;
+
+	if (c == NULL)
+		return (0);
+	eng->dircache = NULL;
+
+	if (success && !c->failed)
+		status = write_new(c, eng->durable);
+	if (c->map != NULL)
+		(void)munmap(c->map, c->maplen);
+	free(c->checked);
+	free(c->v);
+	free(c->newpool);
+	free(c);
+
+	return (status);
+}
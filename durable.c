@@ -0,0 +1,143 @@
+/*
+ * Durable ctimes
+ *
+ * DETAILS:
+ *   Stamped ctimes sit in the page cache & the journal until the filesystem
+ *   writes them back.  With --durable every filesystem that got a touch is
+ *   flushed with a single syncfs(2) after the last window, instead of one
+ *   fsync(2) per file, and long tree runs also flush every SYNC_INTERVAL
+ *   seconds.  syncfs(2) needs a real descriptor on the filesystem, so one
+ *   is kept per device: the first regular file or directory touched on it,
+ *   or the parent directory of another file if it is on the same device.
+ *   Where there's no syncfs(2), sync(2) flushes everything instead.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+/* Seconds between flushes during long runs */
+#define SYNC_INTERVAL	10
+
+struct syncdev {
+	dev_t	 dev;
+	int	 fd;			/* -1 until one could be opened */
+	int	 dirty;
+};
+
+/*
+ * Notes that e was stamped.  Returns 0 on success, -1 on error
+ */
+int
+durable_note(struct engine *eng, const struct entry *e)
+{
+	struct syncdev *d;
+	size_t i;
+
+	for (i = 0; i < eng->ndevs; i++)
+		if (eng->devs[i].dev == e->dev)
+			break;
+	if (i == eng->ndevs) {
+		if ((d = realloc(eng->devs, (i + 1) * sizeof(*d))) == NULL) {
+			perror("realloc()");
+			return (-1);
+		}
+		eng->devs = d;
+		eng->devs[i].dev = e->dev;
+		eng->devs[i].fd = -1;
+		eng->ndevs++;
+	}
+	d = &eng->devs[i];
+	d->dirty = 1;
+	if (d->fd < 0)
+		d->fd = fdcache_open_fs(eng, e);
+
+	return (0);
+}
+
+/*
+ * Flushes the filesystems touched since the last flush, if final is set or
+ * SYNC_INTERVAL seconds have passed.  Returns 0 on success, -1 on error
+ */
+int
+durable_sync(struct engine *eng, int final)
+{
+	struct timespec start, now;
+	uint64_t t;
+	size_t i;
+	int status = 0;
+
+	if (!final) {
+		/* The interval starts with the first batch */
+		if (eng->lastsync.tv_sec == 0 && eng->lastsync.tv_nsec == 0) {
+			(void)clock_gettime(CLOCK_MONOTONIC, &eng->lastsync);
+			return (0);
+		}
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		if (tsdiff_usec(&eng->lastsync, &now) < SYNC_INTERVAL * 1000000L)
+			return (0);
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	t = trace_now(eng);
+
+#ifdef __linux__
+	for (i = 0; i < eng->ndevs; i++) {
+		struct syncdev *d = &eng->devs[i];
+
+		if (!d->dirty)
+			continue;
+		if (d->fd < 0) {
+			fprintf(stderr, "touch2: device %ju: no file to sync it "
+			    "through\n", (uintmax_t)d->dev);
+			status = -1;
+			continue;
+		}
+		if (syncfs(d->fd) < 0) {
+			perror("syncfs()");
+			status = -1;
+			continue;
+		}
+		d->dirty = 0;
+		eng->nsyncs++;
+	}
+#else
+	for (i = 0; i < eng->ndevs; i++)
+		if (eng->devs[i].dirty)
+			break;
+	if (i < eng->ndevs) {
+		sync();
+		for (i = 0; i < eng->ndevs; i++)
+			eng->devs[i].dirty = 0;
+		eng->nsyncs++;
+	}
+#endif
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &eng->lastsync);
+	eng->sync_usecs += tsdiff_usec(&start, &eng->lastsync);
+	trace_span(eng, "sync", t, 0);
+
+	return (status);
+}
+
+void
+durable_free(struct engine *eng)
+{
+	size_t i;
+
+	for (i = 0; i < eng->ndevs; i++)
+		if (eng->devs[i].fd >= 0)
+			(void)close(eng->devs[i].fd);
+	free(eng->devs);
+	eng->devs = NULL;
+	eng->ndevs = 0;
+}
@@ -0,0 +1,873 @@
+/*
+ * Batched ctime engine
+ *
+ * DETAILS:
+ *   Files are collected with their desired ctimes, stat'ed (prepare phase),
+ *   sorted by target time and then committed in windows.  A window steps
+ *   the system clock once and touches every file sharing the same target,
+ *   so N files stamped to the same time cost two clock steps instead of 2*N.
+ *   Consecutive windows are chained: the clock steps directly from one
+ *   target to the next and never stays stepped longer than the configured
+ *   budget, after which it is restored to real time (compensated with
+ *   CLOCK_MONOTONIC for the time spent stepped) and a new chain begins.
+ *
+ *   In tree mode the prepare phase runs in walker threads and the
+ *   committer stamps whatever batch is ready while the walk goes on.
+ *   Otherwise big runs are stat'ed by a thread per CPU, which on NUMA hosts
+ *   are pinned to the node of the filesystems of their entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "touch2.h"
+
+#define NSEC_PER_SEC	1000000000L
+
+/* The fewest entries worth a thread of their own in the prepare phase */
+#define PREPARE_CHUNK		16384
+
+/* The most threads & NUMA nodes of the prepare phase */
+#define PREPARE_MAX_THREADS	64
+#define PREPARE_MAX_NODES	8
+
+struct preparer {
+	pthread_t	 thread;
+	const struct engine *eng;
+	struct entry	*v;
+	size_t		 n;
+	const struct numa *numa;
+	int		 node;		/* to run on, or -1 */
+};
+
+void
+engine_init(struct engine *eng)
+{
+	memset(eng, 0, sizeof(*eng));
+	eng->budget = DEFAULT_BUDGET;
+	fdcache_init(eng);
+}
+
+/*
+ * Frees the path of an entry, unless it points into a mapped manifest
+ */
+void
+engine_free_path(struct engine *eng, char *path)
+{
+	if (eng->pathmap != NULL && path >= eng->pathmap &&
+	    path < eng->pathmap + eng->pathmaplen)
+		return;
+	free(path);
+}
+
+void
+engine_free(struct engine *eng)
+{
+	size_t i;
+
+	for (i = 0; i < eng->nentries; i++) {
+		fdcache_close(eng, &eng->entries[i]);
+		engine_free_path(eng, eng->entries[i].path);
+	}
+	free(eng->entries);
+	eng->entries = NULL;
+	eng->nentries = eng->size = 0;
+	if (eng->pathmap != NULL)
+		(void)munmap(eng->pathmap, eng->pathmaplen);
+	eng->pathmap = NULL;
+	eng->pathmaplen = 0;
+
+	filter_free(eng->filter);
+	eng->filter = NULL;
+	durable_free(eng);
+	trickle_free(eng);
+	freeze_free(eng);
+	mountns_free(eng);
+
+	fdcache_free(eng);
+	watch_close(eng);
+
+	if (host_leave(eng) < 0 || undo_close(eng) < 0 || plan_close(eng) < 0 ||
+	    trace_close(eng) < 0 || dircache_close(eng, 0) < 0)
+		eng->nerrors++;
+}
+
+/*
+ * Finalizer of splitmix64, so that close inputs land on unrelated shards
+ */
+static uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return (x);
+}
+
+/*
+ * Returns whether the inode belongs to this shard.  The device number is
+ * left out as it differs between hosts mounting the same filesystem
+ */
+int
+engine_shard_inode(const struct engine *eng, ino_t ino)
+{
+	if (eng->nshards == 0)
+		return (1);
+
+	return (mix64((uint64_t)ino) % eng->nshards == eng->shard);
+}
+
+/*
+ * Returns whether the path belongs to this shard
+ */
+int
+engine_shard_path(const struct engine *eng, const char *path)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	if (eng->nshards == 0)
+		return (1);
+	if (eng->nmountns != 0)
+		path = mountns_strip(eng, path);
+	for (; *path != '\0'; path++) {
+		h ^= (unsigned char)*path;
+		h *= 0x100000001b3ULL;
+	}
+
+	return (mix64(h) % eng->nshards == eng->shard);
+}
+
+/*
+ * Takes ownership of path.  Returns 0 on success, 1 if the path belongs
+ * to another shard, -1 on error
+ */
+int
+engine_add(struct engine *eng, char *path, const struct timespec *target)
+{
+	struct entry *e;
+
+	if (!engine_shard_path(eng, path)) {
+		engine_free_path(eng, path);
+		eng->nforeign++;
+		return (1);
+	}
+
+	if (eng->nentries == eng->size) {
+		size_t size = eng->size ? eng->size * 2 : 1024;
+
+		e = realloc(eng->entries, size * sizeof(*e));
+		if (e == NULL) {
+			perror("realloc()");
+			return (-1);
+		}
+		eng->entries = e;
+		eng->size = size;
+	}
+
+	e = &eng->entries[eng->nentries++];
+	e->path = path;
+	e->target = *target;
+	e->mode = 0;
+	e->dev = 0;
+	e->ino = 0;
+	e->fd = -1;
+	e->error = 0;
+	e->tag = 0;
+
+	return (0);
+}
+
+int
+block_signals(sigset_t *oldmask)
+{
+	sigset_t newmask;
+
+	if (sigfillset(&newmask) < 0) {
+		perror("sigfillset()");
+		return (-1);
+	}
+	if (sigprocmask(SIG_SETMASK, &newmask, oldmask) < 0) {
+		perror("sigprocmask()");
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+unblock_signals(const sigset_t *oldmask)
+{
+	if (sigprocmask(SIG_SETMASK, oldmask, NULL) < 0) {
+		perror("sigprocmask()");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Forces an update of the inode's ctime without changing anything else.
+ * Returns 0 on success, -1 on (system call) error with errno set
+ */
+int
+touch_inode(const char *file, mode_t mode)
+{
+	if (S_ISLNK(mode)) {
+		/* chmod(2) follows symlinks, but a no-op chown does not */
+		while (lchown(file, (uid_t)-1, (gid_t)-1) < 0)
+			if (errno != EINTR)
+				return (-1);
+		return (0);
+	}
+
+	while (chmod(file, mode) < 0)
+		if (errno != EINTR)
+			return (-1);
+
+	return (0);
+}
+
+static int
+tscmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return ((a->tv_sec < b->tv_sec) ? -1 : 1);
+	if (a->tv_nsec != b->tv_nsec)
+		return ((a->tv_nsec < b->tv_nsec) ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Returns b - a in microseconds
+ */
+long
+tsdiff_usec(const struct timespec *a, const struct timespec *b)
+{
+	return ((b->tv_sec - a->tv_sec) * 1000000L +
+	    (b->tv_nsec - a->tv_nsec) / 1000);
+}
+
+/* ts += b - a */
+static void
+tsadd_elapsed(struct timespec *ts, const struct timespec *a,
+    const struct timespec *b)
+{
+	ts->tv_sec += b->tv_sec - a->tv_sec;
+	ts->tv_nsec += b->tv_nsec - a->tv_nsec;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += NSEC_PER_SEC;
+	} else if (ts->tv_nsec >= NSEC_PER_SEC) {
+		ts->tv_sec++;
+		ts->tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+/*
+ * Gets the desired ctime for a walked file
+ */
+void
+engine_target(const struct engine *eng, const struct stat *st,
+    struct timespec *ts)
+{
+	switch (eng->reftime) {
+	case REF_ATIME:
+		*ts = st->st_atim;
+		break;
+	case REF_MTIME:
+		*ts = st->st_mtim;
+		break;
+	default:
+		*ts = eng->target;
+		break;
+	}
+}
+
+static int
+entrycmp(const void *p1, const void *p2)
+{
+	const struct entry *a = p1, *b = p2;
+	int r;
+
+	if ((r = tscmp(&a->target, &b->target)) != 0)
+		return (r);
+	/* Keep files of the same directory together */
+	return (strcmp(a->path, b->path));
+}
+
+/*
+ * Gets the inode information of an entry.  Returns 0 on success, -1 with
+ * its error set if it must be dropped
+ */
+static int
+stat_entry(const struct engine *eng, struct entry *e)
+{
+	struct stat inode;
+	int r;
+
+	while ((r = mountns_lstat(eng, e->path, &inode)) < 0 && errno == EINTR)
+		;
+	if (r < 0) {
+		e->error = errno;
+		fprintf(stderr, "%s: %s\n", e->path, strerror(errno));
+		return (-1);
+	}
+	/* Entries from an undo log must still be the same file */
+	if (e->ino != 0 &&
+	    (e->ino != inode.st_ino || e->dev != inode.st_dev)) {
+		e->error = ESTALE;
+		fprintf(stderr, "%s: replaced by another file\n", e->path);
+		return (-1);
+	}
+	e->mode = inode.st_mode;
+	e->dev = inode.st_dev;
+	e->ino = inode.st_ino;
+	e->oldctime = inode.st_ctim;
+
+	return (0);
+}
+
+static void *
+prepare_thread(void *arg)
+{
+	struct preparer *p = arg;
+	size_t i;
+
+	if (p->node >= 0)
+		(void)numa_pin(p->numa, p->node);
+	for (i = 0; i < p->n; i++)
+		(void)stat_entry(p->eng, &p->v[i]);
+
+	return (NULL);
+}
+
+/*
+ * Groups the n entries of v by the NUMA node of their filesystem, in
+ * place, counting them by node in count.  Entries on no known node are
+ * spread over all of them
+ */
+static void
+partition_nodes(const struct numa *numa, struct entry *v, size_t n,
+    size_t *count)
+{
+	size_t start[PREPARE_MAX_NODES], next[PREPARE_MAX_NODES], i;
+	int nnodes = numa_nodes(numa), node, k;
+	struct entry e;
+
+	for (k = 0; k < nnodes; k++)
+		count[k] = 0;
+	for (i = 0; i < n; i++) {
+		node = (v[i].dev != 0) ? numa_dev_node(numa, v[i].dev) :
+		    numa_path_node(numa, v[i].path);
+		if (node < 0)
+			node = (int)(i % (size_t)nnodes);
+		v[i].tag = (size_t)node;
+		count[node]++;
+	}
+
+	/* Every entry is swapped straight into its node's bucket */
+	for (k = 0, i = 0; k < nnodes; i += count[k++])
+		start[k] = next[k] = i;
+	for (k = 0; k < nnodes; k++) {
+		while (next[k] < start[k] + count[k]) {
+			e = v[next[k]];
+			while ((int)e.tag != k) {
+				struct entry t = v[next[e.tag]];
+
+				v[next[e.tag]++] = e;
+				e = t;
+			}
+			v[next[k]++] = e;
+		}
+	}
+	for (i = 0; i < n; i++)
+		v[i].tag = 0;
+}
+
+/*
+ * Splits the n entries of v between up to nthreads preparers of node,
+ * starting with p[k].  Returns the next preparer
+ */
+static size_t
+split(struct preparer *p, size_t k, struct entry *v, size_t n,
+    size_t nthreads, const struct numa *numa, int node)
+{
+	size_t i, per;
+
+	if (n == 0)
+		return (k);
+	if (nthreads > (n + PREPARE_CHUNK - 1) / PREPARE_CHUNK)
+		nthreads = (n + PREPARE_CHUNK - 1) / PREPARE_CHUNK;
+	if (nthreads == 0)
+		nthreads = 1;
+	per = (n + nthreads - 1) / nthreads;
+	for (i = 0; i < n; i += per, k++) {
+		p[k].v = v + i;
+		p[k].n = (n - i < per) ? n - i : per;
+		p[k].numa = numa;
+		p[k].node = node;
+	}
+
+	return (k);
+}
+
+/*
+ * Gets the inode information of every entry, dropping those that fail.
+ * Big runs are stat'ed by a thread per CPU, each pinned to the NUMA node
+ * of the filesystems of its share of the entries
+ */
+static void
+engine_prepare(struct engine *eng)
+{
+	struct preparer p[PREPARE_MAX_THREADS + PREPARE_MAX_NODES];
+	size_t count[PREPARE_MAX_NODES], nthreads, share, np = 0, i, n = 0;
+	struct numa *numa = NULL;
+	long ncpus;
+	int k;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpus = 1;
+	nthreads = (size_t)ncpus;
+	if (nthreads > PREPARE_MAX_THREADS)
+		nthreads = PREPARE_MAX_THREADS;
+
+	if (nthreads > 1 && eng->nentries >= 2 * PREPARE_CHUNK &&
+	    (numa = numa_open()) != NULL &&
+	    numa_nodes(numa) <= PREPARE_MAX_NODES) {
+		/*
+		 * The threads of every node share its entries, & the nodes
+		 * share the threads as they do the entries: at most nthreads
+		 * in all, plus one for each node with few entries
+		 */
+		partition_nodes(numa, eng->entries, eng->nentries, count);
+		for (k = 0, i = 0; k < numa_nodes(numa); i += count[k++]) {
+			share = nthreads * count[k] / eng->nentries;
+			if (share > (size_t)numa_cpus(numa, k))
+				share = (size_t)numa_cpus(numa, k);
+			np = split(p, np, eng->entries + i, count[k],
+			    (share != 0) ? share : 1, numa, k);
+		}
+		eng->nnodes = numa_nodes(numa);
+	} else if (nthreads > 1)
+		np = split(p, 0, eng->entries, eng->nentries, nthreads, NULL,
+		    -1);
+
+	if (np <= 1) {
+		for (i = 0; i < eng->nentries; i++)
+			(void)stat_entry(eng, &eng->entries[i]);
+	} else {
+		for (i = 0; i < np; i++)
+			p[i].eng = eng;
+		for (i = 1; i < np; i++) {
+			/* Stat them here instead if there's no thread */
+			if (pthread_create(&p[i].thread, NULL, prepare_thread,
+			    &p[i]) != 0)
+				p[i].thread = pthread_self();
+		}
+		(void)prepare_thread(&p[0]);
+		for (i = 1; i < np; i++) {
+			if (pthread_equal(p[i].thread, pthread_self()))
+				(void)prepare_thread(&p[i]);
+			else
+				(void)pthread_join(p[i].thread, NULL);
+		}
+		eng->nprepare_threads = np;
+	}
+	numa_close(numa);
+
+	for (i = 0; i < eng->nentries; i++) {
+		struct entry *e = &eng->entries[i];
+
+		if (e->error != 0) {
+			eng->nerrors++;
+			engine_free_path(eng, e->path);
+			continue;
+		}
+		eng->entries[n++] = *e;
+	}
+	eng->nentries = n;
+}
+
+static void
+touch_entry(struct engine *eng, struct entry *e)
+{
+	if (fdcache_touch(eng, e) < 0) {
+		e->error = errno;
+		fprintf(stderr, "%s: %s\n", e->path, strerror(errno));
+		eng->nerrors++;
+	} else {
+		e->error = 0;
+		eng->ntouched++;
+	}
+}
+
+/*
+ * Touches the entries from v[i] on sharing its target, until the budget
+ * runs out.  Returns the next entry
+ */
+static size_t
+touch_window(struct engine *eng, struct entry *v, size_t i, size_t n,
+    const struct timespec *start, struct timespec *now)
+{
+	const struct timespec target = v[i].target;
+
+	/* Touch inodes */
+	do {
+		touch_entry(eng, &v[i++]);
+
+		(void)clock_gettime(CLOCK_MONOTONIC, now);
+	} while (i < n && tscmp(&v[i].target, &target) == 0 &&
+	    tsdiff_usec(start, now) < eng->budget);
+
+	return (i);
+}
+
+static int
+tsisset(const struct timespec *ts)
+{
+	return (ts->tv_sec != 0 || ts->tv_nsec != 0);
+}
+
+/*
+ * Commits a chain of windows starting at entry *next and advances *next
+ * past it.  Each window steps the clock directly from the previous target
+ * to its own, and real time is only restored once the budget runs out or
+ * no entries are left.
+ * Returns 0 on success, -1 if the clock could not be stepped
+ */
+static int
+commit_chain(struct engine *eng, struct entry *v, size_t n, size_t *next)
+{
+	struct timespec real, start, now, *target;
+	sigset_t oldmask;
+	size_t i = *next, k;
+	int status = 0, stepped = 0;
+	uint64_t chain, t;
+
+	if (block_signals(&oldmask) < 0)
+		return (-1);
+
+/* ----- BEGIN CRITICAL SECTION ----- */
+
+	/* The services that must not see the stepped clock */
+	if (eng->freezer != NULL && tsisset(&v[i].target))
+		freeze_groups(eng);
+
+	/* Save current time */
+	if (clock_gettime(CLOCK_REALTIME, &real) < 0 ||
+	    clock_gettime(CLOCK_MONOTONIC, &start) < 0) {
+		perror("clock_gettime()");
+		status = -1;
+		goto end;
+	}
+
+	now = start;
+	chain = trace_now(eng);
+	do {
+		target = &v[i].target;
+
+		/* If there's no time, it will be the current time */
+		if (tsisset(target)) {
+			/* Set system time to ctime */
+			t = trace_now(eng);
+			if (clock_settime(CLOCK_REALTIME, target) < 0) {
+				perror("clock_settime(ctime)");
+				status = -1;
+				break;
+			}
+			trace_span(eng, "step", t, 0);
+			eng->nsteps++;
+			eng->nstepped++;
+			stepped = 1;
+		} else if (stepped)
+			break;
+
+		k = i;
+		t = trace_now(eng);
+		i = touch_window(eng, v, i, n, &start, &now);
+		trace_span(eng, "window", t, i - k);
+		eng->nwindows++;
+	} while (i < n && tsdiff_usec(&start, &now) < eng->budget);
+
+	if (stepped) {
+		eng->stepped_usecs += tsdiff_usec(&start, &now);
+		/* Restore system time, accounting for the time spent */
+		tsadd_elapsed(&real, &start, &now);
+		t = trace_now(eng);
+		if (clock_settime(CLOCK_REALTIME, &real) < 0) {
+			perror("clock_settime(now)");
+			status = -1;
+		} else
+			eng->nsteps++;
+		trace_span(eng, "restore", t, 0);
+	}
+	trace_span(eng, "chain", chain, i - *next);
+
+/* ----- END CRITICAL SECTION ----- */
+
+end:
+	if (eng->freezer != NULL)
+		freeze_thaw(eng);
+	if (unblock_signals(&oldmask) < 0)
+		status = -1;
+
+	*next = i;
+
+	return (status);
+}
+
+/*
+ * Sorts the prepared entries and commits them window by window.
+ * Returns 0 on success, -1 if the clock could not be stepped
+ */
+static int
+commit_entries(struct engine *eng, struct entry *v, size_t n)
+{
+	size_t i = 0, k, m, ahead = 0;
+	int status = 0;
+	uint64_t t;
+
+	t = trace_now(eng);
+	qsort(v, n, sizeof(*v), entrycmp);
+	trace_span(eng, "sort", t, n);
+
+	/* Log the previous ctimes before anything is stamped */
+	if (eng->undo != NULL) {
+		t = trace_now(eng);
+		for (k = 0; k < n; k++)
+			if (undo_append(eng, &v[k]) < 0)
+				break;
+		if (k < n || fflush(eng->undo) != 0 ||
+		    (eng->durable && fsync(fileno(eng->undo)) < 0)) {
+			if (k == n)
+				perror("undo log");
+			eng->nerrors += n;
+			return (-1);
+		}
+		trace_span(eng, "undo log", t, n);
+	}
+
+	if (eng->plan != NULL)
+		(void)plan_note(eng, v, n);
+
+	/* A follower hands its entries to the leader of the host's runs */
+	if (eng->host != NULL)
+		i = host_follow(eng, v, n);
+	if (eng->watch != NULL)
+		watch_note(eng, v + i, n - i);
+
+	while (i < n) {
+		/* Open the upcoming files while the clock is not stepped */
+		if (!eng->borrowed_fds) {
+			if (ahead < i)
+				ahead = i;
+			k = ahead;
+			t = trace_now(eng);
+			while (ahead < n && fdcache_open(eng, &v[ahead]) == 0)
+				ahead++;
+			if (ahead > k)
+				trace_span(eng, "open", t, ahead - k);
+		}
+
+		k = i;
+		m = n;
+		if (eng->trickle != NULL) {
+			t = trace_now(eng);
+			m = i + trickle_wait(eng, n - i);
+			trace_span(eng, "throttle", t, 0);
+		}
+		if (commit_chain(eng, v, m, &i) < 0) {
+			int error = errno;
+
+			eng->nerrors += n - i;
+			for (; i < n; i++)
+				v[i].error = error;
+			status = -1;
+		}
+		if (eng->trickle != NULL)
+			trickle_spend(eng, i - k);
+		/* Other processes' changes while the clock was stepped */
+		if (eng->watch != NULL) {
+			t = trace_now(eng);
+			watch_check(eng, v + k, i - k);
+			trace_span(eng, "watch", t, 0);
+		}
+
+		/* Make room for the next ones */
+		for (; k < i; k++) {
+			if (eng->durable && durable_note(eng, &v[k]) < 0)
+				status = -1;
+			if (!eng->borrowed_fds)
+				fdcache_close(eng, &v[k]);
+		}
+		trace_flush(eng, 0);
+
+		/* A leader stamps what its followers queued in between */
+		if (eng->host != NULL)
+			host_serve(eng);
+	}
+
+	if (eng->durable && durable_sync(eng, 0) < 0) {
+		eng->nerrors++;
+		status = -1;
+	}
+
+	return (status);
+}
+
+/*
+ * Commits entries prepared by the caller, setting the error of each one.
+ * Returns 0 on success, -1 if the clock could not be stepped
+ */
+int
+engine_commit(struct engine *eng, struct entry *v, size_t n)
+{
+	return (commit_entries(eng, v, n));
+}
+
+void
+engine_stats(const struct engine *eng)
+{
+	fprintf(stderr, "touch2: %zu files touched in %zu windows, "
+	    "%zu errors\n", eng->ntouched, eng->nwindows, eng->nerrors);
+	/* Restoring after every window would take two steps per window */
+	fprintf(stderr, "touch2: %zu clock steps, %zu saved by chaining, "
+	    "stepped for %.3fs\n", eng->nsteps, 2 * eng->nstepped - eng->nsteps,
+	    eng->stepped_usecs / 1e6);
+	if (eng->durable)
+		fprintf(stderr, "touch2: %zu filesystem syncs in %.3fs\n",
+		    eng->nsyncs, eng->sync_usecs / 1e6);
+	if (eng->trickle != NULL)
+		trickle_stats(eng);
+	if (eng->watch != NULL)
+		watch_stats(eng);
+	if (eng->freezer != NULL)
+		freeze_stats(eng);
+	if (eng->nprepare_threads != 0)
+		fprintf(stderr, "touch2: stat'ed by %zu threads on %d NUMA "
+		    "nodes\n", eng->nprepare_threads,
+		    eng->nnodes ? eng->nnodes : 1);
+	if (eng->nshards != 0)
+		fprintf(stderr, "touch2: %zu files left to the other shards\n",
+		    eng->nforeign);
+}
+
+/*
+ * Returns 0 on success, -1 if any file could not be processed
+ */
+int
+engine_run(struct engine *eng)
+{
+	uint64_t t;
+	int prio;
+
+	prio = trickle_idle(eng);
+	t = trace_now(eng);
+	engine_prepare(eng);
+	trace_span(eng, "stat", t, eng->nentries);
+	trickle_unidle(prio);
+
+	(void)commit_entries(eng, eng->entries, eng->nentries);
+	if (eng->durable && durable_sync(eng, 1) < 0)
+		eng->nerrors++;
+
+	if (eng->verbose)
+		engine_stats(eng);
+
+	return ((eng->nerrors != 0) ? -1 : 0);
+}
+
+/*
+ * Walks the trees rooted at roots, committing each batch of walked files
+ * while the next one is being prepared.
+ * Returns 0 on success, -1 if any file could not be processed
+ */
+int
+engine_run_tree(struct engine *eng, char **roots)
+{
+	struct timespec start, end;
+	struct walker walker;
+	struct ring ring;
+	struct entry *batch;
+	size_t i, n;
+	int failed = 0;
+	uint64_t t;
+
+	if ((batch = malloc(BATCH_SIZE * sizeof(*batch))) == NULL) {
+		perror("malloc()");
+		return (-1);
+	}
+	if (ring_init(&ring, RING_SIZE) < 0) {
+		free(batch);
+		return (-1);
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+	walker.roots = roots;
+	walker.ring = &ring;
+	walker.eng = eng;
+	if (walk_start(&walker) < 0) {
+		ring_free(&ring);
+		free(batch);
+		return (-1);
+	}
+
+	for (;;) {
+		/* The committer waits for the walker */
+		t = trace_now(eng);
+		if ((n = ring_pop(&ring, batch, BATCH_SIZE)) == 0)
+			break;
+		trace_span(eng, "wait", t, n);
+		trace_counter(eng, "queue", ring_count(&ring));
+
+		/* Keep draining after a failure so the walker can finish */
+		if (!failed && commit_entries(eng, batch, n) < 0)
+			failed = 1;
+		else if (failed)
+			eng->nerrors += n;
+		for (i = 0; i < n; i++) {
+			fdcache_close(eng, &batch[i]);
+			free(batch[i].path);
+		}
+	}
+
+	walk_join(&walker);
+	eng->nerrors += walker.nerrors;
+	eng->nforeign += walker.nforeign;
+	if (eng->durable && durable_sync(eng, 1) < 0)
+		eng->nerrors++;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (eng->verbose) {
+		engine_stats(eng);
+		fprintf(stderr, "touch2: walk %.3fs, total %.3fs\n",
+		    walker.usecs / 1e6, tsdiff_usec(&start, &end) / 1e6);
+		if (walker.nthreads > 1)
+			fprintf(stderr, "touch2: walked by %d threads, %zu "
+			    "directory chunks stolen\n", walker.nthreads,
+			    walker.nsteals);
+		if (eng->filter != NULL)
+			fprintf(stderr, "touch2: %zu files filtered out, "
+			    "%zu subtrees pruned\n", walker.nskipped,
+			    walker.npruned);
+		if (eng->dircache != NULL)
+			dircache_stats(eng);
+	}
+
+	ring_free(&ring);
+	free(batch);
+
+	return ((eng->nerrors != 0) ? -1 : 0);
+}
@@ -0,0 +1,347 @@
+/*
+ * O_PATH descriptor cache
+ *
+ * DETAILS:
+ *   Resolving a long path while the clock is stepped makes the window
+ *   longer, so files are opened with O_PATH before their window and touched
+ *   through the descriptor.  The soft RLIMIT_NOFILE is raised to the hard
+ *   limit and as many descriptors are kept as fit.  Each one is closed right
+ *   after its window, in schedule order, making room for the next files.
+ *   Files left without a descriptor are touched relative to their directory,
+ *   whose descriptor is kept while consecutive files share it.
+ */
+
+#define _GNU_SOURCE		/* O_PATH & AT_EMPTY_PATH */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "touch2.h"
+
+/* Linux 6.6, the same number on every architecture but alpha */
+#if defined(__linux__) && !defined(__NR_fchmodat2) && !defined(__alpha__)
+#define __NR_fchmodat2	452
+#endif
+
+/* Descriptors left for everything else */
+#define FD_RESERVE	64
+
+/* Upper bound when the limit is infinite */
+#define FD_MAX		(1 << 20)
+
+#ifdef O_PATH
+
+/*
+ * Raises the soft limit on open files and sizes the cache
+ */
+void
+fdcache_init(struct engine *eng)
+{
+	struct rlimit rl;
+	rlim_t max;
+
+	eng->dirfd = -1;
+	eng->maxfds = 0;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		perror("getrlimit()");
+		return;
+	}
+	if (rl.rlim_cur != rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+			/* e.g. a hard limit above fs.nr_open */
+			if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+				return;
+		}
+	}
+
+	max = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > FD_MAX) ?
+	    FD_MAX : rl.rlim_cur;
+	if (max > FD_RESERVE)
+		eng->maxfds = (size_t)max - FD_RESERVE;
+}
+
+void
+fdcache_free(struct engine *eng)
+{
+	if (eng->dirfd >= 0)
+		(void)close(eng->dirfd);
+	eng->dirfd = -1;
+	free(eng->dirpath);
+	eng->dirpath = NULL;
+}
+
+/*
+ * Opens e with O_PATH, inside its mount namespace if it's in one.  Returns
+ * the descriptor, or -1 with errno set
+ */
+static int
+open_entry(const struct engine *eng, const struct entry *e)
+{
+	struct stat st;
+	int fd;
+
+	while ((fd = mountns_open(eng, e->path,
+	    O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		if (errno != EINTR)
+			return (-1);
+
+	/* The walk may have found it through a path leading out */
+	if (eng->nmountns != 0 && e->ino != 0 && (fstat(fd, &st) < 0 ||
+	    st.st_ino != e->ino || st.st_dev != e->dev)) {
+		(void)close(fd);
+		errno = ESTALE;
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Opens a descriptor for e unless it has one or it can't be opened.
+ * Returns 0 on success, -1 if the cache is full
+ */
+int
+fdcache_open(struct engine *eng, struct entry *e)
+{
+	size_t n = atomic_load_explicit(&eng->nfds, memory_order_relaxed);
+
+	if (e->fd >= 0)
+		return (0);
+	if (n >= eng->maxfds)
+		return (-1);
+
+	if ((e->fd = open_entry(eng, e)) < 0) {
+		if (errno == EMFILE || errno == ENFILE) {
+			/* Somebody else is holding descriptors too */
+			(void)fdcache_shrink(eng, 0);
+			return (-1);
+		}
+		/* Let the commit report it */
+		return (0);
+	}
+	atomic_fetch_add_explicit(&eng->nfds, 1, memory_order_relaxed);
+
+	return (0);
+}
+
+/*
+ * Keeps the cache n descriptors below its current size, for others that
+ * ran out.  Returns whether closing the cached ones will make room
+ */
+int
+fdcache_shrink(struct engine *eng, size_t n)
+{
+	size_t nfds = atomic_load(&eng->nfds);
+
+	atomic_store(&eng->maxfds, (nfds > n) ? nfds - n : 0);
+
+	return (nfds != 0);
+}
+
+void
+fdcache_close(struct engine *eng, struct entry *e)
+{
+	if (e->fd < 0)
+		return;
+	(void)close(e->fd);
+	e->fd = -1;
+	atomic_fetch_sub_explicit(&eng->nfds, 1, memory_order_relaxed);
+}
+
+static int
+fd_chmod(int fd, mode_t mode)
+{
+	/* Kernels before 6.6, or seccomp filters, won't have it */
+	static _Atomic int nofchmodat2;
+	char path[32];
+
+#ifdef __NR_fchmodat2
+	if (!atomic_load_explicit(&nofchmodat2, memory_order_relaxed)) {
+		if (syscall(__NR_fchmodat2, fd, "", mode, AT_EMPTY_PATH) == 0)
+			return (0);
+		if (errno != ENOSYS)
+			return (-1);
+		atomic_store_explicit(&nofchmodat2, 1, memory_order_relaxed);
+	}
+#endif
+	/* fchmod(2) doesn't work on O_PATH descriptors */
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	return (chmod(path, mode));
+}
+
+/*
+ * Returns the descriptor of e's directory, or -1 with *name set to e's path
+ */
+static int
+dir_fd(struct engine *eng, const struct entry *e, const char **name)
+{
+	const char *slash = strrchr(e->path, '/');
+	size_t len;
+
+	*name = e->path;
+	if (slash == NULL || slash == e->path)
+		return (-1);
+	len = (size_t)(slash - e->path);
+
+	if (eng->dirfd < 0 || strncmp(eng->dirpath, e->path, len) != 0 ||
+	    eng->dirpath[len] != '\0') {
+		fdcache_free(eng);
+		if ((eng->dirpath = strndup(e->path, len)) == NULL)
+			return (-1);
+		eng->dirfd = open(eng->dirpath,
+		    O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (eng->dirfd < 0)
+			return (-1);
+	}
+
+	*name = slash + 1;
+
+	return (eng->dirfd);
+}
+
+static int
+touch_fd(const struct entry *e, int fd)
+{
+	int r;
+
+	/* A no-op chown(2) would also clear set[ug]id bits on files */
+	while ((r = S_ISLNK(e->mode) ?
+	    fchownat(fd, "", (uid_t)-1, (gid_t)-1, AT_EMPTY_PATH) :
+	    fd_chmod(fd, e->mode)) < 0 && errno == EINTR)
+		;
+
+	return (r);
+}
+
+/*
+ * Forces an update of the inode's ctime, through its descriptor if it has
+ * one.  Returns 0 on success, -1 on (system call) error with errno set
+ */
+int
+fdcache_touch(struct engine *eng, const struct entry *e)
+{
+	const char *name;
+	int dirfd, fd, r, error;
+
+	if (e->fd >= 0)
+		return (touch_fd(e, e->fd));
+
+	/* Not by path, which would resolve outside the namespace */
+	if (eng->nmountns != 0 && mountns_strip(eng, e->path) != e->path) {
+		if ((fd = open_entry(eng, e)) < 0)
+			return (-1);
+		r = touch_fd(e, fd);
+		error = errno;
+		(void)close(fd);
+		errno = error;
+		return (r);
+	}
+
+	if ((dirfd = dir_fd(eng, e, &name)) < 0)
+		return (touch_inode(e->path, e->mode));
+
+	while ((r = S_ISLNK(e->mode) ?
+	    fchownat(dirfd, name, (uid_t)-1, (gid_t)-1, AT_SYMLINK_NOFOLLOW) :
+	    fchmodat(dirfd, name, e->mode & 07777, 0)) < 0 && errno == EINTR)
+		;
+
+	return (r);
+}
+
+#else /* !O_PATH */
+
+void
+fdcache_init(struct engine *eng)
+{
+	eng->dirfd = -1;
+	eng->maxfds = 0;
+}
+
+void
+fdcache_free(struct engine *eng)
+{
+	(void)eng;
+}
+
+int
+fdcache_open(struct engine *eng, struct entry *e)
+{
+	(void)eng;
+	(void)e;
+	return (-1);
+}
+
+int
+fdcache_shrink(struct engine *eng, size_t n)
+{
+	(void)eng;
+	(void)n;
+	return (0);
+}
+
+void
+fdcache_close(struct engine *eng, struct entry *e)
+{
+	(void)eng;
+	(void)e;
+}
+
+int
+fdcache_touch(struct engine *eng, const struct entry *e)
+{
+	(void)eng;
+	return (touch_inode(e->path, e->mode));
+}
+
+#endif /* O_PATH */
+
+/*
+ * Opens a readable descriptor on the filesystem of e, for the calls that
+ * take no O_PATH descriptors: e itself if it's a regular file or a
+ * directory, else its directory if it's on the same device.  Returns the
+ * descriptor, or -1
+ */
+int
+fdcache_open_fs(const struct engine *eng, const struct entry *e)
+{
+	struct stat st;
+	char path[32], *copy;
+	int fd;
+
+	/* Opening devices or FIFOs could have side effects */
+	if (S_ISREG(e->mode) || S_ISDIR(e->mode)) {
+		if (e->fd >= 0) {
+			(void)snprintf(path, sizeof(path), "/proc/self/fd/%d",
+			    e->fd);
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		} else
+			fd = mountns_open(eng, e->path, O_RDONLY | O_NOFOLLOW |
+			    O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+		if (fd >= 0)
+			return (fd);
+	}
+
+	if ((copy = strdup(e->path)) == NULL)
+		return (-1);
+	fd = mountns_open(eng, dirname(copy), O_RDONLY | O_DIRECTORY |
+	    O_CLOEXEC);
+	free(copy);
+	if (fd >= 0 && (fstat(fd, &st) < 0 || st.st_dev != e->dev)) {
+		(void)close(fd);
+		errno = EXDEV;
+		fd = -1;
+	}
+
+	return (fd);
+}
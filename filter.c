@@ -0,0 +1,582 @@
+/*
+ * Walk filters
+ *
+ * DETAILS:
+ *   The find(1)-like tests given on the command line are compiled once into
+ *   a small program that the walker runs on every entry, cheapest tests
+ *   first.  Globs are compiled too: a plain name, "*suffix" or "prefix*"
+ *   become a single comparison and the rest a sequence of tokens.  Excluded
+ *   entries are pruned, so excluded directories are never read; entries
+ *   failing the other tests are not stamped but directories are still
+ *   descended.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fts.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+enum tok {
+	TOK_LITERAL,			/* len bytes of str */
+	TOK_ANY,			/* ? */
+	TOK_STAR,			/* * */
+	TOK_CLASS			/* [...] */
+};
+
+struct token {
+	enum tok	 type;
+	const char	*str;
+	size_t		 len;
+	unsigned char	 set[32];	/* TOK_CLASS bitmap */
+};
+
+enum globkind {
+	GLOB_EXACT,
+	GLOB_PREFIX,
+	GLOB_SUFFIX,
+	GLOB_TOKENS
+};
+
+struct glob {
+	enum globkind	 kind;
+	char		*str;		/* literal part for the fast kinds */
+	size_t		 len;
+	int		 path;		/* match the whole path, not the name */
+	struct token	*tokens;
+	size_t		 ntokens;
+};
+
+enum op {
+	OP_EXCLUDE,
+	OP_TYPE,
+	OP_MINSIZE,
+	OP_MAXSIZE,
+	OP_UID,
+	OP_GID,
+	OP_NEWER,
+	OP_OLDER,
+	OP_NAME
+};
+
+struct insn {
+	enum op		 op;
+	unsigned	 types;		/* OP_TYPE: bit per S_IFMT value */
+	off_t		 size;
+	uid_t		 uid;
+	gid_t		 gid;
+	char		 field;		/* 'a', 'm' or 'c' */
+	struct timespec	 ts;
+	struct glob	*globs;		/* OP_NAME & OP_EXCLUDE: any of them */
+	size_t		 nglobs;
+};
+
+struct filter {
+	struct insn	*prog;
+	size_t		 n;
+};
+
+#define TYPEBIT(mode)	(1U << (((mode) & S_IFMT) >> 12))
+
+static void
+setbit(unsigned char *set, unsigned char c)
+{
+	set[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+static int
+isbitset(const unsigned char *set, unsigned char c)
+{
+	return ((set[c >> 3] >> (c & 7)) & 1);
+}
+
+/*
+ * Compiles a [...] class starting right after the '['.
+ * Returns a pointer past the ']' or NULL if it's not a class
+ */
+static const char *
+compile_class(const char *p, struct token *t)
+{
+	int negate = 0, c;
+
+	memset(t->set, 0, sizeof(t->set));
+	if (*p == '!' || *p == '^') {
+		negate = 1;
+		p++;
+	}
+	/* A leading ']' is literal */
+	if (*p == ']')
+		setbit(t->set, (unsigned char)*p++);
+	while (*p != ']') {
+		if (*p == '\0')
+			return (NULL);
+		if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+			for (c = (unsigned char)p[0]; c <= (unsigned char)p[2]; c++)
+				setbit(t->set, (unsigned char)c);
+			p += 3;
+		} else
+			setbit(t->set, (unsigned char)*p++);
+	}
+	if (negate)
+		for (c = 0; c < 32; c++)
+			t->set[c] = (unsigned char)~t->set[c];
+	t->type = TOK_CLASS;
+
+	return (p + 1);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+static int
+compile_glob(const char *pattern, struct glob *g)
+{
+	size_t n = strlen(pattern), nstars = 0, i;
+	const char *p, *q;
+	char *lit;
+
+	memset(g, 0, sizeof(*g));
+	g->path = strchr(pattern, '/') != NULL;
+
+	if ((g->str = strdup(pattern)) == NULL) {
+		perror("strdup()");
+		return (-1);
+	}
+	for (i = 0; i < n; i++)
+		if (pattern[i] == '*')
+			nstars++;
+
+	if (strpbrk(pattern, "?[\\") == NULL) {
+		if (nstars == 0) {
+			g->kind = GLOB_EXACT;
+			g->len = n;
+			return (0);
+		}
+		if (nstars == 1 && pattern[n - 1] == '*') {
+			g->kind = GLOB_PREFIX;
+			g->str[n - 1] = '\0';
+			g->len = n - 1;
+			return (0);
+		}
+		if (nstars == 1 && pattern[0] == '*') {
+			g->kind = GLOB_SUFFIX;
+			memmove(g->str, g->str + 1, n);
+			g->len = n - 1;
+			return (0);
+		}
+	}
+
+	/* Literal runs are copied unescaped into g->str */
+	g->kind = GLOB_TOKENS;
+	if ((g->tokens = calloc(n + 1, sizeof(*g->tokens))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	lit = g->str;
+	for (p = pattern; *p != '\0';) {
+		struct token *t = &g->tokens[g->ntokens];
+
+		switch (*p) {
+		case '*':
+			/* Consecutive stars are one */
+			if (g->ntokens == 0 || t[-1].type != TOK_STAR) {
+				t->type = TOK_STAR;
+				g->ntokens++;
+			}
+			p++;
+			continue;
+		case '?':
+			t->type = TOK_ANY;
+			g->ntokens++;
+			p++;
+			continue;
+		case '[':
+			if ((q = compile_class(p + 1, t)) != NULL) {
+				g->ntokens++;
+				p = q;
+				continue;
+			}
+			break;
+		default:
+			break;
+		}
+
+		/* Literal run */
+		t->type = TOK_LITERAL;
+		t->str = lit;
+		do {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			*lit++ = *p++;
+		} while (*p != '\0' && strchr("*?[", *p) == NULL);
+		t->len = (size_t)(lit - t->str);
+		g->ntokens++;
+	}
+
+	return (0);
+}
+
+static void
+free_glob(struct glob *g)
+{
+	free(g->str);
+	free(g->tokens);
+}
+
+/*
+ * Matches the tokens from t on against s.  A star only has to backtrack to
+ * the last star seen, which keeps matching linear for most patterns
+ */
+static int
+match_tokens(const struct token *t, size_t nt, const char *s, size_t len)
+{
+	size_t ti = 0, si = 0, star_ti = (size_t)-1, star_si = 0;
+
+	while (si < len || ti < nt) {
+		if (ti < nt) {
+			const struct token *k = &t[ti];
+
+			switch (k->type) {
+			case TOK_STAR:
+				star_ti = ti++;
+				star_si = si;
+				continue;
+			case TOK_ANY:
+				if (si < len) {
+					ti++, si++;
+					continue;
+				}
+				break;
+			case TOK_CLASS:
+				if (si < len && isbitset(k->set, (unsigned char)s[si])) {
+					ti++, si++;
+					continue;
+				}
+				break;
+			case TOK_LITERAL:
+				if (len - si >= k->len &&
+				    memcmp(s + si, k->str, k->len) == 0) {
+					ti++;
+					si += k->len;
+					continue;
+				}
+				break;
+			}
+		}
+		/* Mismatch: let the last star eat one more character */
+		if (star_ti == (size_t)-1 || star_si >= len)
+			return (0);
+		ti = star_ti + 1;
+		si = ++star_si;
+	}
+
+	return (1);
+}
+
+static int
+match_glob(const struct glob *g, const FTSENT *p)
+{
+	const char *s = g->path ? p->fts_path : p->fts_name;
+	size_t len = g->path ? p->fts_pathlen : p->fts_namelen;
+
+	switch (g->kind) {
+	case GLOB_EXACT:
+		return (len == g->len && memcmp(s, g->str, len) == 0);
+	case GLOB_PREFIX:
+		return (len >= g->len && memcmp(s, g->str, g->len) == 0);
+	case GLOB_SUFFIX:
+		return (len >= g->len &&
+		    memcmp(s + len - g->len, g->str, g->len) == 0);
+	default:
+		return (match_tokens(g->tokens, g->ntokens, s, len));
+	}
+}
+
+static const struct timespec *
+stat_time(const struct stat *st, char field)
+{
+	switch (field) {
+	case 'a':
+		return (&st->st_atim);
+	case 'm':
+		return (&st->st_mtim);
+	default:
+		return (&st->st_ctim);
+	}
+}
+
+static int
+tsbefore(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec ||
+	    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+/*
+ * Runs the filter on a walked entry
+ */
+enum verdict
+filter_run(const struct filter *f, const FTSENT *p)
+{
+	const struct stat *st = p->fts_statp;
+	size_t i, k;
+
+	for (i = 0; i < f->n; i++) {
+		const struct insn *in = &f->prog[i];
+		int ok = 0;
+
+		switch (in->op) {
+		case OP_EXCLUDE:
+			for (k = 0; k < in->nglobs; k++)
+				if (match_glob(&in->globs[k], p))
+					return (FILTER_PRUNE);
+			ok = 1;
+			break;
+		case OP_TYPE:
+			ok = (in->types & TYPEBIT(st->st_mode)) != 0;
+			break;
+		case OP_MINSIZE:
+			ok = st->st_size >= in->size;
+			break;
+		case OP_MAXSIZE:
+			ok = st->st_size <= in->size;
+			break;
+		case OP_UID:
+			ok = st->st_uid == in->uid;
+			break;
+		case OP_GID:
+			ok = st->st_gid == in->gid;
+			break;
+		case OP_NEWER:
+			ok = tsbefore(&in->ts, stat_time(st, in->field));
+			break;
+		case OP_OLDER:
+			ok = tsbefore(stat_time(st, in->field), &in->ts);
+			break;
+		case OP_NAME:
+			for (k = 0; k < in->nglobs && !ok; k++)
+				ok = match_glob(&in->globs[k], p);
+			break;
+		}
+		if (!ok)
+			return (FILTER_SKIP);
+	}
+
+	return (FILTER_SELECT);
+}
+
+struct filter *
+filter_new(void)
+{
+	struct filter *f;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		perror("calloc()");
+
+	return (f);
+}
+
+void
+filter_free(struct filter *f)
+{
+	size_t i, k;
+
+	if (f == NULL)
+		return;
+	for (i = 0; i < f->n; i++) {
+		for (k = 0; k < f->prog[i].nglobs; k++)
+			free_glob(&f->prog[i].globs[k]);
+		free(f->prog[i].globs);
+	}
+	free(f->prog);
+	free(f);
+}
+
+/*
+ * Appends an instruction for op
+ */
+static struct insn *
+new_insn(struct filter *f, enum op op)
+{
+	struct insn *in;
+
+	if ((in = realloc(f->prog, (f->n + 1) * sizeof(*in))) == NULL) {
+		perror("realloc()");
+		return (NULL);
+	}
+	f->prog = in;
+	in = &f->prog[f->n++];
+	memset(in, 0, sizeof(*in));
+	in->op = op;
+
+	return (in);
+}
+
+/*
+ * Returns the instruction for op, appending it if the program has none.
+ * Only for the tests that merge: globs & types
+ */
+static struct insn *
+get_insn(struct filter *f, enum op op)
+{
+	size_t i;
+
+	for (i = 0; i < f->n; i++)
+		if (f->prog[i].op == op)
+			return (&f->prog[i]);
+
+	return (new_insn(f, op));
+}
+
+static int
+add_glob(struct filter *f, enum op op, const char *pattern)
+{
+	struct insn *in;
+	struct glob *g;
+
+	if ((in = get_insn(f, op)) == NULL)
+		return (-1);
+	if ((g = realloc(in->globs, (in->nglobs + 1) * sizeof(*g))) == NULL) {
+		perror("realloc()");
+		return (-1);
+	}
+	in->globs = g;
+	if (compile_glob(pattern, &in->globs[in->nglobs]) < 0)
+		return (-1);
+	in->nglobs++;
+
+	return (0);
+}
+
+/*
+ * Parses a size with an optional k, M, G or T suffix
+ */
+static int
+parse_size(const char *s, off_t *size)
+{
+	char *end;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &end, 10);
+	if (end == s || errno != 0 || n < 0)
+		return (-1);
+	switch (*end) {
+	case 'T': n *= 1024;	/* FALLTHROUGH */
+	case 'G': n *= 1024;	/* FALLTHROUGH */
+	case 'M': n *= 1024;	/* FALLTHROUGH */
+	case 'k': n *= 1024; end++; break;
+	case '\0': break;
+	default: return (-1);
+	}
+	if (*end != '\0')
+		return (-1);
+	*size = (off_t)n;
+
+	return (0);
+}
+
+/*
+ * Adds the test named by the long option opt with its argument.
+ * Returns 0 on success, -1 on an invalid argument, 1 if opt is unknown
+ */
+int
+filter_add(struct filter *f, const char *opt, const char *arg,
+    int (*parse_time)(const char *, struct timespec *))
+{
+	struct insn *in;
+	const char *s;
+	char *end;
+
+	if (strcmp(opt, "--name") == 0)
+		return (add_glob(f, OP_NAME, arg));
+	if (strcmp(opt, "--exclude") == 0)
+		return (add_glob(f, OP_EXCLUDE, arg));
+
+	if (strcmp(opt, "--type") == 0) {
+		if ((in = get_insn(f, OP_TYPE)) == NULL)
+			return (-1);
+		for (s = arg; *s != '\0'; s++) {
+			switch (*s) {
+			case 'f': in->types |= TYPEBIT(S_IFREG); break;
+			case 'd': in->types |= TYPEBIT(S_IFDIR); break;
+			case 'l': in->types |= TYPEBIT(S_IFLNK); break;
+			case 'b': in->types |= TYPEBIT(S_IFBLK); break;
+			case 'c': in->types |= TYPEBIT(S_IFCHR); break;
+			case 'p': in->types |= TYPEBIT(S_IFIFO); break;
+			case 's': in->types |= TYPEBIT(S_IFSOCK); break;
+			case ',': break;
+			default: return (-1);
+			}
+		}
+		return (0);
+	}
+
+	if (strcmp(opt, "--min-size") == 0 || strcmp(opt, "--max-size") == 0) {
+		if ((in = new_insn(f, (opt[2] == 'm' && opt[3] == 'i') ?
+		    OP_MINSIZE : OP_MAXSIZE)) == NULL)
+			return (-1);
+		return (parse_size(arg, &in->size));
+	}
+
+	if (strcmp(opt, "--uid") == 0) {
+		struct passwd *pw;
+
+		if ((in = new_insn(f, OP_UID)) == NULL)
+			return (-1);
+		if ((pw = getpwnam(arg)) != NULL) {
+			in->uid = pw->pw_uid;
+			return (0);
+		}
+		in->uid = (uid_t)strtoul(arg, &end, 10);
+		return ((end == arg || *end != '\0') ? -1 : 0);
+	}
+	if (strcmp(opt, "--gid") == 0) {
+		struct group *gr;
+
+		if ((in = new_insn(f, OP_GID)) == NULL)
+			return (-1);
+		if ((gr = getgrnam(arg)) != NULL) {
+			in->gid = gr->gr_gid;
+			return (0);
+		}
+		in->gid = (gid_t)strtoul(arg, &end, 10);
+		return ((end == arg || *end != '\0') ? -1 : 0);
+	}
+
+	/* --newer-than & --older-than [amc]time=timestamp */
+	if (strcmp(opt, "--newer-than") == 0 || strcmp(opt, "--older-than") == 0) {
+		if ((s = strchr(arg, '=')) == NULL || s - arg != 5 ||
+		    strchr("amc", arg[0]) == NULL ||
+		    strncmp(arg + 1, "time", 4) != 0)
+			return (-1);
+		if ((in = new_insn(f, (opt[2] == 'n') ? OP_NEWER : OP_OLDER)) == NULL)
+			return (-1);
+		in->field = arg[0];
+		return (parse_time(s + 1, &in->ts));
+	}
+
+	return (1);
+}
+
+static int
+insncmp(const void *p1, const void *p2)
+{
+	const struct insn *a = p1, *b = p2;
+
+	return ((int)a->op - (int)b->op);
+}
+
+/*
+ * Orders the program so that exclusions & the cheap tests run first
+ */
+void
+filter_compile(struct filter *f)
+{
+	qsort(f->prog, f->n, sizeof(*f->prog), insncmp);
+}
@@ -0,0 +1,371 @@
+/*
+ * Frozen cgroups
+ *
+ * DETAILS:
+ *   Services that must never see the stepped clock, such as databases &
+ *   lease holders, can be frozen for the span of each chain of windows with
+ *   --freeze: "1" is written to the cgroup.freeze file of their cgroup v2
+ *   groups before the clock is stepped, and "0" once it is restored.
+ *   Freezing is asynchronous, so the clock is only stepped once every
+ *   group's cgroup.events says it's frozen, or FREEZE_TIMEOUT_MSECS later,
+ *   in which case the chain goes ahead anyway & the timeout is counted.
+ *   This is done with signals blocked, like the rest of the critical
+ *   section, so that the groups are not left frozen by an interrupted run.
+ *   Groups already frozen are left alone, & so is a group touch2 is in.
+ *
+ *   Groups are given by path, relative to the cgroup2 mount or absolute.
+ *   Linux only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+
+#include "touch2.h"
+
+#ifdef __linux__
+
+/* How long to wait for the groups to freeze before stepping anyway */
+#define FREEZE_TIMEOUT_MSECS	100
+
+struct cgroup {
+	char		*path;
+	int		 freezefd;	/* cgroup.freeze */
+	int		 eventsfd;	/* cgroup.events */
+};
+
+struct freezer {
+	struct cgroup	*groups;
+	size_t		 ngroups;
+	int		 frozen;
+	/* Statistics */
+	size_t		 nfreezes;
+	size_t		 ntimeouts;
+	long		 freeze_usecs;
+	long		 max_freeze_usecs;
+	long		 thaw_usecs;
+};
+
+/*
+ * Puts the mount point of the cgroup2 hierarchy in buf.
+ * Returns 0 on success, -1 on error
+ */
+static int
+cgroup_root(char *buf, size_t size)
+{
+	char line[PATH_MAX + 64], dir[PATH_MAX], type[32];
+	FILE *fp;
+	int found = 0;
+
+	if ((fp = fopen("/proc/self/mounts", "re")) == NULL) {
+		perror("/proc/self/mounts");
+		return (-1);
+	}
+	while (!found && fgets(line, sizeof(line), fp) != NULL)
+		found = sscanf(line, "%*s %4095s %31s", dir, type) == 2 &&
+		    strcmp(type, "cgroup2") == 0;
+	(void)fclose(fp);
+	if (!found || (size_t)snprintf(buf, size, "%s", dir) >= size) {
+		fprintf(stderr, "--freeze: no cgroup2 hierarchy\n");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns whether this process is in the group at path, or below it
+ */
+static int
+in_group(const char *root, const char *path)
+{
+	char line[PATH_MAX + 8], self[PATH_MAX], *nl;
+	size_t len;
+	FILE *fp;
+	int r = 0;
+
+	if ((fp = fopen("/proc/self/cgroup", "re")) == NULL)
+		return (0);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "0::", 3) != 0)
+			continue;
+		if ((nl = strchr(line, '\n')) != NULL)
+			*nl = '\0';
+		if ((size_t)snprintf(self, sizeof(self), "%s%s", root,
+		    strcmp(line + 3, "/") == 0 ? "" : line + 3) >= sizeof(self))
+			break;
+		len = strlen(path);
+		r = strncmp(self, path, len) == 0 &&
+		    (self[len] == '\0' || self[len] == '/');
+		break;
+	}
+	(void)fclose(fp);
+
+	return (r);
+}
+
+/*
+ * Returns whether the group's cgroup.events says it's frozen, -1 on error
+ */
+static int
+is_frozen(const struct cgroup *g)
+{
+	char buf[256], *p;
+	ssize_t len;
+
+	if ((len = pread(g->eventsfd, buf, sizeof(buf) - 1, 0)) < 0)
+		return (-1);
+	buf[len] = '\0';
+	if ((p = strstr(buf, "frozen ")) == NULL)
+		return (-1);
+
+	return (p[7] == '1');
+}
+
+/*
+ * Adds the cgroup at path to the groups frozen during windows.
+ * Returns 0 on success, -1 on error
+ */
+int
+freeze_add(struct engine *eng, const char *path)
+{
+	struct freezer *f = eng->freezer;
+	struct cgroup *g;
+	char root[PATH_MAX], real[PATH_MAX], file[PATH_MAX + 16];
+	char buf[4];
+	ssize_t len;
+
+	if (cgroup_root(root, sizeof(root)) < 0)
+		return (-1);
+	if (*path == '/')
+		len = snprintf(file, sizeof(file), "%s", path);
+	else
+		len = snprintf(file, sizeof(file), "%s/%s", root, path);
+	if (len < 0 || (size_t)len >= sizeof(file) ||
+	    realpath(file, real) == NULL) {
+		perror(path);
+		return (-1);
+	}
+	if (in_group(root, real)) {
+		fprintf(stderr, "%s: touch2 runs in this cgroup, not freezing "
+		    "it\n", path);
+		return (0);
+	}
+
+	if (f == NULL) {
+		if ((f = calloc(1, sizeof(*f))) == NULL) {
+			perror("calloc()");
+			return (-1);
+		}
+		eng->freezer = f;
+	}
+	if ((g = realloc(f->groups, (f->ngroups + 1) * sizeof(*g))) == NULL) {
+		perror("realloc()");
+		return (-1);
+	}
+	f->groups = g;
+	g = &f->groups[f->ngroups];
+	g->eventsfd = -1;
+	if ((g->path = strdup(real)) == NULL) {
+		perror("strdup()");
+		return (-1);
+	}
+
+	(void)snprintf(file, sizeof(file), "%s/cgroup.freeze", real);
+	if ((g->freezefd = open(file, O_RDWR | O_CLOEXEC)) < 0) {
+		perror(file);
+		free(g->path);
+		return (-1);
+	}
+	(void)snprintf(file, sizeof(file), "%s/cgroup.events", real);
+	if ((g->eventsfd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror(file);
+		(void)close(g->freezefd);
+		free(g->path);
+		return (-1);
+	}
+
+	/* Somebody else froze it & will thaw it */
+	if ((len = pread(g->freezefd, buf, sizeof(buf), 0)) > 0 &&
+	    buf[0] == '1') {
+		fprintf(stderr, "%s: already frozen, leaving it alone\n", path);
+		(void)close(g->freezefd);
+		(void)close(g->eventsfd);
+		free(g->path);
+		return (0);
+	}
+	f->ngroups++;
+
+	return (0);
+}
+
+/*
+ * Writes state to the cgroup.freeze file of every group
+ */
+static void
+write_all(struct freezer *f, const char *state)
+{
+	size_t i;
+
+	for (i = 0; i < f->ngroups; i++)
+		while (pwrite(f->groups[i].freezefd, state, 1, 0) < 0)
+			if (errno != EINTR) {
+				perror(f->groups[i].path);
+				break;
+			}
+}
+
+/*
+ * Freezes the groups & waits for them to be frozen.  Called with signals
+ * blocked, before the clock is stepped
+ */
+void
+freeze_groups(struct engine *eng)
+{
+	struct freezer *f = eng->freezer;
+	struct timespec start, now;
+	struct pollfd pfd;
+	long left, usecs;
+	size_t i;
+	uint64_t t;
+	int r;
+
+	if (f == NULL || f->ngroups == 0)
+		return;
+
+	t = trace_now(eng);
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	write_all(f, "1");
+	f->frozen = 1;
+
+	/* cgroup.events raises POLLPRI when it changes */
+	for (i = 0; i < f->ngroups; i++) {
+		pfd.fd = f->groups[i].eventsfd;
+		pfd.events = POLLPRI;
+		while ((r = is_frozen(&f->groups[i])) == 0) {
+			(void)clock_gettime(CLOCK_MONOTONIC, &now);
+			left = FREEZE_TIMEOUT_MSECS - tsdiff_usec(&start, &now) /
+			    1000;
+			if (left <= 0 || poll(&pfd, 1, (int)left) == 0) {
+				r = -1;
+				break;
+			}
+		}
+		if (r < 0) {
+			fprintf(stderr, "%s: not frozen after %dms, going ahead\n",
+			    f->groups[i].path, FREEZE_TIMEOUT_MSECS);
+			f->ntimeouts++;
+			break;
+		}
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = tsdiff_usec(&start, &now);
+	f->nfreezes++;
+	f->freeze_usecs += usecs;
+	if (usecs > f->max_freeze_usecs)
+		f->max_freeze_usecs = usecs;
+	trace_span(eng, "freeze", t, f->ngroups);
+}
+
+/*
+ * Thaws the groups.  Called once the clock is restored
+ */
+void
+freeze_thaw(struct engine *eng)
+{
+	struct freezer *f = eng->freezer;
+	struct timespec start, now;
+	uint64_t t;
+
+	if (f == NULL || !f->frozen)
+		return;
+
+	t = trace_now(eng);
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	write_all(f, "0");
+	f->frozen = 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	f->thaw_usecs += tsdiff_usec(&start, &now);
+	trace_span(eng, "thaw", t, f->ngroups);
+}
+
+void
+freeze_stats(const struct engine *eng)
+{
+	const struct freezer *f = eng->freezer;
+
+	if (f->nfreezes == 0)
+		return;
+	fprintf(stderr, "touch2: froze %zu cgroups %zu times in %.3fms on "
+	    "average, %.3fms at most, %zu timeouts; thawed in %.3fms on "
+	    "average\n", f->ngroups, f->nfreezes,
+	    f->freeze_usecs / 1e3 / f->nfreezes, f->max_freeze_usecs / 1e3,
+	    f->ntimeouts, f->thaw_usecs / 1e3 / f->nfreezes);
+}
+
+void
+freeze_free(struct engine *eng)
+{
+	struct freezer *f = eng->freezer;
+	size_t i;
+
+	if (f == NULL)
+		return;
+	freeze_thaw(eng);
+	for (i = 0; i < f->ngroups; i++) {
+		(void)close(f->groups[i].freezefd);
+		(void)close(f->groups[i].eventsfd);
+		free(f->groups[i].path);
+	}
+	free(f->groups);
+	free(f);
+	eng->freezer = NULL;
+}
+
+#else /* !__linux__ */
+
+int
+freeze_add(struct engine *eng, const char *path)
+{
+	(void)eng;
+	fprintf(stderr, "%s: %s\n", path, strerror(ENOSYS));
+
+	return (-1);
+}
+
+void
+freeze_groups(struct engine *eng)
+{
+	(void)eng;
+}
+
+void
+freeze_thaw(struct engine *eng)
+{
+	(void)eng;
+}
+
+void
+freeze_stats(const struct engine *eng)
+{
+	(void)eng;
+}
+
+void
+freeze_free(struct engine *eng)
+{
+	(void)eng;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,589 @@
+/*
+ * Git index reader
+ *
+ * DETAILS:
+ *   Parses .git/index (versions 2 to 4, including split indexes) and queues
+ *   every tracked file with the ctime recorded in the index, so that after
+ *   copying or restoring a work tree "git status" only needs to stat(2) the
+ *   files instead of hashing them all again.
+ *
+ *   See Documentation/gitformat-index.txt in the git sources.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#define INDEX_SIGNATURE		0x44495243	/* "DIRC" */
+#define LINK_SIGNATURE		0x6c696e6b	/* "link" */
+
+#define CE_NAMEMASK		0x0fff
+#define CE_STAGEMASK		0x3000
+#define CE_EXTENDED		0x4000
+#define CE_INTENT_TO_ADD	0x2000		/* extended flags */
+#define CE_SKIP_WORKTREE	0x4000		/* extended flags */
+
+#define S_IFGITLINK		0160000
+
+/* Size of the stat data, mode, uid, gid & size fields of an entry */
+#define CE_STAT_SIZE		40
+
+struct gitentry {
+	char		*name;
+	uint32_t	 ctime_sec;
+	uint32_t	 ctime_nsec;
+	uint32_t	 mode;
+	int		 skip;		/* not checked out or deleted */
+};
+
+struct gitindex {
+	struct gitentry	*entries;
+	size_t		 nentries;
+	unsigned char	*link;		/* copy of the "link" extension */
+	size_t		 linklen;
+};
+
+static uint32_t
+get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static uint16_t
+get_be16(const unsigned char *p)
+{
+	return ((uint16_t)(p[0] << 8 | p[1]));
+}
+
+static uint64_t
+get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32 | get_be32(p + 4));
+}
+
+static void
+free_index(struct gitindex *idx)
+{
+	size_t i;
+
+	for (i = 0; i < idx->nentries; i++)
+		free(idx->entries[i].name);
+	free(idx->entries);
+	free(idx->link);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * Decodes the variable length integer used by index v4 path compression.
+ * Returns the number of bytes consumed or 0 on error
+ */
+static size_t
+decode_varint(const unsigned char *p, const unsigned char *end, size_t *val)
+{
+	const unsigned char *start = p;
+	size_t v;
+
+	if (p >= end)
+		return (0);
+	v = *p & 0x7f;
+	while (*p++ & 0x80) {
+		/* A corrupt index mustn't make huge lengths */
+		if (p >= end || v >= (SIZE_MAX >> 7) - 1)
+			return (0);
+		v = ((v + 1) << 7) | (*p & 0x7f);
+	}
+	*val = v;
+
+	return ((size_t)(p - start));
+}
+
+/*
+ * Parses the entries of an index file and keeps the link extension if any.
+ * Returns 0 on success, -1 on error
+ */
+static int
+parse_index(const char *file, const unsigned char *map, size_t len,
+    size_t hashsz, struct gitindex *idx)
+{
+	const unsigned char *p, *end = map + len - hashsz;
+	char *prev = NULL;
+	size_t prevlen = 0;
+	uint32_t version, n, i;
+
+	if (len < 12 + hashsz || get_be32(map) != INDEX_SIGNATURE) {
+		fprintf(stderr, "%s: not a git index\n", file);
+		return (-1);
+	}
+	version = get_be32(map + 4);
+	if (version < 2 || version > 4) {
+		fprintf(stderr, "%s: unsupported index version %u\n",
+		    file, version);
+		return (-1);
+	}
+	n = get_be32(map + 8);
+
+	if ((idx->entries = calloc(n ? n : 1, sizeof(*idx->entries))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	idx->nentries = n;
+
+	p = map + 12;
+	for (i = 0; i < n; i++) {
+		struct gitentry *ce = &idx->entries[i];
+		const unsigned char *start = p, *name;
+		size_t namelen, strip, off = CE_STAT_SIZE + hashsz + 2;
+		uint16_t flags, xflags = 0;
+
+		if (p + off > end)
+			goto corrupt;
+		flags = get_be16(p + off - 2);
+		if (flags & CE_EXTENDED) {
+			if (version < 3 || p + off + 2 > end)
+				goto corrupt;
+			xflags = get_be16(p + off);
+			off += 2;
+		}
+
+		ce->ctime_sec = get_be32(p);
+		ce->ctime_nsec = get_be32(p + 4);
+		ce->mode = get_be32(p + 24);
+		ce->skip = (flags & CE_STAGEMASK) != 0 ||
+		    (xflags & (CE_SKIP_WORKTREE | CE_INTENT_TO_ADD)) != 0 ||
+		    (ce->mode & S_IFMT) == S_IFGITLINK;
+
+		p += off;
+		if (version == 4) {
+			size_t k = decode_varint(p, end, &strip);
+
+			if (k == 0 || strip > prevlen)
+				goto corrupt;
+			p += k;
+		} else
+			strip = 0;
+
+		name = p;
+		if ((p = memchr(name, '\0', (size_t)(end - name))) == NULL)
+			goto corrupt;
+		namelen = (size_t)(p - name);
+
+		if ((ce->name = malloc(prevlen - strip + namelen + 1)) == NULL) {
+			perror("malloc()");
+			goto error;
+		}
+		if (version == 4) {
+			memcpy(ce->name, prev, prevlen - strip);
+			memcpy(ce->name + prevlen - strip, name, namelen + 1);
+			prev = ce->name;
+			prevlen = prevlen - strip + namelen;
+		} else {
+			if ((flags & CE_NAMEMASK) != CE_NAMEMASK &&
+			    (flags & CE_NAMEMASK) != namelen)
+				goto corrupt;
+			memcpy(ce->name, name, namelen + 1);
+			/* Entries are padded with NULs to a multiple of 8 */
+			p = start + ((off + namelen + 8) & ~(size_t)7);
+			if (p > end)
+				goto corrupt;
+			continue;
+		}
+		p++;
+	}
+
+	/* Extensions */
+	while (p + 8 <= end) {
+		uint32_t sig = get_be32(p), size = get_be32(p + 4);
+
+		p += 8;
+		if (size > (size_t)(end - p))
+			goto corrupt;
+		if (sig == LINK_SIGNATURE) {
+			if ((idx->link = malloc(size ? size : 1)) == NULL) {
+				perror("malloc()");
+				goto error;
+			}
+			memcpy(idx->link, p, size);
+			idx->linklen = size;
+		}
+		p += size;
+	}
+
+	return (0);
+
+corrupt:
+	fprintf(stderr, "%s: corrupt index\n", file);
+error:
+	free_index(idx);
+	return (-1);
+}
+
+/*
+ * Reads an index file into idx.  Returns 0 on success, -1 on error
+ */
+static int
+read_index(const char *file, size_t hashsz, struct gitindex *idx)
+{
+	struct stat st;
+	void *map;
+	int fd, status;
+
+	memset(idx, 0, sizeof(*idx));
+
+	while ((fd = open(file, O_RDONLY)) < 0) {
+		if (errno != EINTR) {
+			perror(file);
+			return (-1);
+		}
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(file);
+		(void)close(fd);
+		return (-1);
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		perror(file);
+		return (-1);
+	}
+
+	status = parse_index(file, map, (size_t)st.st_size, hashsz, idx);
+
+	(void)munmap(map, (size_t)st.st_size);
+
+	return (status);
+}
+
+/*
+ * Calls fn for every set bit of an EWAH compressed bitmap, in increasing
+ * order.  Returns the number of bytes consumed or 0 on error
+ */
+static size_t
+ewah_each_bit(const unsigned char *p, size_t len,
+    int (*fn)(size_t, void *), void *arg)
+{
+	size_t nwords, i, pos = 0;
+
+	if (len < 12)
+		return (0);
+	/* Skip the bit count */
+	nwords = get_be32(p + 4);
+	if (nwords > (len - 12) / 8)
+		return (0);
+	p += 8;
+
+	for (i = 0; i < nwords;) {
+		uint64_t rlw = get_be64(p + i * 8);
+		uint64_t run = (rlw >> 1) & 0xffffffffULL;
+		size_t lit = (size_t)(rlw >> 33), k, b;
+
+		if (rlw & 1) {
+			for (k = 0; k < run * 64; k++)
+				if (fn(pos + k, arg) < 0)
+					return (0);
+		}
+		pos += run * 64;
+
+		if (lit > nwords - i - 1)
+			return (0);
+		for (k = 1; k <= lit; k++) {
+			uint64_t word = get_be64(p + (i + k) * 8);
+
+			for (b = 0; b < 64; b++)
+				if ((word >> b) & 1)
+					if (fn(pos + b, arg) < 0)
+						return (0);
+			pos += 64;
+		}
+		i += 1 + lit;
+	}
+
+	/* Skip the words and the position of the last RLW */
+	return (8 + nwords * 8 + 4);
+}
+
+struct merge {
+	struct gitindex	*base;
+	struct gitindex	*split;
+	size_t		 nreplaced;
+};
+
+static int
+delete_entry(size_t pos, void *arg)
+{
+	struct merge *m = arg;
+
+	if (pos >= m->base->nentries)
+		return (-1);
+	m->base->entries[pos].skip = 1;
+
+	return (0);
+}
+
+static int
+replace_entry(size_t pos, void *arg)
+{
+	struct merge *m = arg;
+	struct gitentry *ce;
+
+	if (pos >= m->base->nentries || m->nreplaced >= m->split->nentries)
+		return (-1);
+
+	/* The replacing entry has an empty name and takes the shared one's */
+	ce = &m->split->entries[m->nreplaced++];
+	free(ce->name);
+	ce->name = m->base->entries[pos].name;
+	m->base->entries[pos].name = NULL;
+	m->base->entries[pos].skip = 1;
+
+	return (0);
+}
+
+/*
+ * Merges the shared index named by the link extension of split into it.
+ * Returns 0 on success, -1 on error
+ */
+static int
+merge_shared_index(const char *gitdir, size_t hashsz, struct gitindex *split)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct gitindex base;
+	struct merge m;
+	struct gitentry *v;
+	char *file, *s;
+	size_t i, k, len = split->linklen - hashsz;
+	const unsigned char *p = split->link + hashsz;
+	int status = -1;
+
+	for (i = 0; i < hashsz && split->link[i] == 0; i++)
+		;
+	if (i == hashsz)	/* null oid: not really split */
+		return (0);
+
+	if ((file = malloc(strlen(gitdir) + sizeof("/sharedindex.") +
+	    2 * hashsz)) == NULL) {
+		perror("malloc()");
+		return (-1);
+	}
+	s = file + sprintf(file, "%s/sharedindex.", gitdir);
+	for (i = 0; i < hashsz; i++) {
+		*s++ = hex[split->link[i] >> 4];
+		*s++ = hex[split->link[i] & 0xf];
+	}
+	*s = '\0';
+
+	if (read_index(file, hashsz, &base) < 0) {
+		free(file);
+		return (-1);
+	}
+
+	m.base = &base;
+	m.split = split;
+	m.nreplaced = 0;
+
+	if (len > 0) {
+		if ((k = ewah_each_bit(p, len, delete_entry, &m)) == 0 ||
+		    ewah_each_bit(p + k, len - k, replace_entry, &m) == 0) {
+			fprintf(stderr, "%s: corrupt link extension\n", file);
+			goto end;
+		}
+	}
+
+	/* Append the surviving shared entries */
+	v = realloc(split->entries,
+	    (split->nentries + base.nentries) * sizeof(*v));
+	if (v == NULL) {
+		perror("realloc()");
+		goto end;
+	}
+	split->entries = v;
+	for (i = 0; i < base.nentries; i++) {
+		if (base.entries[i].skip)
+			continue;
+		split->entries[split->nentries++] = base.entries[i];
+		base.entries[i].name = NULL;
+	}
+	status = 0;
+
+end:
+	free_index(&base);
+	free(file);
+	return (status);
+}
+
+/*
+ * Returns the malloc'ed path of the git directory of worktree,
+ * following "gitdir:" files used by linked worktrees & submodules
+ */
+static char *
+find_gitdir(const char *worktree)
+{
+	char buf[4096], *dotgit, *dir, *nl;
+	struct stat st;
+	FILE *fp;
+
+	if ((dotgit = malloc(strlen(worktree) + sizeof("/.git"))) == NULL) {
+		perror("malloc()");
+		return (NULL);
+	}
+	sprintf(dotgit, "%s/.git", worktree);
+
+	if (stat(dotgit, &st) < 0) {
+		perror(dotgit);
+		free(dotgit);
+		return (NULL);
+	}
+	if (S_ISDIR(st.st_mode))
+		return (dotgit);
+
+	if ((fp = fopen(dotgit, "r")) == NULL) {
+		perror(dotgit);
+		free(dotgit);
+		return (NULL);
+	}
+	if (fgets(buf, sizeof(buf), fp) == NULL ||
+	    strncmp(buf, "gitdir: ", 8) != 0) {
+		fprintf(stderr, "%s: invalid gitfile format\n", dotgit);
+		(void)fclose(fp);
+		free(dotgit);
+		return (NULL);
+	}
+	(void)fclose(fp);
+	free(dotgit);
+
+	if ((nl = strchr(buf, '\n')) != NULL)
+		*nl = '\0';
+	if (buf[8] == '/')
+		return (strdup(buf + 8));
+
+	if ((dir = malloc(strlen(worktree) + strlen(buf + 8) + 2)) == NULL) {
+		perror("malloc()");
+		return (NULL);
+	}
+	sprintf(dir, "%s/%s", worktree, buf + 8);
+
+	return (dir);
+}
+
+/*
+ * Returns the size of the object names used by the repository
+ */
+static size_t
+hash_size(const char *gitdir)
+{
+	char buf[4096], *file, *common = NULL;
+	size_t hashsz = 20;
+	FILE *fp;
+
+	if ((file = malloc(strlen(gitdir) + 4096 + sizeof("/commondir"))) == NULL)
+		return (hashsz);
+
+	/* Linked worktrees keep their config in the common directory */
+	sprintf(file, "%s/commondir", gitdir);
+	if ((fp = fopen(file, "r")) != NULL) {
+		if (fgets(buf, sizeof(buf), fp) != NULL) {
+			buf[strcspn(buf, "\n")] = '\0';
+			common = buf;
+		}
+		(void)fclose(fp);
+	}
+	if (common == NULL)
+		sprintf(file, "%s/config", gitdir);
+	else if (common[0] == '/')
+		sprintf(file, "%s/config", common);
+	else
+		sprintf(file, "%s/%s/config", gitdir, common);
+
+	if ((fp = fopen(file, "r")) != NULL) {
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			char *s = buf + strspn(buf, " \t");
+
+			if (strncasecmp(s, "objectformat", 12) == 0 &&
+			    strstr(s, "sha256") != NULL)
+				hashsz = 32;
+		}
+		(void)fclose(fp);
+	}
+	free(file);
+
+	return (hashsz);
+}
+
+/*
+ * Queues every file tracked by the git work tree with the ctime recorded
+ * in its index.  Returns 0 on success, -1 on error
+ */
+int
+gitindex_load(struct engine *eng, const char *worktree)
+{
+	struct gitindex idx;
+	struct timespec target;
+	char *gitdir, *file, *path;
+	size_t i, hashsz;
+	int status = -1;
+
+	if ((gitdir = find_gitdir(worktree)) == NULL)
+		return (-1);
+	hashsz = hash_size(gitdir);
+
+	if ((file = malloc(strlen(gitdir) + sizeof("/index"))) == NULL) {
+		perror("malloc()");
+		free(gitdir);
+		return (-1);
+	}
+	sprintf(file, "%s/index", gitdir);
+
+	if (read_index(file, hashsz, &idx) < 0)
+		goto end;
+
+	if (idx.link != NULL) {
+		if (idx.linklen < hashsz) {
+			fprintf(stderr, "%s: corrupt link extension\n", file);
+			goto end;
+		}
+		if (merge_shared_index(gitdir, hashsz, &idx) < 0)
+			goto end;
+	}
+
+	for (i = 0; i < idx.nentries; i++) {
+		struct gitentry *ce = &idx.entries[i];
+
+		if (ce->skip || ce->name == NULL || ce->name[0] == '\0')
+			continue;
+		/* A target of 0 would mean now */
+		if (ce->ctime_sec == 0 || ce->ctime_nsec >= 1000000000)
+			continue;
+
+		if ((path = malloc(strlen(worktree) + strlen(ce->name) + 2)) == NULL) {
+			perror("malloc()");
+			goto end;
+		}
+		sprintf(path, "%s/%s", worktree, ce->name);
+
+		/* Git built with USE_NSEC compares the nanoseconds too */
+		target.tv_sec = (time_t)ce->ctime_sec;
+		target.tv_nsec = (long)ce->ctime_nsec;
+
+		if (engine_add(eng, path, &target) < 0) {
+			free(path);
+			goto end;
+		}
+	}
+	status = 0;
+
+end:
+	free_index(&idx);
+	free(file);
+	free(gitdir);
+	return (status);
+}
@@ -0,0 +1,306 @@
+/*
+ * Host-wide arbitration
+ *
+ * DETAILS:
+ *   The clock is one for the whole host, so two runs stepping it at once
+ *   would restore each other's skewed time.  Runs take a lock on
+ *   HOST_LOCK with flock(2): the one holding it is the leader, the only
+ *   one to step the clock.  The leader also serves HOST_SOCK with the
+ *   daemon's protocol, & between its own chains stamps what the other runs
+ *   queued there: they hand their entries over through the shared memory
+ *   rings instead of waiting for the lock, so concurrent runs make bigger
+ *   batches rather than taking turns.  When it's done the leader removes
+ *   the socket, answers what was queued, drops its followers & releases
+ *   the lock: one of them becomes the next leader & the others follow it,
+ *   handing over again whatever wasn't answered.  Files are stamped with
+ *   the leader's options, but logged & synced by their own run.  Runs of
+ *   plain files don't serve when they lead, but follow like the others,
+ *   so they never wait behind a daemon.
+ *
+ *   Without the daemon (not on Linux) the lock alone serializes the runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+
+#include "touch2.h"
+
+/* How long followers wait between attempts to find a leader */
+#define HOST_RETRY_NSECS 10000000L
+
+struct host {
+	int		 lockfd;
+	int		 how;		/* HOST_JOIN, HOST_LEAD or HOST_LOCK_ONLY */
+	struct server	*server;	/* the leader's, if it serves */
+	struct conn	*conn;		/* a follower's */
+	/* Statistics */
+	size_t		 nserved;	/* files of followers stamped */
+	size_t		 nhanded;	/* files stamped by a leader */
+};
+
+/*
+ * Becomes the leader, serving followers if serve is set
+ */
+static void
+lead(struct engine *eng, struct host *h, int serve)
+{
+#ifdef __linux__
+	if (serve && (h->server = server_new()) != NULL &&
+	    server_listen(h->server, HOST_SOCK) < 0) {
+		/* Other runs will just wait for the lock */
+		server_free(h->server);
+		h->server = NULL;
+	}
+#else
+	(void)serve;
+#endif
+	if (eng->verbose)
+		fprintf(stderr, "touch2: leading the runs of the host\n");
+}
+
+/*
+ * Finds the leader & follows it, or becomes the leader.  Returns 0 on
+ * success, -1 on error
+ */
+static int
+elect(struct engine *eng, struct host *h)
+{
+	struct timespec ts = { 0, HOST_RETRY_NSECS };
+	int wait = (h->how == HOST_LEAD), r;
+
+	for (;;) {
+		if (wait)
+			r = flock(h->lockfd, LOCK_EX);
+		else
+			r = flock(h->lockfd, LOCK_EX | LOCK_NB);
+		if (r == 0) {
+			lead(eng, h, h->how != HOST_LOCK_ONLY);
+			return (0);
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EWOULDBLOCK) {
+			perror(HOST_LOCK);
+			return (-1);
+		}
+		/* Even a daemon leading for its whole life takes our files */
+		if ((h->conn = client_connect(HOST_SOCK)) != NULL) {
+			if (eng->verbose)
+				fprintf(stderr, "touch2: handing files to the "
+				    "leader of the host's runs\n");
+			return (0);
+		}
+#ifndef __linux__
+		wait = 1;
+		continue;
+#endif
+		/* The leader doesn't serve yet, or any more */
+		(void)nanosleep(&ts, NULL);
+	}
+}
+
+/*
+ * Joins the runs of the host: as leader or follower with HOST_JOIN, as
+ * a leader once the lock is free with HOST_LEAD, or with HOST_LOCK_ONLY
+ * as a leader serving no one or a follower.  Runs go on unarbitrated if
+ * the lock can't be opened.  Returns 0 on success, -1 on error
+ */
+int
+host_join(struct engine *eng, int how)
+{
+	struct host *h;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	if ((h->lockfd = open(HOST_LOCK, O_RDWR | O_CREAT | O_CLOEXEC,
+	    0600)) < 0) {
+		if (eng->verbose)
+			fprintf(stderr, "%s: %s, not arbitrating\n", HOST_LOCK,
+			    strerror(errno));
+		free(h);
+		return (0);
+	}
+	h->how = how;
+	if (elect(eng, h) < 0) {
+		(void)close(h->lockfd);
+		free(h);
+		return (-1);
+	}
+	eng->host = h;
+
+	return (0);
+}
+
+/*
+ * Returns the leader's server, or NULL
+ */
+struct server *
+host_server(const struct engine *eng)
+{
+	return ((eng->host != NULL) ? eng->host->server : NULL);
+}
+
+/*
+ * Returns whether this run hands its files to a leader
+ */
+int
+host_following(const struct engine *eng)
+{
+	return (eng->host != NULL && eng->host->conn != NULL);
+}
+
+/*
+ * Stamps what the followers queued.  Called by the leader between chains
+ */
+void
+host_serve(struct engine *eng)
+{
+#ifdef __linux__
+	struct host *h = eng->host;
+	struct trickle *trickle;
+	struct plan *plan;
+	size_t ntouched, nerrors;
+	FILE *undo;
+	int n;
+
+	if (h == NULL || h->server == NULL)
+		return;
+
+	/* The followers' files are their own run's to log, throttle & count */
+	undo = eng->undo;
+	plan = eng->plan;
+	trickle = eng->trickle;
+	ntouched = eng->ntouched;
+	nerrors = eng->nerrors;
+	eng->undo = NULL;
+	eng->plan = NULL;
+	eng->trickle = NULL;
+	if ((n = server_round(h->server, eng, 0)) > 0)
+		h->nserved += (size_t)n;
+	eng->undo = undo;
+	eng->plan = plan;
+	eng->trickle = trickle;
+	eng->ntouched = ntouched;
+	eng->nerrors = nerrors;
+#else
+	(void)eng;
+#endif
+}
+
+/*
+ * Has the leader stamp the n entries of v, or whatever it can before it
+ * goes away, after which this run may lead.  Moves the entries still to be
+ * stamped to the end of v.  Returns the index of the first of them, n if
+ * none
+ */
+size_t
+host_follow(struct engine *eng, struct entry *v, size_t n)
+{
+	struct host *h = eng->host;
+	struct entry e;
+	size_t i, k;
+	uint64_t t;
+	int r;
+
+	for (i = 0; h != NULL && h->conn != NULL && i < n;) {
+		t = trace_now(eng);
+		r = client_commit(eng, h->conn, v + i, n - i);
+		trace_span(eng, "handoff", t, n - i);
+
+		/* The answered ones go first, keeping their order */
+		for (k = i; k < n; k++) {
+			if (v[k].error == EINPROGRESS)
+				continue;
+			if (v[k].error == 0) {
+				eng->ntouched++;
+				h->nhanded++;
+				if (eng->durable && durable_note(eng, &v[k]) < 0)
+					eng->nerrors++;
+			} else {
+				fprintf(stderr, "%s: %s\n", v[k].path,
+				    strerror(v[k].error));
+				eng->nerrors++;
+			}
+			e = v[k];
+			memmove(&v[i + 1], &v[i], (k - i) * sizeof(*v));
+			v[i++] = e;
+		}
+		if (r == 0)
+			break;
+
+		client_close(h->conn);
+		h->conn = NULL;
+		if (elect(eng, h) < 0) {
+			for (k = i; k < n; k++)
+				v[k].error = EAGAIN;
+			eng->nerrors += n - i;
+			return (n);
+		}
+	}
+
+	return (i);
+}
+
+static void
+host_stats(const struct engine *eng)
+{
+	const struct host *h = eng->host;
+
+	if (h->nhanded != 0)
+		fprintf(stderr, "touch2: %zu files stamped by the leader of "
+		    "the host's runs\n", h->nhanded);
+#ifdef __linux__
+	if (h->server != NULL && h->nserved != 0)
+		fprintf(stderr, "touch2: %zu files stamped for %u other runs\n",
+		    h->nserved, server_clients(h->server));
+#endif
+}
+
+/*
+ * Leaves the runs of the host, answering the followers first if leading.
+ * Returns 0 on success, -1 on error
+ */
+int
+host_leave(struct engine *eng)
+{
+	struct host *h = eng->host;
+	int status = 0;
+
+	if (h == NULL)
+		return (0);
+#ifdef __linux__
+	if (h->server != NULL) {
+		int n;
+
+		/* Newcomers wait for the lock from now on */
+		server_unlisten(h->server);
+		while (server_pending(h->server)) {
+			if ((n = server_round(h->server, eng, 1)) < 0) {
+				status = -1;
+				break;
+			}
+			h->nserved += (size_t)n;
+		}
+	}
+#endif
+	if (eng->verbose)
+		host_stats(eng);
+#ifdef __linux__
+	/* Its followers elect the next leader */
+	server_free(h->server);
+#endif
+	client_close(h->conn);
+	(void)close(h->lockfd);
+	eng->host = NULL;
+	free(h);
+
+	return (status);
+}
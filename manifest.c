@@ -0,0 +1,410 @@
+/*
+ * Manifests
+ *
+ * DETAILS:
+ *   A manifest lists files with the ctime each one should get, one per line
+ *   (or NUL terminated with -0) as "seconds.nanoseconds path".
+ *
+ *   Manifests can have hundreds of millions of lines, so regular files are
+ *   mapped instead of read, split into one chunk per CPU at line boundaries
+ *   and parsed in parallel.  The mapping is private & writable: each line
+ *   is terminated in place, and the entries keep pointing into it rather
+ *   than into a copy of every path.  zstd compressed manifests are streamed
+ *   through zstd(1), run from ZSTD_PATH rather than looked up in PATH, as
+ *   touch2 runs as root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "touch2.h"
+
+#ifndef ZSTD_PATH
+#define ZSTD_PATH	"/usr/bin/zstd"
+#endif
+
+/*
+ * Parses "seconds[.nanoseconds]" and returns a pointer past it, or NULL
+ */
+const char *
+parse_timespec(const char *s, struct timespec *ts)
+{
+	char *end;
+	long nsec = 0;
+	int digits = 0, neg;
+
+	/* strtoll() drops the sign of "-0" */
+	neg = s[strspn(s, " \t\n\v\f\r")] == '-';
+	errno = 0;
+	ts->tv_sec = (time_t)strtoll(s, &end, 10);
+	if (end == s || errno != 0)
+		return (NULL);
+	s = end;
+	if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++) {
+			if (digits++ < 9)
+				nsec = nsec * 10 + (*s - '0');
+		}
+		for (; digits < 9; digits++)
+			nsec *= 10;
+	}
+	/* -1.5 is 1.5s before the epoch, i.e. -2s + 0.5s */
+	if (neg && nsec != 0) {
+		ts->tv_sec -= 1;
+		nsec = 1000000000 - nsec;
+	}
+	ts->tv_nsec = nsec;
+
+	return (s);
+}
+
+/*
+ * Parses a manifest line into path & target.  Returns 0 on success, -1 on
+ * a malformed line
+ */
+int
+manifest_parse(const char *line, struct timespec *target, const char **path)
+{
+	const char *s;
+
+	if ((s = parse_timespec(line, target)) == NULL || *s != ' ' ||
+	    s[1] == '\0')
+		return (-1);
+	*path = s + 1;
+
+	return (0);
+}
+
+/* Don't spread less than this on another thread */
+#define MIN_CHUNK	(1 << 20)
+#define MAX_THREADS	64
+
+#define ZSTD_MAGIC	"\x28\xb5\x2f\xfd"
+
+struct record {
+	char		*path;
+	struct timespec	 target;
+};
+
+/* A chunk of a mapped manifest & what was parsed out of it */
+struct chunk {
+	pthread_t	 thread;
+	char		*start;
+	char		*end;
+	int		 sep;
+	struct record	*records;
+	size_t		 nrecords;
+	size_t		 nlines;
+	size_t		*bad;		/* line numbers within the chunk */
+	size_t		 nbad;
+	int		 error;
+};
+
+/*
+ * Queues the files of a manifest read from fp.
+ * Returns 0 on success, -1 on error
+ */
+static int
+load_stream(struct engine *eng, FILE *fp, const char *file, int sep)
+{
+	struct timespec target;
+	const char *name;
+	char *line = NULL, *path;
+	size_t size = 0, lineno = 0;
+	ssize_t len;
+	int status = 0;
+
+	while ((len = getdelim(&line, &size, sep, fp)) > 0) {
+		lineno++;
+		if (line[len - 1] == sep)
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		if (manifest_parse(line, &target, &name) < 0) {
+			fprintf(stderr, "%s:%zu: malformed line\n", file, lineno);
+			eng->nerrors++;
+			continue;
+		}
+		if ((path = strdup(name)) == NULL) {
+			perror("strdup()");
+			status = -1;
+			break;
+		}
+		if (engine_add(eng, path, &target) < 0) {
+			free(path);
+			status = -1;
+			break;
+		}
+	}
+	if (ferror(fp)) {
+		perror(file);
+		status = -1;
+	}
+	free(line);
+
+	return (status);
+}
+
+/*
+ * Streams the zstd compressed manifest open on fd through zstd(1).
+ * Returns 0 on success, -1 on error
+ */
+static int
+load_zstd(struct engine *eng, int fd, const char *file, int sep)
+{
+	char *argv[] = { "zstd", "-dcq", NULL };
+	int pfd[2], wstatus, status;
+	pid_t pid;
+	FILE *fp;
+
+	if (pipe(pfd) < 0) {
+		perror("pipe()");
+		return (-1);
+	}
+	if ((pid = fork()) < 0) {
+		perror("fork()");
+		(void)close(pfd[0]);
+		(void)close(pfd[1]);
+		return (-1);
+	}
+	if (pid == 0) {
+		if (dup2(fd, STDIN_FILENO) < 0 || dup2(pfd[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		(void)close(pfd[0]);
+		(void)close(pfd[1]);
+		execv(ZSTD_PATH, argv);
+		perror(ZSTD_PATH);
+		_exit(127);
+	}
+	(void)close(pfd[1]);
+
+	if ((fp = fdopen(pfd[0], "r")) == NULL) {
+		perror("fdopen()");
+		(void)close(pfd[0]);
+		status = -1;
+	} else {
+		status = load_stream(eng, fp, file, sep);
+		(void)fclose(fp);
+	}
+
+	while (waitpid(pid, &wstatus, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waitpid()");
+			return (-1);
+		}
+	}
+	if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+		fprintf(stderr, "%s: zstd failed\n", file);
+		status = -1;
+	}
+
+	return (status);
+}
+
+static void *
+parse_chunk(void *arg)
+{
+	struct chunk *c = arg;
+	struct timespec target;
+	const char *name;
+	char *p, *q;
+	size_t size = 0;
+
+	for (p = c->start; p < c->end; p = q + 1) {
+		/* memchr() scans a word or a vector at a time */
+		if ((q = memchr(p, c->sep, (size_t)(c->end - p))) == NULL)
+			q = c->end;		/* the extra byte past the file */
+		*q = '\0';
+		c->nlines++;
+		if (q == p)
+			continue;
+
+		if (manifest_parse(p, &target, &name) < 0) {
+			size_t *v;
+
+			if ((v = realloc(c->bad, (c->nbad + 1) * sizeof(*v))) == NULL) {
+				c->error = errno;
+				break;
+			}
+			c->bad = v;
+			c->bad[c->nbad++] = c->nlines;
+			continue;
+		}
+		if (c->nrecords == size) {
+			struct record *v;
+
+			size = size ? size * 2 : 4096;
+			if ((v = realloc(c->records, size * sizeof(*v))) == NULL) {
+				c->error = errno;
+				break;
+			}
+			c->records = v;
+		}
+		c->records[c->nrecords].path = (char *)name;
+		c->records[c->nrecords].target = target;
+		c->nrecords++;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Maps the regular file manifest open on fd & parses it in parallel.
+ * Returns 0 on success, -1 on error
+ */
+static int
+load_mapped(struct engine *eng, int fd, size_t len, const char *file, int sep)
+{
+	struct chunk chunks[MAX_THREADS];
+	size_t nchunks, i, k, lineno = 0;
+	char *map, *p;
+	long ncpus;
+	int status = 0;
+
+	/*
+	 * One byte more than the file, so that a last line without separator
+	 * can be terminated too: reserve anonymous memory & map the file over
+	 */
+	map = mmap(NULL, len + 1, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap()");
+		return (-1);
+	}
+	if (mmap(map, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	    fd, 0) == MAP_FAILED) {
+		perror(file);
+		(void)munmap(map, len + 1);
+		return (-1);
+	}
+	(void)madvise(map, len, MADV_SEQUENTIAL);
+	eng->pathmap = map;
+	eng->pathmaplen = len + 1;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpus = 1;
+	nchunks = len / MIN_CHUNK + 1;
+	if (nchunks > (size_t)ncpus)
+		nchunks = (size_t)ncpus;
+	if (nchunks > MAX_THREADS)
+		nchunks = MAX_THREADS;
+
+	/* Cut after the first separator past every nth of the file */
+	memset(chunks, 0, sizeof(chunks));
+	p = map;
+	for (i = 0; i < nchunks; i++) {
+		char *end = map + len / nchunks * (i + 1);
+
+		if (end < p)
+			end = p;
+		if (i == nchunks - 1)
+			end = map + len;
+		else if ((end = memchr(end, sep, (size_t)(map + len - end))) == NULL)
+			end = map + len;
+		else
+			end++;
+		chunks[i].start = p;
+		chunks[i].end = end;
+		chunks[i].sep = sep;
+		p = end;
+	}
+
+	for (i = 1; i < nchunks; i++) {
+		/* Parse it here instead if there's no thread */
+		if (pthread_create(&chunks[i].thread, NULL, parse_chunk,
+		    &chunks[i]) != 0)
+			chunks[i].thread = pthread_self();
+	}
+	parse_chunk(&chunks[0]);
+	for (i = 1; i < nchunks; i++) {
+		if (pthread_equal(chunks[i].thread, pthread_self()))
+			parse_chunk(&chunks[i]);
+		else
+			(void)pthread_join(chunks[i].thread, NULL);
+	}
+
+	/* Queue in file order */
+	for (i = 0; i < nchunks; i++) {
+		struct chunk *c = &chunks[i];
+
+		if (c->error != 0 && status == 0) {
+			fprintf(stderr, "%s: %s\n", file, strerror(c->error));
+			status = -1;
+		}
+		for (k = 0; k < c->nbad; k++) {
+			fprintf(stderr, "%s:%zu: malformed line\n", file,
+			    lineno + c->bad[k]);
+			eng->nerrors++;
+		}
+		for (k = 0; k < c->nrecords && status == 0; k++)
+			if (engine_add(eng, c->records[k].path,
+			    &c->records[k].target) < 0)
+				status = -1;
+		lineno += c->nlines;
+		free(c->records);
+		free(c->bad);
+	}
+
+	return (status);
+}
+
+/*
+ * Queues every file listed in the manifest ("-" for stdin).
+ * Returns 0 on success, -1 on error
+ */
+int
+manifest_load(struct engine *eng, const char *file, int sep)
+{
+	char magic[4];
+	struct stat st;
+	FILE *fp;
+	int fd, status;
+
+	if (strcmp(file, "-") == 0)
+		return (load_stream(eng, stdin, file, sep));
+
+	while ((fd = open(file, O_RDONLY)) < 0) {
+		if (errno != EINTR) {
+			perror(file);
+			return (-1);
+		}
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(file);
+		(void)close(fd);
+		return (-1);
+	}
+
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    memcmp(magic, ZSTD_MAGIC, sizeof(magic)) == 0) {
+		status = load_zstd(eng, fd, file, sep);
+		(void)close(fd);
+		return (status);
+	}
+
+	/* Only one manifest can be mapped */
+	if (S_ISREG(st.st_mode) && st.st_size > 0 && eng->pathmap == NULL) {
+		status = load_mapped(eng, fd, (size_t)st.st_size, file, sep);
+		(void)close(fd);
+		return (status);
+	}
+
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		perror(file);
+		(void)close(fd);
+		return (-1);
+	}
+	status = load_stream(eng, fp, file, sep);
+	(void)fclose(fp);
+
+	return (status);
+}
@@ -0,0 +1,419 @@
+/*
+ * Container mount namespaces
+ *
+ * DETAILS:
+ *   The clock is the host's, so the files of running containers can be
+ *   stamped in the same windows as any other, from one process, instead of
+ *   running touch2 in each of them.  --mount-ns PID opens the root & the
+ *   working directory of the process through /proc/PID/root & /proc/PID/cwd,
+ *   which lead into its mount namespace, and keeps them open: paths are then
+ *   looked up through /proc/self/fd, so they still lead to the same
+ *   namespace if the process exits & its PID is reused.  Trees & git work
+ *   trees are walked once per namespace, and manifest entries are stamped in
+ *   each of them; absolute paths start at the root, relative ones at the
+ *   working directory.  The files stamped are opened with openat2(2)
+ *   (Linux 5.6) & touched through that descriptor only: absolute symlinks
+ *   & ".." resolve as in the container, with RESOLVE_IN_ROOT, & relative
+ *   paths may not leave the working directory, as its place in the root is
+ *   unknown.  The paths given, the directories walked & the gitdir of
+ *   linked work trees are still looked up from our root; a file found that
+ *   way is skipped unless the lookup inside leads to the same inode.
+ *   Shards are chosen by the paths inside the namespaces, as descriptor
+ *   numbers depend on the order of the options.  Linux only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "touch2.h"
+
+struct mountns {
+	pid_t		 pid;
+	int		 rootfd;	/* O_PATH on /proc/PID/root */
+	int		 cwdfd;		/* O_PATH on /proc/PID/cwd */
+};
+
+#ifdef __linux__
+
+/* Linux 5.6, the same number on every architecture but alpha */
+#if !defined(__NR_openat2) && !defined(__alpha__)
+#define __NR_openat2	437
+#endif
+
+#ifndef RESOLVE_IN_ROOT
+#define RESOLVE_NO_MAGICLINKS	0x02
+#define RESOLVE_BENEATH		0x08
+#define RESOLVE_IN_ROOT		0x10
+#endif
+
+/* struct open_how, which not every libc declares */
+struct how {
+	uint64_t	 flags;
+	uint64_t	 mode;
+	uint64_t	 resolve;
+};
+
+/*
+ * Adds the mount namespace of the process pid.  Returns 0 on success, -1
+ * on error
+ */
+int
+mountns_add(struct engine *eng, const char *pid)
+{
+	struct mountns *m;
+	char path[64], *end;
+	long n;
+
+	errno = 0;
+	n = strtol(pid, &end, 10);
+	if (errno != 0 || *end != '\0' || n <= 0 || n != (pid_t)n) {
+		fprintf(stderr, "--mount-ns: bad PID \"%s\"\n", pid);
+		return (-1);
+	}
+
+	if ((m = realloc(eng->mountns, (eng->nmountns + 1) * sizeof(*m))) ==
+	    NULL) {
+		perror("realloc()");
+		return (-1);
+	}
+	eng->mountns = m;
+	m = &eng->mountns[eng->nmountns];
+	m->pid = (pid_t)n;
+
+	(void)snprintf(path, sizeof(path), "/proc/%ld/root", n);
+	if ((m->rootfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		perror(path);
+		return (-1);
+	}
+	(void)snprintf(path, sizeof(path), "/proc/%ld/cwd", n);
+	if ((m->cwdfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		perror(path);
+		(void)close(m->rootfd);
+		return (-1);
+	}
+	eng->nmountns++;
+
+	return (0);
+}
+
+/*
+ * Prints where the paths of each mount namespace lead, as they are
+ * reported
+ */
+void
+mountns_print(const struct engine *eng)
+{
+	const struct mountns *m;
+	size_t k;
+
+	for (k = 0; k < eng->nmountns; k++) {
+		m = &eng->mountns[k];
+		fprintf(stderr, "touch2: /proc/self/fd/%d is the root of PID %ld, "
+		    "/proc/self/fd/%d its working directory\n", m->rootfd,
+		    (long)m->pid, m->cwdfd);
+	}
+}
+
+/*
+ * Returns the path leading to path in the kth mount namespace, to be
+ * freed, or NULL on error
+ */
+char *
+mountns_path(const struct engine *eng, size_t k, const char *path)
+{
+	const struct mountns *m = &eng->mountns[k];
+	char *p;
+
+	if (asprintf(&p, "/proc/self/fd/%d%s%s",
+	    (*path == '/') ? m->rootfd : m->cwdfd,
+	    (*path == '/') ? "" : "/", path) < 0) {
+		perror("asprintf()");
+		return (NULL);
+	}
+
+	return (p);
+}
+
+/*
+ * Returns path as it is inside its mount namespace, past the prefix added
+ * by mountns_path(), setting *dirfd to the root or working directory it
+ * starts at, or path itself with *dirfd set to -1
+ */
+static const char *
+split(const struct engine *eng, const char *path, int *dirfd)
+{
+	static const char prefix[] = "/proc/self/fd/";
+	const char *p;
+	char *end;
+	long fd;
+	size_t k;
+
+	*dirfd = -1;
+	if (strncmp(path, prefix, sizeof(prefix) - 1) != 0)
+		return (path);
+	p = path + sizeof(prefix) - 1;
+	if (*p < '0' || *p > '9')
+		return (path);
+	fd = strtol(p, &end, 10);
+	if (*end != '/')
+		return (path);
+	for (k = 0; k < eng->nmountns; k++) {
+		if (fd == eng->mountns[k].rootfd) {
+			*dirfd = eng->mountns[k].rootfd;
+			return (end);
+		}
+		if (fd == eng->mountns[k].cwdfd) {
+			*dirfd = eng->mountns[k].cwdfd;
+			return (end + 1);
+		}
+	}
+
+	return (path);
+}
+
+/*
+ * Returns path as it is inside its mount namespace, so that shards don't
+ * depend on descriptor numbers
+ */
+const char *
+mountns_strip(const struct engine *eng, const char *path)
+{
+	int dirfd;
+
+	return (split(eng, path, &dirfd));
+}
+
+/*
+ * Opens path with the flags of open(2), looking a path from mountns_path()
+ * up inside its mount namespace only.  Returns the descriptor, or -1 with
+ * errno set
+ */
+int
+mountns_open(const struct engine *eng, const char *path, int flags)
+{
+	struct how how;
+	const char *rel;
+	int dirfd;
+
+	rel = split(eng, path, &dirfd);
+	if (dirfd < 0)
+		return (open(path, flags));
+
+	/* Only paths from the root start with a slash */
+	memset(&how, 0, sizeof(how));
+	how.flags = (uint64_t)flags;
+	how.resolve = RESOLVE_NO_MAGICLINKS |
+	    ((*rel == '/') ? RESOLVE_IN_ROOT : RESOLVE_BENEATH);
+
+	return ((int)syscall(__NR_openat2, dirfd, rel, &how, sizeof(how)));
+}
+
+/*
+ * Like lstat(2), looking path up as mountns_open() does.  Returns 0 on
+ * success, -1 with errno set
+ */
+int
+mountns_lstat(const struct engine *eng, const char *path, struct stat *st)
+{
+	int fd, r, error;
+
+	if (mountns_strip(eng, path) == path)
+		return (lstat(path, st));
+
+	if ((fd = mountns_open(eng, path, O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return (-1);
+	r = fstat(fd, st);
+	error = errno;
+	(void)close(fd);
+	errno = error;
+
+	return (r);
+}
+
+/*
+ * Returns the NULL terminated list of the paths leading to the n paths of
+ * v in every mount namespace, to be freed with mountns_free_paths(), or
+ * NULL on error
+ */
+char **
+mountns_paths(const struct engine *eng, char **v, size_t n)
+{
+	char **paths;
+	size_t i, k;
+
+	if ((paths = calloc(n * eng->nmountns + 1, sizeof(*paths))) == NULL) {
+		perror("calloc()");
+		return (NULL);
+	}
+	for (k = 0; k < eng->nmountns; k++)
+		for (i = 0; i < n; i++)
+			if ((paths[k * n + i] = mountns_path(eng, k, v[i])) ==
+			    NULL) {
+				mountns_free_paths(paths);
+				return (NULL);
+			}
+
+	return (paths);
+}
+
+void
+mountns_free_paths(char **paths)
+{
+	size_t i;
+
+	for (i = 0; paths != NULL && paths[i] != NULL; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+/*
+ * Replaces the entries added so far by their copies in every mount
+ * namespace.  Returns 0 on success, -1 on error
+ */
+int
+mountns_expand(struct engine *eng)
+{
+	struct entry *v;
+	size_t n = eng->nentries, i, k, j = 0;
+
+	if (n == 0)
+		return (0);
+	/* They were sharded by their own paths already */
+	if ((v = calloc(n * eng->nmountns, sizeof(*v))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	for (k = 0; k < eng->nmountns; k++)
+		for (i = 0; i < n; i++, j++) {
+			v[j] = eng->entries[i];
+			if ((v[j].path = mountns_path(eng, k,
+			    eng->entries[i].path)) == NULL)
+				goto fail;
+		}
+
+	for (i = 0; i < n; i++)
+		engine_free_path(eng, eng->entries[i].path);
+	free(eng->entries);
+	eng->entries = v;
+	eng->nentries = eng->size = j;
+
+	return (0);
+
+fail:
+	while (j-- > 0)
+		free(v[j].path);
+	free(v);
+
+	return (-1);
+}
+
+void
+mountns_free(struct engine *eng)
+{
+	size_t k;
+
+	for (k = 0; k < eng->nmountns; k++) {
+		(void)close(eng->mountns[k].rootfd);
+		(void)close(eng->mountns[k].cwdfd);
+	}
+	free(eng->mountns);
+	eng->mountns = NULL;
+	eng->nmountns = 0;
+}
+
+#else /* !__linux__ */
+
+int
+mountns_add(struct engine *eng, const char *pid)
+{
+	(void)eng;
+	fprintf(stderr, "--mount-ns %s: %s\n", pid, strerror(ENOSYS));
+
+	return (-1);
+}
+
+void
+mountns_print(const struct engine *eng)
+{
+	(void)eng;
+}
+
+char *
+mountns_path(const struct engine *eng, size_t k, const char *path)
+{
+	(void)eng;
+	(void)k;
+	(void)path;
+
+	return (NULL);
+}
+
+const char *
+mountns_strip(const struct engine *eng, const char *path)
+{
+	(void)eng;
+
+	return (path);
+}
+
+int
+mountns_open(const struct engine *eng, const char *path, int flags)
+{
+	(void)eng;
+
+	return (open(path, flags));
+}
+
+int
+mountns_lstat(const struct engine *eng, const char *path, struct stat *st)
+{
+	(void)eng;
+
+	return (lstat(path, st));
+}
+
+char **
+mountns_paths(const struct engine *eng, char **v, size_t n)
+{
+	(void)eng;
+	(void)v;
+	(void)n;
+
+	return (NULL);
+}
+
+void
+mountns_free_paths(char **paths)
+{
+	(void)paths;
+}
+
+int
+mountns_expand(struct engine *eng)
+{
+	(void)eng;
+
+	return (-1);
+}
+
+void
+mountns_free(struct engine *eng)
+{
+	(void)eng;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,392 @@
+/*
+ * NUMA placement
+ *
+ * DETAILS:
+ *   On multi-socket hosts the inodes & dentries of a filesystem are best
+ *   looked up from the node its device is attached to.  The topology comes
+ *   from sysfs: the CPUs of every node from its cpulist, restricted to
+ *   those we may run on, & the node of every mounted block device from the
+ *   numa_node of its device, or of the device's parent for a partition or
+ *   an NVMe namespace.  Paths are mapped to nodes by the longest mount point
+ *   leading to them, relative paths by the working directory's.  Hosts with
+ *   a single node get no placement at all.  Linux only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "touch2.h"
+
+#ifdef __linux__
+
+#ifndef NUMA_SYSFS
+#define NUMA_SYSFS	"/sys"
+#endif
+
+/* The most nodes looked for */
+#define NUMA_MAX_NODES	64
+
+struct numa_mount {
+	char		*dir;
+	size_t		 len;
+	dev_t		 dev;
+	int		 node;
+};
+
+struct numa {
+	int		 nnodes;
+	int		 ids[NUMA_MAX_NODES];	/* as in sysfs */
+	cpu_set_t	 cpus[NUMA_MAX_NODES];
+	int		 ncpus[NUMA_MAX_NODES];
+	struct numa_mount *mounts;	/* on a known node, longest first */
+	size_t		 nmounts;
+	int		 cwdnode;
+};
+
+/*
+ * Parses a sysfs list such as "0-3,8,10-11", calling fn with every number.
+ * Returns 0 on success, -1 on error
+ */
+static int
+parse_list(const char *file, void (*fn)(void *, long), void *arg)
+{
+	char buf[4096], *p, *end;
+	long lo, hi;
+	FILE *fp;
+
+	if ((fp = fopen(file, "re")) == NULL)
+		return (-1);
+	p = fgets(buf, sizeof(buf), fp);
+	(void)fclose(fp);
+	if (p == NULL)
+		return (-1);
+
+	while (*p != '\0' && *p != '\n') {
+		lo = hi = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			return (-1);
+		if (*end == '-' && ((hi = strtol(end + 1, &end, 10)) < lo))
+			return (-1);
+		for (; lo <= hi; lo++)
+			fn(arg, lo);
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	return (0);
+}
+
+static void
+add_node(void *arg, long id)
+{
+	struct numa *n = arg;
+
+	if (n->nnodes < NUMA_MAX_NODES)
+		n->ids[n->nnodes++] = (int)id;
+}
+
+static void
+add_cpu(void *arg, long cpu)
+{
+	if (cpu < CPU_SETSIZE)
+		CPU_SET((int)cpu, (cpu_set_t *)arg);
+}
+
+/*
+ * Returns the node of a block device, or -1
+ */
+static int
+dev_node(const struct numa *n, dev_t dev)
+{
+	static const char *links[] = {
+		"device/numa_node",		/* disks */
+		"../device/numa_node",		/* their partitions */
+		"device/device/numa_node",	/* NVMe namespaces */
+		"../device/device/numa_node"
+	};
+	char file[128];
+	FILE *fp;
+	size_t i;
+	int id, k;
+
+	for (i = 0; i < sizeof(links) / sizeof(*links); i++) {
+		(void)snprintf(file, sizeof(file), "%s/dev/block/%u:%u/%s",
+		    NUMA_SYSFS, major(dev), minor(dev), links[i]);
+		if ((fp = fopen(file, "re")) == NULL)
+			continue;
+		k = fscanf(fp, "%d", &id);
+		(void)fclose(fp);
+		if (k != 1 || id < 0)
+			return (-1);
+		for (k = 0; k < n->nnodes; k++)
+			if (n->ids[k] == id)
+				return (k);
+		return (-1);
+	}
+
+	return (-1);
+}
+
+/*
+ * Undoes the octal escapes of /proc/self/mountinfo in place
+ */
+static void
+unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s != '\0'; s++, d++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d = (char)((s[1] - '0') << 6 | (s[2] - '0') << 3 |
+			    (s[3] - '0'));
+			s += 3;
+		} else
+			*d = *s;
+	}
+	*d = '\0';
+}
+
+static int
+mountcmp(const void *a, const void *b)
+{
+	const struct numa_mount *ma = a, *mb = b;
+
+	return ((ma->len > mb->len) ? -1 : (ma->len < mb->len));
+}
+
+/*
+ * Reads the mounts of block devices on a known node.  Returns 0 on
+ * success, -1 on error
+ */
+static int
+read_mounts(struct numa *n)
+{
+	char line[PATH_MAX * 2], dir[PATH_MAX];
+	struct numa_mount *m;
+	unsigned int maj, min;
+	FILE *fp;
+	int node;
+
+	if ((fp = fopen("/proc/self/mountinfo", "re")) == NULL)
+		return (-1);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%*d %*d %u:%u %*s %4095s", &maj, &min,
+		    dir) != 3 || maj == 0)
+			continue;
+		if ((node = dev_node(n, makedev(maj, min))) < 0)
+			continue;
+		if ((m = realloc(n->mounts, (n->nmounts + 1) * sizeof(*m))) ==
+		    NULL) {
+			(void)fclose(fp);
+			return (-1);
+		}
+		n->mounts = m;
+		m = &n->mounts[n->nmounts];
+		unescape(dir);
+		if ((m->dir = strdup(dir)) == NULL) {
+			(void)fclose(fp);
+			return (-1);
+		}
+		/* "/" is the prefix of everything */
+		m->len = (strcmp(dir, "/") == 0) ? 0 : strlen(dir);
+		m->dev = makedev(maj, min);
+		m->node = node;
+		n->nmounts++;
+	}
+	(void)fclose(fp);
+	qsort(n->mounts, n->nmounts, sizeof(*n->mounts), mountcmp);
+
+	return (0);
+}
+
+/*
+ * Returns the topology of the host, or NULL if it has a single node
+ */
+struct numa *
+numa_open(void)
+{
+	struct numa *n;
+	cpu_set_t allowed;
+	char file[128], cwd[PATH_MAX];
+	int i, k;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		return (NULL);
+	if (parse_list(NUMA_SYSFS "/devices/system/node/online", add_node,
+	    n) < 0 || n->nnodes < 2 ||
+	    sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		free(n);
+		return (NULL);
+	}
+
+	/* Nodes without CPUs we may use, like CXL memory, can't be used */
+	for (i = k = 0; i < n->nnodes; i++) {
+		(void)snprintf(file, sizeof(file),
+		    "%s/devices/system/node/node%d/cpulist", NUMA_SYSFS,
+		    n->ids[i]);
+		CPU_ZERO(&n->cpus[k]);
+		if (parse_list(file, add_cpu, &n->cpus[k]) < 0)
+			continue;
+		CPU_AND(&n->cpus[k], &n->cpus[k], &allowed);
+		if ((n->ncpus[k] = CPU_COUNT(&n->cpus[k])) == 0)
+			continue;
+		n->ids[k++] = n->ids[i];
+	}
+	n->nnodes = k;
+	if (n->nnodes < 2 || read_mounts(n) < 0) {
+		numa_close(n);
+		return (NULL);
+	}
+	n->cwdnode = (getcwd(cwd, sizeof(cwd)) != NULL) ?
+	    numa_path_node(n, cwd) : -1;
+
+	return (n);
+}
+
+void
+numa_close(struct numa *n)
+{
+	size_t i;
+
+	if (n == NULL)
+		return;
+	for (i = 0; i < n->nmounts; i++)
+		free(n->mounts[i].dir);
+	free(n->mounts);
+	free(n);
+}
+
+int
+numa_nodes(const struct numa *n)
+{
+	return (n->nnodes);
+}
+
+int
+numa_cpus(const struct numa *n, int node)
+{
+	return (n->ncpus[node]);
+}
+
+/*
+ * Returns the node of the filesystem of path, or -1
+ */
+int
+numa_path_node(const struct numa *n, const char *path)
+{
+	const struct numa_mount *m;
+	size_t i;
+
+	if (*path != '/')
+		return (n->cwdnode);
+	for (i = 0; i < n->nmounts; i++) {
+		m = &n->mounts[i];
+		if (strncmp(path, m->dir, m->len) == 0 &&
+		    (path[m->len] == '/' || path[m->len] == '\0'))
+			return (m->node);
+	}
+
+	return (-1);
+}
+
+/*
+ * Returns the node of the block device dev, or -1
+ */
+int
+numa_dev_node(const struct numa *n, dev_t dev)
+{
+	size_t i;
+
+	for (i = 0; i < n->nmounts; i++)
+		if (n->mounts[i].dev == dev)
+			return (n->mounts[i].node);
+
+	return (-1);
+}
+
+/*
+ * Keeps the calling thread on the CPUs of node.  Returns 0 on success, -1
+ * on error
+ */
+int
+numa_pin(const struct numa *n, int node)
+{
+	int error;
+
+	if ((error = pthread_setaffinity_np(pthread_self(),
+	    sizeof(n->cpus[node]), &n->cpus[node])) != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+#else /* !__linux__ */
+
+struct numa *
+numa_open(void)
+{
+	return (NULL);
+}
+
+void
+numa_close(struct numa *n)
+{
+	(void)n;
+}
+
+int
+numa_nodes(const struct numa *n)
+{
+	(void)n;
+	return (1);
+}
+
+int
+numa_cpus(const struct numa *n, int node)
+{
+	(void)n;
+	(void)node;
+	return (0);
+}
+
+int
+numa_path_node(const struct numa *n, const char *path)
+{
+	(void)n;
+	(void)path;
+	return (-1);
+}
+
+int
+numa_dev_node(const struct numa *n, dev_t dev)
+{
+	(void)n;
+	(void)dev;
+	return (-1);
+}
+
+int
+numa_pin(const struct numa *n, int node)
+{
+	(void)n;
+	(void)node;
+	return (0);
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,378 @@
+/*
+ * Workload plans
+ *
+ * DETAILS:
+ *   --record saves what a run stamped without saying what it was: the
+ *   shape of the directory tree, the type of every file, which of the
+ *   run's devices it was on, and its target relative to the first one.
+ *   Directories are numbered as they are first seen, parents first, &
+ *   files refer to their directory by number, so no name is kept.  The
+ *   plan is kept in memory & written by plan_close(): a header, the parent
+ *   of every directory, then fixed size records, in host byte order like
+ *   the undo log.  touch2-replay reads it back with plan_load().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#define PLAN_MAGIC	"touch2p\n"
+#define PLAN_VERSION	1
+#define PLAN_BOM	0x01020304	/* written in host byte order */
+
+struct plan_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 bom;
+	uint32_t	 ndevs;
+	uint32_t	 ndirs;
+	uint64_t	 nrecords;
+	/* uint32_t parents[ndirs], padded to 8 bytes */
+	/* struct plan_record records[nrecords] */
+};
+
+/* A directory path & its number, in the hash table */
+struct plan_slot {
+	char		*path;		/* NULL if free */
+	size_t		 len;
+	uint32_t	 dir;
+};
+
+struct plan {
+	FILE		*fp;
+	const char	*file;
+	int		 failed;
+	/* Directories */
+	struct plan_slot *slots;
+	size_t		 nslots;	/* a power of 2 */
+	uint32_t	*parents;
+	uint32_t	 ndirs;
+	size_t		 dirsize;
+	/* Devices, in the order seen */
+	dev_t		*devs;
+	uint32_t	 ndevs;
+	/* Files */
+	struct plan_record *records;
+	size_t		 nrecords;
+	size_t		 size;
+	struct timespec	 base;		/* the first target */
+};
+
+static uint64_t
+hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+
+	return (h);
+}
+
+/*
+ * Returns the length of the directory part of path[0, len), without
+ * trailing slashes
+ */
+static size_t
+dirlen(const char *path, size_t len)
+{
+	while (len > 0 && path[len - 1] != '/')
+		len--;
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+
+	return (len);
+}
+
+static int
+plan_grow(struct plan *p)
+{
+	struct plan_slot *slots;
+	size_t nslots = p->nslots ? p->nslots * 2 : 1024, i, k;
+
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return (-1);
+	for (i = 0; i < p->nslots; i++) {
+		if (p->slots[i].path == NULL)
+			continue;
+		k = hash(p->slots[i].path, p->slots[i].len) & (nslots - 1);
+		while (slots[k].path != NULL)
+			k = (k + 1) & (nslots - 1);
+		slots[k] = p->slots[i];
+	}
+	free(p->slots);
+	p->slots = slots;
+	p->nslots = nslots;
+
+	return (0);
+}
+
+/*
+ * Returns the number of the directory path[0, len), numbering it & its
+ * parents if they're new, or -1 on error.  The empty path is the top
+ */
+static int64_t
+plan_dir(struct plan *p, const char *path, size_t len)
+{
+	struct plan_slot *s;
+	int64_t parent;
+	size_t k;
+
+	if (2 * (p->ndirs + 1) > p->nslots && plan_grow(p) < 0)
+		return (-1);
+	for (k = hash(path, len) & (p->nslots - 1); p->slots[k].path != NULL;
+	    k = (k + 1) & (p->nslots - 1)) {
+		s = &p->slots[k];
+		if (s->len == len && memcmp(s->path, path, len) == 0)
+			return (s->dir);
+	}
+
+	/* Parents first, which may grow the table */
+	parent = (len == 0) ? UINT32_MAX : plan_dir(p, path, dirlen(path, len));
+	if (parent < 0)
+		return (-1);
+	if (p->ndirs == p->dirsize) {
+		uint32_t *v;
+
+		p->dirsize = p->dirsize ? p->dirsize * 2 : 1024;
+		if ((v = realloc(p->parents, p->dirsize * sizeof(*v))) == NULL)
+			return (-1);
+		p->parents = v;
+	}
+	p->parents[p->ndirs] = (uint32_t)parent;
+
+	for (k = hash(path, len) & (p->nslots - 1); p->slots[k].path != NULL;
+	    k = (k + 1) & (p->nslots - 1))
+		;
+	s = &p->slots[k];
+	if ((s->path = malloc(len + 1)) == NULL)
+		return (-1);
+	memcpy(s->path, path, len);
+	s->path[len] = '\0';
+	s->len = len;
+	s->dir = p->ndirs;
+
+	return (p->ndirs++);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+int
+plan_open(struct engine *eng, const char *file)
+{
+	struct plan *p;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	/* Fail now rather than after the run */
+	if ((p->fp = fopen(file, "w")) == NULL) {
+		perror(file);
+		free(p);
+		return (-1);
+	}
+	p->file = file;
+	eng->plan = p;
+
+	return (0);
+}
+
+/*
+ * Records n entries about to be stamped.  Returns 0 on success, -1 on
+ * error, after which the plan is not written
+ */
+int
+plan_note(struct engine *eng, const struct entry *v, size_t n)
+{
+	struct plan *p = eng->plan;
+	struct plan_record *r;
+	int64_t dir;
+	size_t i, len;
+	uint32_t d;
+
+	if (p->failed)
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		const struct entry *e = &v[i];
+
+		len = strlen(e->path);
+		while (len > 1 && e->path[len - 1] == '/')
+			len--;
+		/* Directories are recorded as themselves */
+		if (!S_ISDIR(e->mode))
+			len = dirlen(e->path, len);
+		else if (len == 1 && e->path[0] == '/')
+			len = 0;
+		if ((dir = plan_dir(p, e->path, len)) < 0)
+			goto fail;
+
+		for (d = 0; d < p->ndevs && p->devs[d] != e->dev; d++)
+			;
+		if (d == p->ndevs) {
+			dev_t *devs;
+
+			if ((devs = realloc(p->devs, (d + 1) * sizeof(*devs))) == NULL)
+				goto fail;
+			p->devs = devs;
+			p->devs[p->ndevs++] = e->dev;
+		}
+
+		if (p->nrecords == p->size) {
+			p->size = p->size ? p->size * 2 : 4096;
+			r = realloc(p->records, p->size * sizeof(*r));
+			if (r == NULL)
+				goto fail;
+			p->records = r;
+		}
+		if (p->nrecords == 0)
+			p->base = e->target;
+		r = &p->records[p->nrecords++];
+		r->dir = (uint32_t)dir;
+		r->type = (uint32_t)(e->mode & S_IFMT);
+		r->dev = d;
+		r->pad = 0;
+		r->delta = (int64_t)(e->target.tv_sec - p->base.tv_sec) *
+		    1000000000 + (e->target.tv_nsec - p->base.tv_nsec);
+	}
+
+	return (0);
+
+fail:
+	perror("plan");
+	p->failed = 1;
+	return (-1);
+}
+
+static void
+plan_free(struct plan *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->nslots; i++)
+		free(p->slots[i].path);
+	free(p->slots);
+	free(p->parents);
+	free(p->devs);
+	free(p->records);
+	free(p);
+}
+
+/*
+ * Writes the plan & frees it.  Returns 0 on success, -1 on error
+ */
+int
+plan_close(struct engine *eng)
+{
+	static const char pad[8];
+	struct plan *p = eng->plan;
+	struct plan_header h;
+	int status = 0;
+
+	if (p == NULL)
+		return (0);
+	eng->plan = NULL;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PLAN_MAGIC, sizeof(h.magic));
+	h.version = PLAN_VERSION;
+	h.bom = PLAN_BOM;
+	h.ndevs = p->ndevs;
+	h.ndirs = p->ndirs;
+	h.nrecords = p->nrecords;
+
+	if (p->failed)
+		status = -1;
+	else if (fwrite(&h, sizeof(h), 1, p->fp) != 1 ||
+	    fwrite(p->parents, sizeof(*p->parents), p->ndirs, p->fp) != p->ndirs ||
+	    fwrite(pad, 1, (p->ndirs & 1) * 4, p->fp) != (p->ndirs & 1) * 4 ||
+	    fwrite(p->records, sizeof(*p->records), p->nrecords,
+	    p->fp) != p->nrecords || fflush(p->fp) != 0) {
+		perror(p->file);
+		status = -1;
+	}
+	if (fclose(p->fp) != 0 && status == 0) {
+		perror(p->file);
+		status = -1;
+	}
+	plan_free(p);
+
+	return (status);
+}
+
+/*
+ * Reads a plan written by plan_close(), allocating its arrays.
+ * Returns 0 on success, -1 on error
+ */
+int
+plan_load(const char *file, struct plan_data *pd)
+{
+	struct plan_header h;
+	uint32_t pad;
+	size_t i;
+	FILE *fp;
+
+	memset(pd, 0, sizeof(*pd));
+	if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		return (-1);
+	}
+	if (fread(&h, sizeof(h), 1, fp) != 1 ||
+	    memcmp(h.magic, PLAN_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.version != PLAN_VERSION || h.bom != PLAN_BOM ||
+	    (h.ndirs == 0 && h.nrecords != 0) ||
+	    h.nrecords > SIZE_MAX / sizeof(struct plan_record))
+		goto bad;
+
+	pd->ndevs = h.ndevs;
+	pd->ndirs = h.ndirs;
+	pd->nrecords = h.nrecords;
+	pd->parents = malloc((h.ndirs ? h.ndirs : 1) * sizeof(*pd->parents));
+	pd->records = malloc((h.nrecords ? h.nrecords : 1) * sizeof(*pd->records));
+	if (pd->parents == NULL || pd->records == NULL) {
+		perror("malloc()");
+		goto fail;
+	}
+	if (fread(pd->parents, sizeof(*pd->parents), h.ndirs, fp) != h.ndirs ||
+	    fread(&pad, 1, (h.ndirs & 1) * 4, fp) != (h.ndirs & 1) * 4 ||
+	    fread(pd->records, sizeof(*pd->records), pd->nrecords,
+	    fp) != pd->nrecords)
+		goto bad;
+
+	/* Parents come first, & the top has none */
+	if (pd->ndirs > 0 && pd->parents[0] != UINT32_MAX)
+		goto bad;
+	for (i = 1; i < pd->ndirs; i++)
+		if (pd->parents[i] >= i)
+			goto bad;
+	for (i = 0; i < pd->nrecords; i++)
+		if (pd->records[i].dir >= pd->ndirs ||
+		    pd->records[i].dev >= pd->ndevs)
+			goto bad;
+	(void)fclose(fp);
+
+	return (0);
+
+bad:
+	fprintf(stderr, "%s: %s\n", file,
+	    ferror(fp) ? strerror(errno) : "not a touch2 plan");
+fail:
+	(void)fclose(fp);
+	plan_unload(pd);
+	return (-1);
+}
+
+void
+plan_unload(struct plan_data *pd)
+{
+	free(pd->parents);
+	free(pd->records);
+	memset(pd, 0, sizeof(*pd));
+}
@@ -0,0 +1,687 @@
+/*
+ * Parallel tree walker
+ *
+ * DETAILS:
+ *   Trees are rarely balanced: one directory may hold millions of files
+ *   while its siblings hold ten, so handing each thread a fixed part of the
+ *   tree leaves most of them idle.  Instead every thread has a deque of
+ *   directories to read.  It takes the newest one from the bottom of its
+ *   own deque, which keeps its walk depth first & its dentries warm, and
+ *   once it runs dry it steals the oldest one from the top of another's,
+ *   the one likely to hold the biggest subtree.
+ *
+ *   Directories are read with getdents64(2) one WALK_CHUNK at a time.
+ *   Before stat'ing the entries of a chunk, the thread puts the directory
+ *   back on its deque, so the next chunk can be stolen & read meanwhile:
+ *   a huge directory is spread over all the threads instead of holding
+ *   up one of them.  Its descriptor's offset is only ever moved by the one
+ *   thread holding the directory's task, & it's closed once the last chunk
+ *   has been stat'ed.  Entries are stat'ed relative to it with fstatat(2).
+ *
+ *   The entries found are pushed into the ring in small batches under a
+ *   lock, as it has a single producer.  Entries are not found in any
+ *   particular order, which tree mode doesn't need.  --cache needs
+ *   directories to be left after their contents, so it keeps fts(3).
+ *   Linux only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fts.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "touch2.h"
+
+#ifdef __linux__
+
+/* Bytes of directory entries read at a time */
+#define WALK_CHUNK		32768
+
+/* The most walker threads */
+#define WALK_MAX_THREADS	64
+
+/* Entries pushed into the ring at a time */
+#define WALK_BATCH		256
+
+/* How long idle threads sleep between attempts to steal */
+#define WALK_BACKOFF_NSEC	20000L
+
+struct linux_dirent64 {
+	uint64_t	 d_ino;
+	int64_t		 d_off;
+	unsigned short	 d_reclen;
+	unsigned char	 d_type;
+	char		 d_name[];
+};
+
+/* A directory to read */
+struct wdir {
+	struct wdir	*parent;	/* for cycles */
+	char		*path;
+	size_t		 pathlen;
+	dev_t		 dev;
+	ino_t		 ino;
+	int		 level;
+	int		 fd;		/* once it's read */
+	_Atomic int	 refs;		/* its task, chunks & subdirectories */
+	_Atomic int	 users;		/* its task & chunks, holding fd */
+};
+
+struct deque {
+	pthread_mutex_t	 lock;
+	struct wdir	**v;
+	size_t		 top;		/* the oldest, stolen */
+	size_t		 bottom;	/* past the newest, the owner's */
+	size_t		 size;
+};
+
+struct pwalk;
+
+struct worker {
+	pthread_t	 thread;
+	struct pwalk	*pw;
+	struct deque	 dq;
+	unsigned int	 seed;
+	FTSENT		*ent;		/* for the filter */
+	struct stat	 st;		/* its stat */
+	char		*buf;		/* getdents64() */
+	char		*path;
+	size_t		 pathsize;
+	struct entry	 batch[WALK_BATCH];
+	size_t		 nbatch;
+	/* Statistics */
+	size_t		 n;
+	size_t		 nerrors;
+	size_t		 nskipped;
+	size_t		 npruned;
+	size_t		 nforeign;
+	size_t		 nsteals;
+};
+
+struct pwalk {
+	struct walker	*w;
+	struct worker	*workers;
+	int		 nworkers;
+	_Atomic size_t	 pending;	/* directory tasks queued or running */
+	_Atomic int	 failed;	/* out of memory, stop reading */
+	pthread_mutex_t	 pushlock;	/* the ring has a single producer */
+};
+
+static void
+backoff(void)
+{
+	struct timespec ts = { 0, WALK_BACKOFF_NSEC };
+
+	(void)nanosleep(&ts, NULL);
+}
+
+static void
+wdir_put(struct wdir *d)
+{
+	struct wdir *parent;
+
+	while (d != NULL && atomic_fetch_sub(&d->refs, 1) == 1) {
+		parent = d->parent;
+		free(d->path);
+		free(d);
+		d = parent;
+	}
+}
+
+/*
+ * Done with its descriptor, for a task or a chunk
+ */
+static void
+wdir_unuse(struct wdir *d)
+{
+	if (atomic_fetch_sub(&d->users, 1) == 1 && d->fd >= 0)
+		(void)close(d->fd);
+	wdir_put(d);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+static int
+deque_push(struct deque *dq, struct wdir *d)
+{
+	struct wdir **v;
+	size_t size;
+
+	(void)pthread_mutex_lock(&dq->lock);
+	if (dq->bottom == dq->size) {
+		if (dq->top > 0) {
+			memmove(dq->v, dq->v + dq->top,
+			    (dq->bottom - dq->top) * sizeof(*dq->v));
+			dq->bottom -= dq->top;
+			dq->top = 0;
+		}
+		if (dq->bottom == dq->size) {
+			size = dq->size ? dq->size * 2 : 64;
+			if ((v = realloc(dq->v, size * sizeof(*v))) == NULL) {
+				(void)pthread_mutex_unlock(&dq->lock);
+				return (-1);
+			}
+			dq->v = v;
+			dq->size = size;
+		}
+	}
+	dq->v[dq->bottom++] = d;
+	(void)pthread_mutex_unlock(&dq->lock);
+
+	return (0);
+}
+
+/*
+ * Takes the newest directory, for the owner.  Returns NULL if empty
+ */
+static struct wdir *
+deque_pop(struct deque *dq)
+{
+	struct wdir *d = NULL;
+
+	(void)pthread_mutex_lock(&dq->lock);
+	if (dq->bottom > dq->top)
+		d = dq->v[--dq->bottom];
+	if (dq->bottom == dq->top)
+		dq->bottom = dq->top = 0;
+	(void)pthread_mutex_unlock(&dq->lock);
+
+	return (d);
+}
+
+/*
+ * Takes the oldest directory, for thieves.  Returns NULL if empty
+ */
+static struct wdir *
+deque_steal(struct deque *dq)
+{
+	struct wdir *d = NULL;
+
+	(void)pthread_mutex_lock(&dq->lock);
+	if (dq->bottom > dq->top)
+		d = dq->v[dq->top++];
+	(void)pthread_mutex_unlock(&dq->lock);
+
+	return (d);
+}
+
+/*
+ * Queues a directory task on the worker's deque.  Returns 0 on success,
+ * -1 on error
+ */
+static int
+queue(struct worker *wk, struct wdir *d)
+{
+	atomic_fetch_add(&wk->pw->pending, 1);
+	if (deque_push(&wk->dq, d) < 0) {
+		atomic_fetch_sub(&wk->pw->pending, 1);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+flush(struct worker *wk)
+{
+	struct pwalk *pw = wk->pw;
+	size_t i;
+
+	if (wk->nbatch == 0)
+		return;
+	(void)pthread_mutex_lock(&pw->pushlock);
+	for (i = 0; i < wk->nbatch; i++)
+		ring_push(pw->w->ring, &wk->batch[i]);
+	(void)pthread_mutex_unlock(&pw->pushlock);
+	wk->n += wk->nbatch;
+	wk->nbatch = 0;
+}
+
+static void
+fail(struct worker *wk, const char *what)
+{
+	perror(what);
+	wk->nerrors++;
+	atomic_store(&wk->pw->failed, 1);
+}
+
+/*
+ * Filters the entry in wk->ent, queues it for the committer & returns
+ * whether its subtree is to be walked
+ */
+static int
+found(struct worker *wk)
+{
+	struct engine *eng = wk->pw->w->eng;
+	FTSENT *p = wk->ent;
+	const struct stat *st = p->fts_statp;
+	struct entry *e;
+
+	if (S_ISDIR(st->st_mode))
+		p->fts_info = FTS_D;
+	else if (S_ISREG(st->st_mode))
+		p->fts_info = FTS_F;
+	else if (S_ISLNK(st->st_mode))
+		p->fts_info = FTS_SL;
+	else
+		p->fts_info = FTS_DEFAULT;
+
+	if (eng->filter != NULL) {
+		switch (filter_run(eng->filter, p)) {
+		case FILTER_PRUNE:
+			wk->npruned++;
+			return (0);
+		case FILTER_SKIP:
+			wk->nskipped++;
+			return (S_ISDIR(st->st_mode));
+		default:
+			break;
+		}
+	}
+
+	if (!engine_shard_inode(eng, st->st_ino)) {
+		wk->nforeign++;
+		return (S_ISDIR(st->st_mode));
+	}
+
+	e = &wk->batch[wk->nbatch];
+	if ((e->path = strdup(p->fts_path)) == NULL) {
+		fail(wk, "strdup()");
+		return (0);
+	}
+	e->mode = st->st_mode;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->oldctime = st->st_ctim;
+	engine_target(eng, st, &e->target);
+	e->fd = -1;
+	e->error = 0;
+	e->tag = 0;
+	(void)fdcache_open(eng, e);
+	if (++wk->nbatch == WALK_BATCH)
+		flush(wk);
+
+	return (S_ISDIR(st->st_mode));
+}
+
+/*
+ * Queues the directory in wk->ent below parent.  Returns 0 on success,
+ * -1 on error
+ */
+static int
+descend(struct worker *wk, struct wdir *parent)
+{
+	const FTSENT *p = wk->ent;
+	struct wdir *d, *a;
+
+	/* Only bind mounts make cycles in a physical walk */
+	for (a = parent; a != NULL; a = a->parent)
+		if (a->dev == p->fts_statp->st_dev &&
+		    a->ino == p->fts_statp->st_ino) {
+			fprintf(stderr, "%s: directory cycle\n", p->fts_path);
+			wk->nerrors++;
+			return (0);
+		}
+
+	if ((d = calloc(1, sizeof(*d))) == NULL ||
+	    (d->path = strdup(p->fts_path)) == NULL) {
+		free(d);
+		fail(wk, "malloc()");
+		return (-1);
+	}
+	d->pathlen = p->fts_pathlen;
+	d->dev = p->fts_statp->st_dev;
+	d->ino = p->fts_statp->st_ino;
+	d->level = p->fts_level;
+	d->fd = -1;
+	atomic_init(&d->refs, 1);
+	atomic_init(&d->users, 1);
+	if ((d->parent = parent) != NULL)
+		atomic_fetch_add(&parent->refs, 1);
+	if (queue(wk, d) < 0) {
+		wdir_put(d);
+		fail(wk, "realloc()");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Fills wk->ent for the entry name of d, or a root if d is NULL, all but
+ * its stat.  Returns 0 on success, -1 on error
+ */
+static int
+fill(struct worker *wk, const struct wdir *d, const char *name,
+    size_t namelen)
+{
+	FTSENT *p = wk->ent;
+	size_t len, sep;
+	char *path;
+
+	/* Like fts, "dir/" leads to "dir/name" */
+	sep = (d != NULL && d->path[d->pathlen - 1] != '/');
+	len = (d != NULL) ? d->pathlen + sep + namelen : namelen;
+	if (len > USHRT_MAX || namelen > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	if (len >= wk->pathsize) {
+		if ((path = realloc(wk->path, len + 1)) == NULL)
+			return (-1);
+		wk->path = path;
+		wk->pathsize = len + 1;
+	}
+	if (d != NULL) {
+		memcpy(wk->path, d->path, d->pathlen);
+		wk->path[d->pathlen] = '/';
+		memcpy(wk->path + d->pathlen + sep, name, namelen + 1);
+	} else
+		memcpy(wk->path, name, namelen + 1);
+
+	p->fts_path = p->fts_accpath = wk->path;
+	p->fts_pathlen = (unsigned short)len;
+	memcpy(p->fts_name, name, namelen + 1);
+	p->fts_namelen = (unsigned short)namelen;
+	p->fts_level = (d != NULL) ? d->level + 1 : FTS_ROOTLEVEL;
+	p->fts_statp = &wk->st;
+
+	return (0);
+}
+
+/*
+ * Stats the entries of a chunk of d
+ */
+static void
+chunk(struct worker *wk, struct wdir *d, const char *buf, long len)
+{
+	const struct linux_dirent64 *de;
+	const char *name;
+	long off;
+
+	for (off = 0; off < len; off += de->d_reclen) {
+		de = (const struct linux_dirent64 *)(buf + off);
+		name = de->d_name;
+		if (name[0] == '.' && (name[1] == '\0' ||
+		    (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (atomic_load_explicit(&wk->pw->failed, memory_order_relaxed))
+			return;
+
+		if (fill(wk, d, name, strlen(name)) < 0) {
+			fprintf(stderr, "%s/%s: %s\n", d->path, name,
+			    strerror(errno));
+			wk->nerrors++;
+			continue;
+		}
+		if (fstatat(d->fd, name, &wk->st, AT_SYMLINK_NOFOLLOW) < 0) {
+			fprintf(stderr, "%s: %s\n", wk->path, strerror(errno));
+			wk->nerrors++;
+			continue;
+		}
+		if (found(wk) && S_ISDIR(wk->st.st_mode))
+			(void)descend(wk, d);
+	}
+}
+
+/*
+ * Reads the next chunk of d, putting d back for the one after
+ */
+static void
+run(struct worker *wk, struct wdir *d)
+{
+	long len;
+
+	if (atomic_load_explicit(&wk->pw->failed, memory_order_relaxed)) {
+		wdir_unuse(d);
+		return;
+	}
+	while (d->fd < 0 && (d->fd = open(d->path,
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		if (errno == EINTR)
+			continue;
+		/* The cache filled the table: wait for the commits to close */
+		if ((errno == EMFILE || errno == ENFILE) &&
+		    fdcache_shrink(wk->pw->w->eng,
+		    2 * (size_t)wk->pw->nworkers)) {
+			flush(wk);
+			backoff();
+			continue;
+		}
+		fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+		wk->nerrors++;
+		wdir_unuse(d);
+		return;
+	}
+	while ((len = syscall(SYS_getdents64, d->fd, wk->buf, WALK_CHUNK)) < 0 &&
+	    errno == EINTR)
+		;
+	if (len <= 0) {
+		if (len < 0) {
+			fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+			wk->nerrors++;
+		}
+		wdir_unuse(d);
+		return;
+	}
+
+	/* The task goes back for the next chunk, to be stolen meanwhile */
+	atomic_fetch_add(&d->refs, 1);
+	atomic_fetch_add(&d->users, 1);
+	if (queue(wk, d) < 0) {
+		fail(wk, "realloc()");
+		wdir_unuse(d);
+	}
+	chunk(wk, d, wk->buf, len);
+	wdir_unuse(d);
+}
+
+/*
+ * Returns a directory taken from another worker, or NULL
+ */
+static struct wdir *
+steal(struct worker *wk)
+{
+	struct pwalk *pw = wk->pw;
+	struct wdir *d;
+	int i, k;
+
+	k = (int)(rand_r(&wk->seed) % (unsigned int)pw->nworkers);
+	for (i = 0; i < pw->nworkers; i++, k = (k + 1) % pw->nworkers) {
+		if (&pw->workers[k] == wk)
+			continue;
+		if ((d = deque_steal(&pw->workers[k].dq)) != NULL) {
+			wk->nsteals++;
+			return (d);
+		}
+	}
+
+	return (NULL);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker *wk = arg;
+	struct pwalk *pw = wk->pw;
+	struct wdir *d;
+
+	/* The I/O priority of the first is inherited from it */
+	if (wk != &pw->workers[0])
+		trace_thread(pw->w->eng, "walker");
+
+	for (;;) {
+		if ((d = deque_pop(&wk->dq)) == NULL &&
+		    (d = steal(wk)) == NULL) {
+			/* Entries found meanwhile shouldn't wait for us */
+			flush(wk);
+			if (atomic_load(&pw->pending) == 0)
+				break;
+			backoff();
+			continue;
+		}
+		run(wk, d);
+		atomic_fetch_sub(&pw->pending, 1);
+	}
+	flush(wk);
+
+	return (NULL);
+}
+
+/*
+ * Stats the roots, queuing the directories among them on the deques
+ */
+static void
+roots(struct pwalk *pw)
+{
+	struct worker *wk;
+	char **r;
+	int i = 0;
+
+	for (r = pw->w->roots; *r != NULL && !pw->failed; r++) {
+		wk = &pw->workers[i];
+		if (fill(wk, NULL, *r, strlen(*r)) < 0 ||
+		    lstat(*r, &wk->st) < 0) {
+			fprintf(stderr, "%s: %s\n", *r, strerror(errno));
+			wk->nerrors++;
+			continue;
+		}
+		if (found(wk) && S_ISDIR(wk->st.st_mode) &&
+		    descend(wk, NULL) == 0)
+			i = (i + 1) % pw->nworkers;
+	}
+}
+
+/*
+ * Returns the number of threads to walk with, 1 to walk with fts(3)
+ */
+int
+pwalk_threads(const struct engine *eng)
+{
+	long ncpus;
+
+	if (eng->dircache != NULL ||
+	    (ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 2)
+		return (1);
+
+	return ((ncpus > WALK_MAX_THREADS) ? WALK_MAX_THREADS : (int)ncpus);
+}
+
+/*
+ * Walks the roots of w with nthreads threads, the calling one included,
+ * which must have signals blocked.  Returns the number of entries pushed,
+ * or -1 if nothing could be walked
+ */
+ssize_t
+pwalk_run(struct walker *w, int nthreads)
+{
+	struct pwalk pw;
+	struct worker *wk;
+	size_t n = 0;
+	int i, error, status = 0;
+
+	memset(&pw, 0, sizeof(pw));
+	pw.w = w;
+	pw.nworkers = nthreads;
+	atomic_init(&pw.pending, 0);
+	atomic_init(&pw.failed, 0);
+	if ((pw.workers = calloc((size_t)nthreads, sizeof(*pw.workers))) ==
+	    NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	(void)pthread_mutex_init(&pw.pushlock, NULL);
+	for (i = 0; i < nthreads; i++) {
+		wk = &pw.workers[i];
+		wk->pw = &pw;
+		wk->seed = (unsigned int)i;
+		(void)pthread_mutex_init(&wk->dq.lock, NULL);
+		if ((wk->ent = malloc(offsetof(FTSENT, fts_name) + PATH_MAX +
+		    1)) == NULL || (wk->buf = malloc(WALK_CHUNK)) == NULL) {
+			perror("malloc()");
+			status = -1;
+		}
+		if (wk->ent != NULL)
+			memset(wk->ent, 0, offsetof(FTSENT, fts_name));
+	}
+	if (status < 0)
+		goto end;
+
+	roots(&pw);
+
+	/* The calling thread is the first worker; missing ones are stolen from */
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&pw.workers[i].thread, NULL,
+		    worker_thread, &pw.workers[i])) != 0) {
+			fprintf(stderr, "pthread_create(): %s\n",
+			    strerror(error));
+			break;
+		}
+	w->nthreads = i;
+	(void)worker_thread(&pw.workers[0]);
+	while (--i > 0)
+		(void)pthread_join(pw.workers[i].thread, NULL);
+
+	/* Tasks left by a failure */
+	for (i = 0; i < nthreads; i++) {
+		struct wdir *d;
+
+		while ((d = deque_pop(&pw.workers[i].dq)) != NULL)
+			wdir_unuse(d);
+	}
+
+end:
+	for (i = 0; i < nthreads; i++) {
+		wk = &pw.workers[i];
+		n += wk->n;
+		w->nerrors += wk->nerrors;
+		w->nskipped += wk->nskipped;
+		w->npruned += wk->npruned;
+		w->nforeign += wk->nforeign;
+		w->nsteals += wk->nsteals;
+		(void)pthread_mutex_destroy(&wk->dq.lock);
+		free(wk->dq.v);
+		free(wk->ent);
+		free(wk->buf);
+		free(wk->path);
+	}
+	(void)pthread_mutex_destroy(&pw.pushlock);
+	free(pw.workers);
+
+	return ((status < 0) ? -1 : (ssize_t)n);
+}
+
+#else /* !__linux__ */
+
+int
+pwalk_threads(const struct engine *eng)
+{
+	(void)eng;
+	return (1);
+}
+
+ssize_t
+pwalk_run(struct walker *w, int nthreads)
+{
+	(void)w;
+	(void)nthreads;
+	return (-1);
+}
+
+#endif /* __linux__ */
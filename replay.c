@@ -0,0 +1,290 @@
+/*
+ * Plan replay
+ *
+ * DETAILS:
+ *   touch2-replay, a link to touch2, recreates a synthetic tree with the
+ *   shape of a plan saved by --record & stamps it the same way, so that
+ *   changes to the engine can be measured against real workloads without
+ *   their paths.  Directories are named d<number> & files f<number> after
+ *   their record, with their recorded type.  Each device of the plan is
+ *   given one of the directories on the command line, in turn, so that
+ *   the device mix can be reproduced by giving directories on as many
+ *   filesystems.  Targets keep their spacing, ending a day ago.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "touch2.h"
+
+static char usage[] =
+	"Usage: touch2-replay [-v] [-w usecs] [-u log] [--durable] [--trickle rate]\n"
+	"                     [--trace file] plan dir...\n"
+	"  Recreates the tree recorded in plan under the dirs & replays the run\n"
+	"  on it, with the options of touch2.  The files of the nth device of\n"
+	"  the plan go under the nth dir, in turn\n";
+
+struct replay {
+	struct plan_data plan;
+	char		**roots;
+	size_t		 nroots;
+	char		**dirs;		/* paths below a root, by number */
+	unsigned char	*made;		/* by root & directory */
+};
+
+static void
+replay_usage(int status)
+{
+	fprintf(status ? stderr : stdout, "%s", usage);
+	exit(status);
+}
+
+/*
+ * Names the directories after their numbers.  Returns 0 on success, -1 on
+ * error
+ */
+static int
+name_dirs(struct replay *r)
+{
+	const struct plan_data *pd = &r->plan;
+	uint32_t i;
+
+	if ((r->dirs = calloc(pd->ndirs ? pd->ndirs : 1, sizeof(*r->dirs))) == NULL ||
+	    (r->made = calloc(pd->ndirs ? pd->ndirs : 1, r->nroots)) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	for (i = 0; i < pd->ndirs; i++) {
+		const char *parent;
+		int len;
+
+		if (pd->parents[i] == UINT32_MAX)
+			len = asprintf(&r->dirs[i], "%s", "");
+		else if (*(parent = r->dirs[pd->parents[i]]) == '\0')
+			len = asprintf(&r->dirs[i], "d%u", i);
+		else
+			len = asprintf(&r->dirs[i], "%s/d%u", parent, i);
+		if (len < 0) {
+			r->dirs[i] = NULL;
+			perror("asprintf()");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Puts the path of directory d under root k, followed by suffix, in buf.
+ * Returns 0 on success, -1 if it doesn't fit
+ */
+static int
+dir_path(const struct replay *r, size_t k, uint32_t d, const char *suffix,
+    char *buf, size_t size)
+{
+	int len;
+
+	if (*r->dirs[d] == '\0')
+		len = snprintf(buf, size, "%s%s", r->roots[k], suffix);
+	else
+		len = snprintf(buf, size, "%s/%s%s", r->roots[k], r->dirs[d],
+		    suffix);
+	if (len < 0 || (size_t)len >= size) {
+		fprintf(stderr, "%s: %s\n", r->roots[k], strerror(ENAMETOOLONG));
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Creates directory d & its parents under root k.  Returns 0 on success,
+ * -1 on error
+ */
+static int
+make_dir(struct replay *r, size_t k, uint32_t d)
+{
+	char path[4096];
+
+	if (r->made[(size_t)d * r->nroots + k])
+		return (0);
+	if (r->plan.parents[d] != UINT32_MAX &&
+	    make_dir(r, k, r->plan.parents[d]) < 0)
+		return (-1);
+
+	if (dir_path(r, k, d, "", path, sizeof(path)) < 0)
+		return (-1);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror(path);
+		return (-1);
+	}
+	r->made[(size_t)d * r->nroots + k] = 1;
+
+	return (0);
+}
+
+/*
+ * Creates the file of a record.  Returns 0 on success, -1 on error
+ */
+static int
+make_file(const char *path, uint32_t type)
+{
+	int fd;
+
+	switch (type) {
+	case S_IFLNK:
+		if (symlink(".", path) < 0 && errno != EEXIST)
+			break;
+		return (0);
+	case S_IFIFO:
+		if (mkfifo(path, 0644) < 0 && errno != EEXIST)
+			break;
+		return (0);
+	default:
+		/* Devices & sockets become regular files */
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+			break;
+		(void)close(fd);
+		return (0);
+	}
+	perror(path);
+
+	return (-1);
+}
+
+/*
+ * Creates the tree of the plan & adds its files to the engine.
+ * Returns 0 on success, -1 on error
+ */
+static int
+build(struct replay *r, struct engine *eng)
+{
+	const struct plan_data *pd = &r->plan;
+	struct timespec base, target;
+	int64_t lo = 0, hi = 0, ns;
+	char path[4096], name[32], *p;
+	size_t i, k;
+
+	for (i = 0; i < pd->nrecords; i++) {
+		if (pd->records[i].delta < lo)
+			lo = pd->records[i].delta;
+		if (pd->records[i].delta > hi)
+			hi = pd->records[i].delta;
+	}
+	(void)clock_gettime(CLOCK_REALTIME, &base);
+	base.tv_sec -= 86400 + (hi - lo) / 1000000000 + 1;
+	base.tv_nsec = 0;
+
+	for (i = 0; i < pd->nrecords; i++) {
+		const struct plan_record *rec = &pd->records[i];
+
+		k = rec->dev % r->nroots;
+		if (make_dir(r, k, rec->dir) < 0)
+			return (-1);
+		if (rec->type == S_IFDIR)
+			name[0] = '\0';
+		else
+			(void)snprintf(name, sizeof(name), "/f%zu", i);
+		if (dir_path(r, k, rec->dir, name, path, sizeof(path)) < 0 ||
+		    (rec->type != S_IFDIR && make_file(path, rec->type) < 0))
+			return (-1);
+
+		ns = rec->delta - lo;
+		target.tv_sec = base.tv_sec + (time_t)(ns / 1000000000);
+		target.tv_nsec = (long)(ns % 1000000000);
+		if ((p = strdup(path)) == NULL) {
+			perror("strdup()");
+			return (-1);
+		}
+		if (engine_add(eng, p, &target) < 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+int
+replay_main(int argc, char *argv[])
+{
+	struct replay r;
+	struct engine eng;
+	char *undolog = NULL, *trace = NULL;
+	int status;
+	long trickle;
+	size_t i;
+	int c;
+
+	engine_init(&eng);
+	memset(&r, 0, sizeof(r));
+
+	for (c = 1; c < argc && argv[c][0] == '-'; c++) {
+		if (strcmp(argv[c], "-v") == 0)
+			eng.verbose = 1;
+		else if (strcmp(argv[c], "-h") == 0)
+			replay_usage(0);
+		else if (strcmp(argv[c], "-w") == 0) {
+			if (argv[++c] == NULL || (eng.budget = atol(argv[c])) <= 0)
+				replay_usage(1);
+		} else if (strcmp(argv[c], "-u") == 0) {
+			if ((undolog = argv[++c]) == NULL)
+				replay_usage(1);
+		} else if (strcmp(argv[c], "--trace") == 0) {
+			if ((trace = argv[++c]) == NULL)
+				replay_usage(1);
+		} else if (strcmp(argv[c], "--durable") == 0)
+			eng.durable = 1;
+		else if (strcmp(argv[c], "--trickle") == 0) {
+			if (argv[++c] == NULL || (trickle = atol(argv[c])) < 0)
+				replay_usage(1);
+			if (eng.trickle == NULL && trickle_init(&eng, trickle) < 0)
+				return (1);
+		} else
+			replay_usage(1);
+	}
+	if (argc - c < 2)
+		replay_usage(1);
+
+	if (plan_load(argv[c], &r.plan) < 0)
+		return (1);
+	r.roots = &argv[c + 1];
+	r.nroots = (size_t)(argc - c - 1);
+
+	status = 1;
+	if (name_dirs(&r) < 0 || build(&r, &eng) < 0)
+		goto end;
+	if (eng.verbose)
+		fprintf(stderr, "touch2-replay: %zu files in %u directories "
+		    "on %u devices\n", r.plan.nrecords, r.plan.ndirs,
+		    r.plan.ndevs);
+
+	if (undolog != NULL && undo_open(&eng, undolog) < 0)
+		goto end;
+	if (trace != NULL && trace_open(&eng, trace) < 0)
+		goto end;
+	if (host_join(&eng, HOST_JOIN) < 0)
+		goto end;
+	status = (engine_run(&eng) < 0) ? 1 : 0;
+	if (host_leave(&eng) < 0 || undo_close(&eng) < 0 || trace_close(&eng) < 0)
+		status = 1;
+
+end:
+	engine_free(&eng);
+	for (i = 0; r.dirs != NULL && i < r.plan.ndirs; i++)
+		free(r.dirs[i]);
+	free(r.dirs);
+	free(r.made);
+	plan_unload(&r.plan);
+
+	return (status);
+}
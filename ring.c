@@ -0,0 +1,120 @@
+/*
+ * Bounded single-producer single-consumer ring of entries
+ *
+ * DETAILS:
+ *   The walker pushes prepared entries while the committer pops them in
+ *   batches.  Neither side takes a lock: each only writes its own index and
+ *   waits with a short sleep when the ring is full (backpressure, so memory
+ *   stays bounded) or empty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "touch2.h"
+
+/* How long to sleep while waiting for the other side */
+#define RING_BACKOFF_NSEC	20000L
+
+static void
+backoff(void)
+{
+	struct timespec ts = { 0, RING_BACKOFF_NSEC };
+
+	(void)nanosleep(&ts, NULL);
+}
+
+/*
+ * size must be a power of 2.  Returns 0 on success, -1 on error
+ */
+int
+ring_init(struct ring *r, size_t size)
+{
+	if ((r->slots = calloc(size, sizeof(*r->slots))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	r->mask = size - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->closed, 0);
+
+	return (0);
+}
+
+void
+ring_free(struct ring *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+/*
+ * Waits while the ring is full
+ */
+void
+ring_push(struct ring *r, const struct entry *e)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	while (tail - atomic_load_explicit(&r->head, memory_order_acquire) > r->mask)
+		backoff();
+
+	r->slots[tail & r->mask] = *e;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * No more entries will be pushed
+ */
+void
+ring_close(struct ring *r)
+{
+	atomic_store_explicit(&r->closed, 1, memory_order_release);
+}
+
+/*
+ * Pops up to max entries into v, waiting while the ring is empty.
+ * Returns the number of entries, or 0 once the ring is closed and drained
+ */
+size_t
+ring_pop(struct ring *r, struct entry *v, size_t max)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail, n, i;
+
+	for (;;) {
+		tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (tail != head)
+			break;
+		if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+			/* Entries pushed right before closing */
+			tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+			if (tail == head)
+				return (0);
+			break;
+		}
+		backoff();
+	}
+
+	n = tail - head;
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++)
+		v[i] = r->slots[(head + i) & r->mask];
+	atomic_store_explicit(&r->head, head + n, memory_order_release);
+
+	return (n);
+}
+
+/*
+ * Returns the number of entries waiting, for statistics
+ */
+size_t
+ring_count(struct ring *r)
+{
+	return (atomic_load_explicit(&r->tail, memory_order_relaxed) -
+	    atomic_load_explicit(&r->head, memory_order_relaxed));
+}
@@ -0,0 +1,478 @@
+/*
+ * Snapshots & snapshot diffs
+ *
+ * DETAILS:
+ *   A snapshot lists every file of the given trees as
+ *   "dev ino seconds.nanoseconds path", where the time is the ctime, one
+ *   per line (or NUL terminated with -0).  Directories are walked in sorted
+ *   order, so two snapshots of the same trees, taken at different times or
+ *   on different replicas, can be merge joined by path while reading them,
+ *   with memory bounded by the longest line.  The diff is a manifest of the
+ *   files of the first snapshot whose ctime differs in the second one.
+ *   Stamped files end up a little after their target, so a ctime no later
+ *   than the window budget after the wanted one is not a difference.
+ *
+ *   Without a filter, a snapshot of the root of an XFS mount takes the
+ *   inodes from a bulkstat scan & only reads the directories, walking them
+ *   in the same order as fts(3) would.  Files not found in the scan, like
+ *   those created since or on other filesystems mounted below, are
+ *   stat'ed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fts.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+struct snapline {
+	FILE		*fp;
+	const char	*file;
+	char		*line;
+	size_t		 size;
+	size_t		 lineno;
+	/* Parsed fields */
+	struct timespec	 ctime;
+	const char	*path;
+};
+
+/* A directory entry of a bulkstat walk */
+struct dirname {
+	char		*name;
+	ino_t		 ino;
+	unsigned char	 type;
+};
+
+/* A bulkstat walk */
+struct xfswalk {
+	const struct xfstable *table;
+	FILE		*fp;
+	int		 sep;
+	char		*path;
+	size_t		 size;
+	int		 status;
+};
+
+static int
+namecmp(const FTSENT **a, const FTSENT **b)
+{
+	return (strcmp((*a)->fts_name, (*b)->fts_name));
+}
+
+static int
+direntcmp(const void *a, const void *b)
+{
+	return (strcmp(((const struct dirname *)a)->name,
+	    ((const struct dirname *)b)->name));
+}
+
+static void
+snapshot_line(FILE *fp, const struct stat *st, const char *path, int sep)
+{
+	fprintf(fp, "%ju %ju %jd.%09ld %s%c", (uintmax_t)st->st_dev,
+	    (uintmax_t)st->st_ino, (intmax_t)st->st_ctim.tv_sec,
+	    st->st_ctim.tv_nsec, path, sep);
+}
+
+/*
+ * Reads the entries of the directory open as fd, which is closed, sorted
+ * by name.  Returns their number, or -1 on error
+ */
+static ssize_t
+read_dir(int fd, struct dirname **namesp)
+{
+	struct dirname *names = NULL, *v;
+	struct dirent *d;
+	size_t n = 0, size = 0;
+	DIR *dir;
+
+	if ((dir = fdopendir(fd)) == NULL) {
+		(void)close(fd);
+		return (-1);
+	}
+	for (;;) {
+		errno = 0;
+		if ((d = readdir(dir)) == NULL)
+			break;
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		if (n == size) {
+			size = (size == 0) ? 64 : size * 2;
+			if ((v = realloc(names, size * sizeof(*v))) == NULL)
+				goto fail;
+			names = v;
+		}
+		if ((names[n].name = strdup(d->d_name)) == NULL)
+			goto fail;
+		names[n].ino = d->d_ino;
+		names[n].type = d->d_type;
+		n++;
+	}
+	if (errno != 0)
+		goto fail;
+	(void)closedir(dir);
+
+	qsort(names, n, sizeof(*names), direntcmp);
+	*namesp = names;
+
+	return ((ssize_t)n);
+
+fail:
+	while (n > 0)
+		free(names[--n].name);
+	free(names);
+	(void)closedir(dir);
+	return (-1);
+}
+
+/*
+ * Writes the lines of the subtree of the directory open as fd, whose path
+ * is in w->path & its inode in st.  Takes the inodes of the files on the
+ * device of the table from it
+ */
+static void
+xfs_walk(struct xfswalk *w, int fd, const struct stat *st)
+{
+	struct dirname *names;
+	struct stat child;
+	size_t len, i;
+	ssize_t n;
+	int cfd, intable, error;
+
+	snapshot_line(w->fp, st, w->path, w->sep);
+	if ((n = read_dir(fd, &names)) < 0) {
+		fprintf(stderr, "%s: %s\n", w->path, strerror(errno));
+		w->status = -1;
+		return;
+	}
+
+	/* Children of "dir/" are "dir/name", like with fts(3) */
+	len = strlen(w->path);
+	if (len > 0 && w->path[len - 1] == '/')
+		len--;
+	intable = (st->st_dev == xfs_dev(w->table));
+
+	for (i = 0; i < (size_t)n; i++) {
+		size_t need = len + strlen(names[i].name) + 2;
+
+		if (need > w->size) {
+			char *p;
+
+			if ((p = realloc(w->path, need)) == NULL) {
+				perror("realloc()");
+				w->status = -1;
+				break;
+			}
+			w->path = p;
+			w->size = need;
+		}
+		w->path[len] = '/';
+		strcpy(w->path + len + 1, names[i].name);
+
+		if (names[i].type == DT_DIR || names[i].type == DT_UNKNOWN) {
+			/* Mount points are stat'ed through the opened directory */
+			cfd = open(w->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			    O_CLOEXEC);
+			if (cfd >= 0) {
+				if (fstat(cfd, &child) == 0) {
+					xfs_walk(w, cfd, &child);
+					continue;
+				}
+				(void)close(cfd);
+			} else if ((error = errno) != ENOTDIR && error != ELOOP &&
+			    lstat(w->path, &child) == 0) {
+				/* Listed, but can't be read */
+				snapshot_line(w->fp, &child, w->path, w->sep);
+				fprintf(stderr, "%s: %s\n", w->path,
+				    strerror(error));
+				w->status = -1;
+				continue;
+			}
+		}
+		if ((!intable ||
+		    xfs_lookup(w->table, names[i].ino, &child) < 0) &&
+		    lstat(w->path, &child) < 0) {
+			fprintf(stderr, "%s: %s\n", w->path, strerror(errno));
+			w->status = -1;
+			continue;
+		}
+		snapshot_line(w->fp, &child, w->path, w->sep);
+	}
+
+	for (i = 0; i < (size_t)n; i++)
+		free(names[i].name);
+	free(names);
+	w->path[len] = '\0';
+}
+
+/*
+ * Writes a snapshot of the XFS mount at root with the table.
+ * Returns 0 on success, -1 on error
+ */
+static int
+snapshot_xfs(const char *root, const struct xfstable *t, FILE *fp, int sep)
+{
+	struct xfswalk w;
+	struct stat st;
+	int fd;
+
+	memset(&w, 0, sizeof(w));
+	w.table = t;
+	w.fp = fp;
+	w.sep = sep;
+	if ((w.path = strdup(root)) == NULL) {
+		perror("strdup()");
+		return (-1);
+	}
+	w.size = strlen(root) + 1;
+
+	if ((fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+	    fstat(fd, &st) < 0) {
+		perror(root);
+		if (fd >= 0)
+			(void)close(fd);
+		free(w.path);
+		return (-1);
+	}
+	xfs_walk(&w, fd, &st);
+	free(w.path);
+
+	return (w.status);
+}
+
+/*
+ * Compares paths in the order they are walked, i.e. as if '/' sorted
+ * before any other character
+ */
+int
+pathcmp(const char *a, const char *b)
+{
+	int ca, cb;
+
+	while (*a != '\0' && *a == *b)
+		a++, b++;
+
+	ca = (*a == '/') ? 1 : (*a == '\0') ? 0 : (unsigned char)*a + 1;
+	cb = (*b == '/') ? 1 : (*b == '\0') ? 0 : (unsigned char)*b + 1;
+
+	return (ca - cb);
+}
+
+/*
+ * Writes a snapshot of the trees rooted at roots to file ("-" for stdout),
+ * leaving out what the filter f, if any, doesn't select.
+ * Returns 0 on success, -1 on error
+ */
+int
+snapshot_write(char **roots, const char *file, int sep, const struct filter *f)
+{
+	struct xfstable *t = NULL;
+	FTSENT *p;
+	FTS *fts;
+	FILE *fp;
+	int status = 0;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdout;
+	else if ((fp = fopen(file, "w")) == NULL) {
+		perror(file);
+		return (-1);
+	}
+
+	if (f == NULL && roots[0] != NULL && roots[1] == NULL &&
+	    (t = xfs_scan(roots[0])) != NULL) {
+		status = snapshot_xfs(roots[0], t, fp, sep);
+		xfs_free(t);
+		goto end;
+	}
+
+	if ((fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, namecmp)) == NULL) {
+		perror("fts_open()");
+		if (fp != stdout)
+			(void)fclose(fp);
+		return (-1);
+	}
+
+	for (;;) {
+		errno = 0;
+		if ((p = fts_read(fts)) == NULL) {
+			if (errno != 0) {
+				perror("fts_read()");
+				status = -1;
+			}
+			break;
+		}
+
+		switch (p->fts_info) {
+		case FTS_DP:
+			continue;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			fprintf(stderr, "%s: %s\n", p->fts_path,
+			    strerror(p->fts_errno));
+			status = -1;
+			continue;
+		default:
+			break;
+		}
+
+		if (f != NULL) {
+			switch (filter_run(f, p)) {
+			case FILTER_PRUNE:
+				if (p->fts_info == FTS_D)
+					(void)fts_set(fts, p, FTS_SKIP);
+				continue;
+			case FILTER_SKIP:
+				continue;
+			default:
+				break;
+			}
+		}
+
+		snapshot_line(fp, p->fts_statp, p->fts_path, sep);
+	}
+	(void)fts_close(fts);
+
+end:
+	if (fflush(fp) != 0 || ferror(fp)) {
+		perror(file);
+		status = -1;
+	}
+	if (fp != stdout && fclose(fp) != 0) {
+		perror(file);
+		status = -1;
+	}
+
+	return (status);
+}
+
+/*
+ * Reads the next snapshot line.  Returns 1 if there is one, 0 at the end,
+ * -1 on error
+ */
+static int
+snapshot_next(struct snapline *s, int sep)
+{
+	const char *p;
+	ssize_t len;
+
+	for (;;) {
+		if ((len = getdelim(&s->line, &s->size, sep, s->fp)) <= 0) {
+			if (ferror(s->fp)) {
+				perror(s->file);
+				return (-1);
+			}
+			return (0);
+		}
+		s->lineno++;
+		if (s->line[len - 1] == sep)
+			s->line[--len] = '\0';
+		if (len > 0)
+			break;
+	}
+
+	/* Skip dev & ino */
+	p = s->line + strspn(s->line, "0123456789");
+	if (*p == ' ')
+		p += 1 + strspn(p + 1, "0123456789");
+	if (*p != ' ' || manifest_parse(p + 1, &s->ctime, &s->path) < 0) {
+		fprintf(stderr, "%s:%zu: malformed line\n", s->file, s->lineno);
+		return (-1);
+	}
+
+	return (1);
+}
+
+static int
+snapshot_open(struct snapline *s, const char *file)
+{
+	memset(s, 0, sizeof(*s));
+	s->file = file;
+	if (strcmp(file, "-") == 0)
+		s->fp = stdin;
+	else if ((s->fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+snapshot_close(struct snapline *s)
+{
+	free(s->line);
+	if (s->fp != NULL && s->fp != stdin)
+		(void)fclose(s->fp);
+}
+
+/*
+ * Returns whether ctime is not within slack usecs after want
+ */
+static int
+drifted(const struct timespec *want, const struct timespec *ctime, long slack)
+{
+	long long d;
+
+	d = ((long long)ctime->tv_sec - want->tv_sec) * 1000000000LL +
+	    (ctime->tv_nsec - want->tv_nsec);
+
+	return (d < 0 || d > slack * 1000LL);
+}
+
+/*
+ * Writes a manifest of the files in the snapshot from whose ctime differs
+ * in the snapshot to.  Returns 0 on success, -1 on error
+ */
+int
+snapshot_diff(const char *from, const char *to, FILE *out, int sep, long slack)
+{
+	struct snapline a, b;
+	int ra, rb, cmp, status = -1;
+
+	if (snapshot_open(&a, from) < 0)
+		return (-1);
+	if (snapshot_open(&b, to) < 0) {
+		snapshot_close(&a);
+		return (-1);
+	}
+
+	ra = snapshot_next(&a, sep);
+	rb = snapshot_next(&b, sep);
+	while (ra > 0 && rb >= 0) {
+		/* Files missing from the second snapshot can't be stamped */
+		cmp = (rb == 0) ? -1 : pathcmp(a.path, b.path);
+		if (cmp < 0)
+			ra = snapshot_next(&a, sep);
+		else if (cmp > 0)
+			rb = snapshot_next(&b, sep);
+		else {
+			if (drifted(&a.ctime, &b.ctime, slack))
+				fprintf(out, "%jd.%09ld %s%c",
+				    (intmax_t)a.ctime.tv_sec, a.ctime.tv_nsec,
+				    a.path, sep);
+			ra = snapshot_next(&a, sep);
+			rb = snapshot_next(&b, sep);
+		}
+	}
+	if (ra == 0 && rb >= 0)
+		status = 0;
+
+	if (fflush(out) != 0 || ferror(out)) {
+		perror("fflush()");
+		status = -1;
+	}
+
+	snapshot_close(&a);
+	snapshot_close(&b);
+
+	return (status);
+}
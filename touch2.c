@@ -8,13 +8,101 @@
 
 static char usage[] =
 	"Usage: ./touch2 [-a|-m] [-r file|-t timestamp] files...\n"
+	"       ./touch2 [-a|-m] [-r file|-t timestamp] [run options] [filters]\n"
+	"                [--cache file] [--mount-ns PID]... -R files...\n"
+	"       ./touch2 [run options] [--mount-ns PID]... -g worktree\n"
+	"       ./touch2 [run options] --undo log\n"
+	"       ./touch2 [-0] [run options] [--mount-ns PID]... -f manifest\n"
+	"       ./touch2 [run options] --daemon socket\n"
+	"       ./touch2 [-0v] [--weight N] --submit socket -f manifest\n"
+	"       ./touch2 [-0] [filters] --snapshot file files...\n"
+	"       ./touch2 cp [run options] source... destination\n"
+	"       ./touch2 [-0] [-w usecs] --diff snapshot1 snapshot2\n"
+	"       touch2-replay [run options] plan dir...\n"
+	"  Run options: [-v] [-w usecs] [-u log] [--durable] [--trickle rate]\n"
+	"               [--shard K/N] [--record plan] [--trace file]\n"
+	"               [--watch | --repair] [--freeze cgroup]...\n"
 	"  Options:\n"
 	"  -h	   Print this help and exit\n"
 	"  -a	   Use the file's last-access time\n"
 	"  -m	   Use the file's last-modification time\n"
 	"  -r file Use this file's time instead of current time\n"
 	"  -t [[[YYYY:]MM:]DD:]hh:mm:ss[.uuuuuu]\n"
-	"	   Use this timestamp instead of current time\n";
+	"	   Use this timestamp instead of current time\n"
+	"  -R	   Change the files in the directory trees too\n"
+	"  --cache file\n"
+	"	   Skip the subtrees whose directories are unchanged since the\n"
+	"	   last run with this cache (with -R & -t, -r, -a or -m)\n"
+	"  --mount-ns PID\n"
+	"	   Look the files up in the mount namespace of the process,\n"
+	"	   once per PID given, & stamp them all together (with -R,\n"
+	"	   -g & -f; Linux only)\n"
+	"  -g dir  Set the ctimes of the files tracked by the git work tree\n"
+	"	   to those recorded in its index\n"
+	"  -w usecs\n"
+	"	   Maximum time the clock may stay stepped at once (10000)\n"
+	"  -f file Set the ctimes listed in the manifest file (- for stdin)\n"
+	"  -u log  Save the previous ctimes to log (with -R, -g, -f, --undo\n"
+	"	   & cp)\n"
+	"  --undo log\n"
+	"	   Restore the ctimes saved by -u\n"
+	"  --record plan\n"
+	"	   Save the shape of the run, without any name, for\n"
+	"	   touch2-replay (with -R, -g, -f, --undo, --daemon & cp)\n"
+	"  --trace file\n"
+	"	   Save a timeline of the run's phases in the Chrome trace\n"
+	"	   event format, for Perfetto (with -R, -g, -f, --undo,\n"
+	"	   --daemon & cp)\n"
+	"  --watch\n"
+	"	   Log the files other processes change while the clock is\n"
+	"	   stepped, on the filesystems touched (with -R, -g, -f,\n"
+	"	   --undo, --daemon & cp; Linux only)\n"
+	"  --repair\n"
+	"	   Like --watch, & give these files the current time back\n"
+	"  --snapshot file\n"
+	"	   Save the ctimes of the files in the trees to file\n"
+	"  cp	   Copy the sources like cp -a & give the copies their ctimes\n"
+	"  --diff snapshot1 snapshot2\n"
+	"	   Print a manifest of the files in snapshot1 whose ctime\n"
+	"	   differs in snapshot2 by more than the -w budget\n"
+	"  --durable\n"
+	"	   Flush the filesystems touched to disk before exiting\n"
+	"	   (with -R, -g, -f, --undo & cp)\n"
+	"  --trickle rate\n"
+	"	   Stamp at most rate files per second (0 for no limit),\n"
+	"	   walk at idle I/O priority & pause while the host is under\n"
+	"	   pressure (with -R, -g, -f, --undo & cp)\n"
+	"  --freeze cgroup\n"
+	"	   Freeze this cgroup v2 group while the clock is stepped, by\n"
+	"	   path below the cgroup2 mount (with -R, -g, -f, --undo,\n"
+	"	   --daemon & cp; Linux only)\n"
+	"  --daemon socket\n"
+	"	   Serve the clients connecting to socket (Linux only)\n"
+	"  --submit socket\n"
+	"	   Have the daemon at socket set the ctimes of the manifest\n"
+	"  --weight N\n"
+	"	   Get N times the share of the daemon of other clients\n"
+	"	   (1 to 16, root only)\n"
+	"  --shard K/N\n"
+	"	   Only change the Kth of N disjoint parts of the files,\n"
+	"	   chosen by inode number (by path with -g, -f & --undo)\n"
+	"  -0	   Manifests & snapshots are NUL separated\n"
+	"  -v	   Print statistics\n"
+	"  Filters (with -R & --snapshot; all must match):\n"
+	"  --name glob\n"
+	"	   Only files whose name matches one of the globs\n"
+	"  --exclude glob\n"
+	"	   Skip the files matching the glob & don't descend into them;\n"
+	"	   a glob with a '/' is matched against the whole path\n"
+	"  --type [fdlbcps]\n"
+	"	   Only files of these types\n"
+	"  --min-size size, --max-size size\n"
+	"	   Only files in this size range (k, M, G & T suffixes)\n"
+	"  --newer-than [amc]time=timestamp, --older-than [amc]time=timestamp\n"
+	"	   Only files whose time is after (before) the timestamp,\n"
+	"	   given as for -t or as @seconds[.nanoseconds]\n"
+	"  --uid user, --gid group\n"
+	"	   Only files owned by this user (group)\n";
 
 #define ERROR_MUTUALLY_EXCLUSIVE1 \
 	"ERROR: The -a, -m & -t options are mutually exclusive!\n"
@@ -22,6 +110,35 @@ static char usage[] =
 #define ERROR_MUTUALLY_EXCLUSIVE2 \
 	"ERROR: The -r & -t options are mutually exclusive!\n"
 
+#define ERROR_MUTUALLY_EXCLUSIVE3 \
+	"ERROR: The -g option takes no files & excludes -a, -m, -r & -t!\n"
+
+#define ERROR_MUTUALLY_EXCLUSIVE4 \
+	"ERROR: The -f, --undo, --diff & --daemon options take no files & exclude -a, -m, -r & -t!\n"
+
+#define ERROR_MUTUALLY_EXCLUSIVE5 \
+	"ERROR: The -f, -g, -R, --undo, --snapshot, --diff & --daemon options are mutually exclusive!\n"
+
+#define ERROR_FILTER \
+	"ERROR: The filters need -R or --snapshot!\n"
+
+#define ERROR_UNDO \
+	"ERROR: The -u, --record, --trace, --watch & --repair options need -R, -g, -f, --undo,\n" \
+	"       --daemon or cp!\n"
+
+#define ERROR_DURABLE \
+	"ERROR: The --durable, --trickle & --freeze options need -R, -g, -f, --undo, --daemon\n" \
+	"       or cp, --shard needs -R, -g, -f or --undo!\n"
+
+#define ERROR_CACHE \
+	"ERROR: The --cache option needs -R & one of -t, -r, -a or -m!\n"
+
+#define ERROR_MOUNTNS \
+	"ERROR: The --mount-ns option needs -R, -g or -f!\n"
+
+#define ERROR_COPY \
+	"ERROR: cp takes only run options except --shard, a source & a destination!\n"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,18 +149,60 @@ static char usage[] =
 #include <sys/time.h>
 #include <time.h>
 
+#include "touch2.h"
+
 /* Use the file's atime instead of ctime as reference */
 static int use_atime = 0;
 /* Use the file's mtime... */
 static int use_mtime = 0;
 
+/*
+ * Hands the n files of v to the leader of the host's runs, with the
+ * targets change_ctime() would give them.  Returns 0 on success, -1 on
+ * error
+ */
+static int
+follow_files(struct engine *eng, char **v, int n, struct timeval ctime)
+{
+	struct timespec target;
+	struct stat inode;
+	char *path;
+	int i, status = 0;
+
+	for (i = 0; i < n; i++) {
+		/* No target is the current time */
+		target.tv_sec = ctime.tv_sec;
+		target.tv_nsec = ctime.tv_usec * 1000;
+		if (!timerisset(&ctime) && (use_atime || use_mtime)) {
+			if (lstat(v[i], &inode) < 0) {
+				perror(v[i]);
+				status = -1;
+				continue;
+			}
+			target = use_atime ? inode.st_atim : inode.st_mtim;
+		}
+		if ((path = strdup(v[i])) == NULL) {
+			perror("strdup()");
+			return (-1);
+		}
+		if (engine_add(eng, path, &target) < 0) {
+			free(path);
+			return (-1);
+		}
+	}
+	if (engine_run(eng) < 0)
+		status = -1;
+
+	return (status);
+}
+
 /*
  * Returns 0 on success, -1 on (system call) error
  */
 static int
 change_ctime(const char *file, struct timeval ctime)
 {
-	sigset_t newsigmask, oldsigmask;
+	sigset_t oldsigmask;
 	struct timeval now;
 	struct stat inode;
 	int status = 0;
@@ -51,10 +210,13 @@ change_ctime(const char *file, struct timeval ctime)
 	if (file == NULL)
 		return (-1);
 
-	/* Get file's inode information */
-	while (stat(file, &inode) < 0) {
+	/*
+	 * Get file's inode information.  A symlink is stamped itself, as
+	 * when a leader stamps it
+	 */
+	while (lstat(file, &inode) < 0) {
 		if (errno != EINTR) {
-			perror("stat()");
+			perror("lstat()");
 			return (-1);
 		}
 	}
@@ -78,14 +240,8 @@ change_ctime(const char *file, struct timeval ctime)
 	}
 
 	/* Block ALL signals */
-	if (sigfillset(&newsigmask) < 0) {
-		perror("sigfillset()");
-		return (-1);
-	}
-	if (sigprocmask(SIG_SETMASK, &newsigmask, &oldsigmask) < 0) {
-		perror("sigprocmask()");
+	if (block_signals(&oldsigmask) < 0)
 		return (-1);
-	}
 
 /* ----- BEGIN CRITICAL SECTION ----- */
 
@@ -100,11 +256,9 @@ change_ctime(const char *file, struct timeval ctime)
 	}
 
 	/* Touch inode */
-	while (chmod(file, inode.st_mode) < 0) {
-		if (errno != EINTR) {
-			perror("chmod()");
-			status--;
-		}
+	if (touch_inode(file, inode.st_mode) < 0) {
+		perror("chmod()");
+		status--;
 	}
 
 	if (timerisset(&ctime)) {
@@ -120,10 +274,8 @@ change_ctime(const char *file, struct timeval ctime)
 end:
 
 	/* Unblock signals */
-	if (sigprocmask(SIG_SETMASK, &oldsigmask, NULL) < 0) {
-		perror("sigprocmask()");
+	if (unblock_signals(&oldsigmask) < 0)
 		return (-1);
-	}
 
 	return ((status != 0) ? -1 : 0);
 }
@@ -199,6 +351,63 @@ str2timeval(const char *s, struct timeval *tvp)
 	return;
 }
 
+/*
+ * Parses a filter timestamp.  Returns 0 on success, -1 on error
+ */
+static int
+str2timespec(const char *s, struct timespec *ts)
+{
+	struct timeval tv;
+	const char *end;
+
+	if (*s == '@')
+		return (((end = parse_timespec(s + 1, ts)) == NULL ||
+		    *end != '\0') ? -1 : 0);
+
+	str2timeval(s, &tv);
+	ts->tv_sec = tv.tv_sec;
+	ts->tv_nsec = tv.tv_usec * 1000;
+
+	return (0);
+}
+
+/*
+ * Parses K/N, with 1 <= K <= N.  Returns 0 on success, -1 on error
+ */
+static int
+parse_shard(const char *s, struct engine *eng)
+{
+	unsigned long long k, n;
+	char *end;
+
+	errno = 0;
+	k = strtoull(s, &end, 10);
+	if (end == s || *end != '/' || errno != 0)
+		return (-1);
+	s = end + 1;
+	n = strtoull(s, &end, 10);
+	if (end == s || *end != '\0' || errno != 0 || k < 1 || k > n)
+		return (-1);
+	eng->shard = k - 1;
+	eng->nshards = n;
+
+	return (0);
+}
+
+/*
+ * Returns the exit status of an engine run
+ */
+static int
+engine_exit(struct engine *eng, int status)
+{
+	if (host_leave(eng) < 0 || undo_close(eng) < 0 || plan_close(eng) < 0 ||
+	    trace_close(eng) < 0 || dircache_close(eng, status >= 0) < 0)
+		status = -1;
+	engine_free(eng);
+
+	return ((status < 0) ? 1 : 0);
+}
+
 static
 void exit_usage(int status)
 {
@@ -214,10 +423,49 @@ main(int argc, char *argv[])
 {
 	struct timeval new_ctime = { 0, 0 };
 	char *rfile = NULL; /* Reference file */
+	char *worktree = NULL; /* Git work tree */
+	char *undolog = NULL; /* Undo log to write */
+	char *record = NULL; /* Plan to record */
+	char *trace = NULL; /* Timeline to write */
+	char *cache = NULL; /* Directory cache */
+	int watch = 0; /* Watch other processes, 2 to repair their files */
+	uint64_t filterkey = DIRCACHE_SEED; /* Hash of the filters */
+	char *restore = NULL; /* Undo log to restore */
+	char *manifest = NULL; /* Manifest to read */
+	char *snapshot = NULL; /* Snapshot to write */
+	char *daemon = NULL; /* Socket to serve */
+	char *submit = NULL; /* Socket of the daemon to submit to */
+	char *diff[2] = { NULL, NULL }; /* Snapshots to compare */
+	const char *name; /* How we were called */
+	struct filter *filter = NULL; /* Walk filter */
+	char **roots; /* Trees of the mount namespaces */
+	char *path; /* Work tree in a mount namespace */
+	int sep = '\n'; /* Manifest & snapshot separator */
+	int recurse = 0;
+	int copy = 0; /* cp */
+	long trickle = 0; /* --trickle rate */
+	long weight = 1; /* --weight for --submit */
+	struct engine eng;
 	struct stat inode;
-	int i;
+	uint64_t t;
+	size_t k;
+	int i, status;
 
-	for (i = 1; i < argc; i++) {
+	/* touch2-replay is a link */
+	if ((name = strrchr(argv[0], '/')) == NULL)
+		name = argv[0];
+	else
+		name++;
+	if (strcmp(name, "touch2-replay") == 0)
+		return (replay_main(argc, argv));
+
+	engine_init(&eng);
+
+	/* touch2 cp, a command of its own with the run options */
+	if (argc > 1 && strcmp(argv[1], "cp") == 0)
+		copy = 1;
+
+	for (i = 1 + copy; i < argc; i++) {
 		if (argv[i][0] == '-') {
 			switch (argv[i][1]) {
 			case 'a':   /* use atime */
@@ -255,6 +503,116 @@ main(int argc, char *argv[])
 					exit_usage(1);
 				str2timeval(argv[i], &new_ctime);
 				break;
+			case 'R':   /* tree mode */
+				recurse = 1;
+				break;
+			case 'g':   /* use the git index */
+				if ((worktree = argv[++i]) == NULL)
+					exit_usage(1);
+				break;
+			case 'w':   /* window budget */
+				if (argv[++i] == NULL)
+					exit_usage(1);
+				if ((eng.budget = atol(argv[i])) <= 0)
+					exit_usage(1);
+				break;
+			case 'u':   /* write an undo log */
+				if ((undolog = argv[++i]) == NULL)
+					exit_usage(1);
+				break;
+			case '-':   /* long options */
+				if (strcmp(argv[i], "--undo") == 0) {
+					if ((restore = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--snapshot") == 0) {
+					if ((snapshot = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--record") == 0) {
+					if ((record = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--trace") == 0) {
+					if ((trace = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--watch") == 0) {
+					if (watch == 0)
+						watch = 1;
+				} else if (strcmp(argv[i], "--repair") == 0) {
+					watch = 2;
+				} else if (strcmp(argv[i], "--cache") == 0) {
+					if ((cache = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--durable") == 0) {
+					eng.durable = 1;
+				} else if (strcmp(argv[i], "--daemon") == 0) {
+					if ((daemon = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--submit") == 0) {
+					if ((submit = argv[++i]) == NULL)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--weight") == 0) {
+					if (argv[++i] == NULL)
+						exit_usage(1);
+					weight = atol(argv[i]);
+					if (weight < 1 || weight > SHM_MAX_WEIGHT)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--shard") == 0) {
+					if (argv[++i] == NULL ||
+					    parse_shard(argv[i], &eng) < 0)
+						exit_usage(1);
+				} else if (strcmp(argv[i], "--trickle") == 0) {
+					if (argv[++i] == NULL)
+						exit_usage(1);
+					if ((trickle = atol(argv[i])) < 0)
+						exit_usage(1);
+					if (eng.trickle == NULL &&
+					    trickle_init(&eng, trickle) < 0)
+						exit(1);
+				} else if (strcmp(argv[i], "--freeze") == 0) {
+					if (argv[++i] == NULL)
+						exit_usage(1);
+					if (freeze_add(&eng, argv[i]) < 0)
+						exit(1);
+				} else if (strcmp(argv[i], "--mount-ns") == 0) {
+					if (argv[++i] == NULL)
+						exit_usage(1);
+					if (mountns_add(&eng, argv[i]) < 0)
+						exit(1);
+				} else if (strcmp(argv[i], "--diff") == 0) {
+					if ((diff[0] = argv[++i]) == NULL ||
+					    (diff[1] = argv[++i]) == NULL)
+						exit_usage(1);
+				} else {
+					int r;
+
+					if (argv[i + 1] == NULL)
+						exit_usage(1);
+					if (filter == NULL && (filter = filter_new()) == NULL)
+						exit(1);
+					if ((r = filter_add(filter, argv[i], argv[i + 1],
+					    str2timespec)) != 0) {
+						if (r < 0)
+							fprintf(stderr, "%s: %s: bad argument \"%s\"\n",
+							    argv[0], argv[i], argv[i + 1]);
+						exit_usage(1);
+					}
+					/* A cache is only good for the same filters */
+					filterkey = dircache_hash(filterkey, argv[i],
+					    strlen(argv[i]) + 1);
+					filterkey = dircache_hash(filterkey, argv[i + 1],
+					    strlen(argv[i + 1]) + 1);
+					i++;
+				}
+				break;
+			case 'f':   /* use a manifest */
+				if ((manifest = argv[++i]) == NULL)
+					exit_usage(1);
+				break;
+			case '0':   /* NUL separated manifests */
+				sep = '\0';
+				break;
+			case 'v':   /* verbose */
+				eng.verbose = 1;
+				break;
 			case 'h':   /* help */
 				exit_usage(0);
 				break;
@@ -267,6 +625,144 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (cache != NULL && (!recurse || (!use_atime && !use_mtime &&
+	    rfile == NULL && !timerisset(&new_ctime)))) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_CACHE);
+		exit_usage(1);
+	}
+	if (eng.nmountns != 0 && ((!recurse && worktree == NULL &&
+	    manifest == NULL) || submit != NULL)) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_MOUNTNS);
+		exit_usage(1);
+	}
+	if (eng.verbose)
+		mountns_print(&eng);
+	if (copy && (argc - i < 2 || recurse || worktree != NULL ||
+	    restore != NULL || manifest != NULL || snapshot != NULL ||
+	    diff[0] != NULL || daemon != NULL || submit != NULL ||
+	    filter != NULL || eng.nshards != 0 || use_atime || use_mtime ||
+	    rfile != NULL || timerisset(&new_ctime) || sep != '\n')) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_COPY);
+		exit_usage(1);
+	}
+	if ((manifest != NULL && submit == NULL) + (worktree != NULL) + recurse +
+	    (restore != NULL) + (snapshot != NULL) + (diff[0] != NULL) +
+	    (daemon != NULL) > 1) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_MUTUALLY_EXCLUSIVE5);
+		exit_usage(1);
+	}
+	if ((restore != NULL || manifest != NULL || diff[0] != NULL ||
+	    daemon != NULL) &&
+	    (i < argc || use_atime || use_mtime || rfile != NULL ||
+	    timerisset(&new_ctime))) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_MUTUALLY_EXCLUSIVE4);
+		exit_usage(1);
+	}
+
+	if (filter != NULL) {
+		if (!recurse && snapshot == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[0], ERROR_FILTER);
+			exit_usage(1);
+		}
+		filter_compile(filter);
+		eng.filter = filter;
+	}
+
+	if (diff[0] != NULL)
+		exit((snapshot_diff(diff[0], diff[1], stdout, sep, eng.budget) < 0) ?
+		    1 : 0);
+
+	if (snapshot != NULL) {
+		if (i >= argc)
+			exit_usage(1);
+		exit((snapshot_write(&argv[i], snapshot, sep, filter) < 0) ? 1 : 0);
+	}
+
+	if (submit != NULL) {
+		if (manifest == NULL)
+			exit_usage(1);
+		exit((client_submit(submit, manifest, sep, (unsigned)weight,
+		    eng.verbose) < 0) ? 1 : 0);
+	}
+	if (worktree != NULL && (i < argc || recurse || use_atime || use_mtime ||
+	    rfile != NULL || timerisset(&new_ctime))) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_MUTUALLY_EXCLUSIVE3);
+		exit_usage(1);
+	}
+	if ((undolog != NULL || record != NULL || trace != NULL || watch) &&
+	    !recurse && worktree == NULL && restore == NULL &&
+	    manifest == NULL && daemon == NULL && !copy) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_UNDO);
+		exit_usage(1);
+	}
+
+	if (!recurse && worktree == NULL && restore == NULL && manifest == NULL &&
+	    (eng.nshards != 0 ||
+	    ((eng.durable || eng.trickle != NULL || eng.freezer != NULL) &&
+	    daemon == NULL && !copy))) {
+		fprintf(stderr, "%s: %s\n", argv[0], ERROR_DURABLE);
+		exit_usage(1);
+	}
+
+	if (undolog != NULL && undo_open(&eng, undolog) < 0)
+		exit(1);
+	if (record != NULL && plan_open(&eng, record) < 0)
+		exit(1);
+	if (trace != NULL && trace_open(&eng, trace) < 0)
+		exit(1);
+	if (watch && watch_open(&eng, watch == 2) < 0)
+		exit(1);
+
+	/* Only one run on the host may step the clock at a time */
+	if (i < argc || restore != NULL || manifest != NULL || worktree != NULL ||
+	    daemon != NULL) {
+		if (host_join(&eng, (daemon != NULL) ? HOST_LEAD :
+		    (!recurse && !copy && restore == NULL && manifest == NULL &&
+		    worktree == NULL) ? HOST_LOCK_ONLY : HOST_JOIN) < 0)
+			exit(1);
+	}
+
+	if (daemon != NULL)
+		return (engine_exit(&eng, daemon_run(&eng, daemon)));
+
+	if (copy)
+		return (engine_exit(&eng, copy_run(&eng, &argv[i], argc - i - 1,
+		    argv[argc - 1])));
+
+	if (restore != NULL) {
+		t = trace_now(&eng);
+		if (undo_load(&eng, restore) < 0)
+			exit(1);
+		trace_span(&eng, "load", t, eng.nentries);
+		return (engine_exit(&eng, engine_run(&eng)));
+	}
+
+	if (manifest != NULL) {
+		t = trace_now(&eng);
+		if (manifest_load(&eng, manifest, sep) < 0)
+			exit(1);
+		/* The same files in every container */
+		if (eng.nmountns != 0 && mountns_expand(&eng) < 0)
+			exit(1);
+		trace_span(&eng, "load", t, eng.nentries);
+		return (engine_exit(&eng, engine_run(&eng)));
+	}
+
+	if (worktree != NULL) {
+		t = trace_now(&eng);
+		if (eng.nmountns == 0 && gitindex_load(&eng, worktree) < 0)
+			exit(1);
+		/* Each container has its own index */
+		for (k = 0; k < eng.nmountns; k++) {
+			if ((path = mountns_path(&eng, k, worktree)) == NULL ||
+			    gitindex_load(&eng, path) < 0)
+				exit(1);
+			free(path);
+		}
+		trace_span(&eng, "load", t, eng.nentries);
+		return (engine_exit(&eng, engine_run(&eng)));
+	}
+
 	if (i >= argc) {
 		exit_usage(1);
 	}
@@ -294,12 +790,39 @@ main(int argc, char *argv[])
 
 	}
 
+	if (recurse) {
+		if (use_atime && rfile == NULL)
+			eng.reftime = REF_ATIME;
+		else if (use_mtime && rfile == NULL)
+			eng.reftime = REF_MTIME;
+		eng.target.tv_sec = new_ctime.tv_sec;
+		eng.target.tv_nsec = new_ctime.tv_usec * 1000;
+		if (cache != NULL && dircache_open(&eng, cache, filterkey) < 0)
+			exit(1);
+		if (eng.nmountns == 0)
+			return (engine_exit(&eng, engine_run_tree(&eng, &argv[i])));
+
+		/* The trees of every container are walked in one run */
+		if ((roots = mountns_paths(&eng, &argv[i], (size_t)(argc - i))) ==
+		    NULL)
+			exit(1);
+		status = engine_run_tree(&eng, roots);
+		mountns_free_paths(roots);
+		return (engine_exit(&eng, status));
+	}
+
+	/* The leader stamps them in its own windows */
+	if (host_following(&eng))
+		return (engine_exit(&eng, follow_files(&eng, &argv[i], argc - i,
+		    new_ctime)));
+
 	for (; i < argc; i++) {
 		if (change_ctime(argv[i], new_ctime) < 0) {
 			fprintf(stderr, "%s: There was an error processing \"%s\"\n",
 				argv[0], argv[i]);
 		}
 	}
+	(void)host_leave(&eng);
 
 	return (0);
 }
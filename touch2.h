@@ -0,0 +1,443 @@
+/*
+ * Shared declarations for touch2
+ */
+
+#ifndef TOUCH2_H
+#define TOUCH2_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fts.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * A file whose ctime is to be set, together with the inode information
+ * gathered for it during the prepare phase.
+ */
+struct entry {
+	char		*path;
+	struct timespec	 target;	/* desired ctime */
+	/* Filled in by the prepare phase */
+	mode_t		 mode;
+	dev_t		 dev;
+	ino_t		 ino;
+	struct timespec	 oldctime;
+	int		 fd;		/* O_PATH descriptor or -1 */
+	/* Filled in by the commit */
+	int		 error;		/* errno, 0 once stamped */
+	size_t		 tag;		/* free for the caller */
+};
+
+/* Where the ctime of a walked file comes from */
+enum reftime {
+	REF_TARGET,			/* engine.target */
+	REF_ATIME,			/* the file's own atime */
+	REF_MTIME			/* the file's own mtime */
+};
+
+struct conn;
+struct dircache;
+struct freezer;
+struct filter;
+struct host;
+struct mountns;
+struct numa;
+struct plan;
+struct server;
+struct syncdev;
+struct trace;
+struct trickle;
+struct watch;
+struct xfstable;
+
+struct engine {
+	struct entry	*entries;
+	size_t		 nentries;
+	size_t		 size;
+	char		*pathmap;	/* mapped manifest the paths point into */
+	size_t		 pathmaplen;
+	long		 budget;	/* usecs the clock may stay stepped */
+	int		 verbose;
+	FILE		*undo;		/* undo log, if any */
+	struct plan	*plan;		/* --record, if any */
+	struct trace	*trace;		/* --trace, if any */
+	/* --durable */
+	int		 durable;
+	struct syncdev	*devs;		/* devices touched */
+	size_t		 ndevs;
+	struct timespec	 lastsync;
+	struct trickle	*trickle;	/* --trickle, if enabled */
+	/* --shard: only the files hashing to shard out of nshards */
+	uint64_t	 shard;
+	uint64_t	 nshards;	/* 0 for all files */
+	/* Descriptor cache */
+	_Atomic size_t	 nfds;
+	_Atomic size_t	 maxfds;
+	int		 dirfd;
+	char		*dirpath;
+	int		 borrowed_fds;	/* entry descriptors are the caller's */
+	/* Tree mode */
+	enum reftime	 reftime;
+	struct timespec	 target;	/* zero means the current time */
+	struct filter	*filter;	/* walk filter, if any */
+	struct dircache	*dircache;	/* --cache, if any */
+	struct host	*host;		/* the host's other runs, if any */
+	struct watch	*watch;		/* --watch, if any */
+	struct freezer	*freezer;	/* --freeze, if any */
+	struct mountns	*mountns;	/* --mount-ns */
+	size_t		 nmountns;
+	/* Statistics */
+	size_t		 nwindows;
+	size_t		 nstepped;	/* windows that stepped the clock */
+	size_t		 nsteps;	/* clock_settime() calls */
+	long		 stepped_usecs;	/* time spent with the clock stepped */
+	size_t		 ntouched;
+	size_t		 nerrors;
+	size_t		 nsyncs;
+	long		 sync_usecs;	/* time spent flushing */
+	size_t		 nforeign;	/* files of other shards */
+	size_t		 nprepare_threads; /* threads of the prepare phase */
+	int		 nnodes;	/* NUMA nodes they ran on */
+};
+
+/* Default value for engine.budget */
+#define DEFAULT_BUDGET	10000L
+
+/* Tree mode ring size & the most entries committed per batch */
+#define RING_SIZE	65536
+#define BATCH_SIZE	4096
+
+
+struct ring {
+	struct entry	*slots;
+	size_t		 mask;
+	_Atomic size_t	 head;		/* next slot to pop */
+	_Atomic size_t	 tail;		/* next slot to push */
+	_Atomic int	 closed;
+};
+
+struct walker {
+	pthread_t	 thread;
+	char		**roots;
+	struct ring	*ring;
+	struct engine	*eng;
+	/* Results */
+	size_t		 nerrors;
+	size_t		 nskipped;	/* entries the filter left out */
+	size_t		 npruned;	/* subtrees the filter excluded */
+	size_t		 nforeign;	/* files of other shards */
+	int		 nthreads;
+	size_t		 nsteals;	/* directory chunks stolen */
+	long		 usecs;
+};
+
+/*
+ * Daemon protocol.  A client connects to the daemon's socket and gets a
+ * shm_hello with the memfd holding its rings & two eventfds: one to wake
+ * the daemon up, one signaled when completions are posted.  The memfd
+ * holds a shm_rings header followed by the submission & completion rings.
+ * Files are registered at an index by sending a shm_register on the
+ * socket together with their descriptors, before submitting entries
+ * that use the index.  The daemon shares itself among the clients by
+ * their weight, and keeps their counters in shm_rings.stats.
+ */
+#define SHM_MAGIC	"touch2r\n"
+#define SHM_VERSION	2
+#define SHM_SQ_ENTRIES	4096
+#define SHM_CQ_ENTRIES	4096	/* a submission is only taken with room here */
+#define SHM_MAX_FDS	250	/* descriptors per shm_register, SCM_MAX_FD */
+
+#define SHM_MAX_WEIGHT	16	/* only for root clients, others get 1 */
+
+/* shm_rings.flags */
+#define SHM_NEED_WAKEUP	0x1	/* the daemon sleeps: signal the eventfd */
+
+/* Latency histogram buckets, by log2 of microseconds */
+#define SHM_LATENCY_BUCKETS 32
+
+struct shm_hello {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 sq_entries;
+	uint32_t	 cq_entries;
+	uint32_t	 size;		/* of the memfd */
+	/* SCM_RIGHTS: memfd, submission eventfd, completion eventfd */
+};
+
+struct shm_register {
+	uint32_t	 index;		/* of the first descriptor */
+	uint32_t	 count;
+	/* SCM_RIGHTS: count descriptors, O_PATH will do */
+};
+
+struct shm_sqe {
+	uint32_t	 index;		/* registered file */
+	uint32_t	 nsec;
+	int64_t		 sec;		/* ctime wanted */
+	uint64_t	 user_data;	/* copied to the completion */
+	uint64_t	 submitted;	/* CLOCK_MONOTONIC ns, 0 if unknown */
+};
+
+struct shm_cqe {
+	uint64_t	 user_data;
+	int32_t		 res;		/* 0 or -errno */
+	uint32_t	 pad;
+};
+
+/* Counters kept by the daemon for a client */
+struct shm_stats {
+	uint64_t	 completed;
+	uint64_t	 failed;
+	uint64_t	 stepped_ns;	/* share of the time the clock was stepped */
+	uint64_t	 latency_ns;	/* total, from submission to completion */
+	uint64_t	 latency_max_ns;
+	uint64_t	 latency[SHM_LATENCY_BUCKETS];
+};
+
+struct shm_rings {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 sq_entries;
+	uint32_t	 cq_entries;
+	/* Each side writes its own cache line */
+	_Alignas(64) _Atomic uint32_t sq_head;	/* daemon */
+	_Atomic uint32_t flags;			/* daemon */
+	_Alignas(64) _Atomic uint32_t sq_tail;	/* client */
+	uint32_t	 weight;		/* client: share of the daemon */
+	_Alignas(64) _Atomic uint32_t cq_head;	/* client */
+	_Alignas(64) _Atomic uint32_t cq_tail;	/* daemon */
+	_Alignas(64) struct shm_stats stats;	/* daemon */
+	/* struct shm_sqe sqes[sq_entries]; struct shm_cqe cqes[cq_entries] */
+};
+
+#define SHM_SQES(r)	((struct shm_sqe *)((char *)(r) + \
+			    ((sizeof(struct shm_rings) + 63) & ~(size_t)63)))
+/* The daemon never reads sizes back: clients can write the whole mapping */
+#define SHM_CQES(r, sq)	((struct shm_cqe *)(SHM_SQES(r) + (sq)))
+#define SHM_SIZE(sq, cq) (((sizeof(struct shm_rings) + 63) & ~(size_t)63) + \
+			    (sq) * sizeof(struct shm_sqe) + \
+			    (cq) * sizeof(struct shm_cqe))
+
+/* engine.c */
+void	engine_init(struct engine *);
+void	engine_free(struct engine *);
+int	engine_add(struct engine *, char *, const struct timespec *);
+void	engine_free_path(struct engine *, char *);
+int	engine_shard_inode(const struct engine *, ino_t);
+int	engine_shard_path(const struct engine *, const char *);
+int	engine_run(struct engine *);
+int	engine_run_tree(struct engine *, char **);
+int	engine_commit(struct engine *, struct entry *, size_t);
+void	engine_stats(const struct engine *);
+void	engine_target(const struct engine *, const struct stat *,
+	    struct timespec *);
+
+int	block_signals(sigset_t *);
+int	unblock_signals(const sigset_t *);
+int	touch_inode(const char *, mode_t);
+long	tsdiff_usec(const struct timespec *, const struct timespec *);
+
+/* ring.c */
+int	ring_init(struct ring *, size_t);
+void	ring_free(struct ring *);
+void	ring_push(struct ring *, const struct entry *);
+void	ring_close(struct ring *);
+size_t	ring_pop(struct ring *, struct entry *, size_t);
+size_t	ring_count(struct ring *);
+
+/* walk.c */
+int	walk_start(struct walker *);
+void	walk_join(struct walker *);
+
+/* pwalk.c */
+int	pwalk_threads(const struct engine *);
+ssize_t	pwalk_run(struct walker *, int);
+
+
+/* fdcache.c */
+void	fdcache_init(struct engine *);
+void	fdcache_free(struct engine *);
+int	fdcache_open(struct engine *, struct entry *);
+int	fdcache_shrink(struct engine *, size_t);
+void	fdcache_close(struct engine *, struct entry *);
+int	fdcache_touch(struct engine *, const struct entry *);
+int	fdcache_open_fs(const struct engine *, const struct entry *);
+
+/* undo.c */
+int	undo_open(struct engine *, const char *);
+int	undo_append(struct engine *, const struct entry *);
+int	undo_close(struct engine *);
+int	undo_load(struct engine *, const char *);
+
+/* durable.c */
+int	durable_note(struct engine *, const struct entry *);
+int	durable_sync(struct engine *, int);
+void	durable_free(struct engine *);
+
+/* trickle.c */
+int	trickle_init(struct engine *, long);
+void	trickle_free(struct engine *);
+int	trickle_idle(const struct engine *);
+void	trickle_unidle(int);
+size_t	trickle_wait(struct engine *, size_t);
+void	trickle_spend(struct engine *, size_t);
+void	trickle_stats(const struct engine *);
+
+/* daemon.c */
+int	daemon_run(struct engine *, const char *);
+struct server *server_new(void);
+int	server_listen(struct server *, const char *);
+void	server_unlisten(struct server *);
+int	server_round(struct server *, struct engine *, int);
+int	server_pending(const struct server *);
+unsigned server_clients(const struct server *);
+void	server_print(const struct server *);
+void	server_free(struct server *);
+
+/* client.c */
+int	client_submit(const char *, const char *, int, unsigned, int);
+struct conn *client_connect(const char *);
+int	client_commit(const struct engine *, struct conn *, struct entry *,
+	    size_t);
+void	client_close(struct conn *);
+
+/* manifest.c */
+const char *parse_timespec(const char *, struct timespec *);
+int	manifest_parse(const char *, struct timespec *, const char **);
+int	manifest_load(struct engine *, const char *, int);
+
+/* snapshot.c */
+int	pathcmp(const char *, const char *);
+int	snapshot_write(char **, const char *, int, const struct filter *);
+int	snapshot_diff(const char *, const char *, FILE *, int, long);
+
+/* plan.c */
+struct plan_record {
+	uint32_t	 dir;		/* directory number */
+	uint32_t	 type;		/* S_IFMT bits of the mode */
+	uint32_t	 dev;		/* device number, from 0 */
+	uint32_t	 pad;
+	int64_t		 delta;		/* nsecs after the first target */
+};
+
+struct plan_data {
+	uint32_t	*parents;	/* by directory, UINT32_MAX for the top */
+	uint32_t	 ndirs;
+	uint32_t	 ndevs;
+	struct plan_record *records;
+	size_t		 nrecords;
+};
+
+int	plan_open(struct engine *, const char *);
+int	plan_note(struct engine *, const struct entry *, size_t);
+int	plan_close(struct engine *);
+int	plan_load(const char *, struct plan_data *);
+void	plan_unload(struct plan_data *);
+
+/* trace.c */
+int	trace_open(struct engine *, const char *);
+int	trace_close(struct engine *);
+uint64_t trace_now(const struct engine *);
+void	trace_span(const struct engine *, const char *, uint64_t, size_t);
+void	trace_counter(const struct engine *, const char *, uint64_t);
+void	trace_thread(const struct engine *, const char *);
+void	trace_flush(const struct engine *, int);
+
+/* replay.c */
+int	replay_main(int, char **);
+
+/* host.c */
+#define HOST_LOCK	"/run/touch2.lock"
+#define HOST_SOCK	"/run/touch2.sock"
+
+/* How to join the host's runs */
+#define HOST_JOIN	0		/* lead, or follow the leader */
+#define HOST_LEAD	1		/* wait to lead */
+#define HOST_LOCK_ONLY	2		/* lead serving no one, or follow */
+
+int	host_join(struct engine *, int);
+int	host_following(const struct engine *);
+struct server *host_server(const struct engine *);
+void	host_serve(struct engine *);
+size_t	host_follow(struct engine *, struct entry *, size_t);
+int	host_leave(struct engine *);
+
+/* watch.c */
+int	watch_open(struct engine *, int);
+void	watch_note(struct engine *, const struct entry *, size_t);
+void	watch_check(struct engine *, const struct entry *, size_t);
+void	watch_stats(const struct engine *);
+void	watch_close(struct engine *);
+
+/* freeze.c */
+int	freeze_add(struct engine *, const char *);
+void	freeze_groups(struct engine *);
+void	freeze_thaw(struct engine *);
+void	freeze_stats(const struct engine *);
+void	freeze_free(struct engine *);
+
+/* mountns.c */
+int	mountns_add(struct engine *, const char *);
+void	mountns_print(const struct engine *);
+char	*mountns_path(const struct engine *, size_t, const char *);
+const char *mountns_strip(const struct engine *, const char *);
+int	mountns_open(const struct engine *, const char *, int);
+int	mountns_lstat(const struct engine *, const char *, struct stat *);
+char	**mountns_paths(const struct engine *, char **, size_t);
+void	mountns_free_paths(char **);
+int	mountns_expand(struct engine *);
+void	mountns_free(struct engine *);
+
+/* numa.c */
+struct numa *numa_open(void);
+void	numa_close(struct numa *);
+int	numa_nodes(const struct numa *);
+int	numa_cpus(const struct numa *, int);
+int	numa_path_node(const struct numa *, const char *);
+int	numa_dev_node(const struct numa *, dev_t);
+int	numa_pin(const struct numa *, int);
+
+/* copy.c */
+int	copy_run(struct engine *, char **, int, const char *);
+
+/* xfs.c */
+struct xfstable *xfs_scan(const char *);
+int	xfs_lookup(const struct xfstable *, ino_t, struct stat *);
+dev_t	xfs_dev(const struct xfstable *);
+void	xfs_free(struct xfstable *);
+
+/* filter.c */
+enum verdict {
+	FILTER_SELECT,			/* stamp it */
+	FILTER_SKIP,			/* leave it, but walk its subtree */
+	FILTER_PRUNE			/* leave it & its subtree */
+};
+
+struct filter *filter_new(void);
+void	filter_free(struct filter *);
+int	filter_add(struct filter *, const char *, const char *,
+	    int (*)(const char *, struct timespec *));
+void	filter_compile(struct filter *);
+enum verdict filter_run(const struct filter *, const FTSENT *);
+
+/* dircache.c */
+#define DIRCACHE_SEED	0xcbf29ce484222325ULL
+
+uint64_t dircache_hash(uint64_t, const void *, size_t);
+int	dircache_open(struct engine *, const char *, uint64_t);
+int	dircache_enter(struct engine *, FTSENT *);
+void	dircache_note(struct engine *, FTSENT *, const struct timespec *);
+void	dircache_leave(struct engine *, FTSENT *);
+void	dircache_stats(const struct engine *);
+int	dircache_close(struct engine *, int);
+
+/* gitindex.c */
+int	gitindex_load(struct engine *, const char *);
+
+#endif /* TOUCH2_H */
@@ -0,0 +1,295 @@
+/*
+ * Timeline tracing
+ *
+ * DETAILS:
+ *   --trace writes the phases of a run as Chrome trace events, which
+ *   Perfetto & chrome://tracing show as a timeline per thread: spans for
+ *   loading, stat'ing, sorting, each chain of windows with its clock steps
+ *   & restore, syncs & the committer waiting for the walker, plus counters
+ *   for the depth of the walker's queue & the resident set size.  Times
+ *   are taken from CLOCK_MONOTONIC, which clock steps don't move.  Events
+ *   are buffered in memory & only written out between chains, so that no
+ *   file is written while the clock is stepped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "touch2.h"
+
+/* Events buffered before trace_flush() writes them */
+#define TRACE_FLUSH	16384
+
+struct event {
+	const char	*name;		/* a string constant */
+	const char	*label;		/* thread name, for 'M' */
+	char		 ph;		/* 'X' span, 'C' counter, 'M' metadata */
+	long		 tid;
+	uint64_t	 ts;		/* nsecs since the start */
+	uint64_t	 arg;		/* span length or counter value */
+	size_t		 count;		/* files in a span, if any */
+};
+
+struct trace {
+	pthread_mutex_t	 lock;
+	FILE		*fp;
+	const char	*file;
+	int		 failed;
+	long		 pid;
+	uint64_t	 start;
+	struct event	*v;
+	size_t		 n;
+	size_t		 size;
+	int		 statm;		/* /proc/self/statm, or -1 */
+	size_t		 nwritten;
+};
+
+static _Thread_local long thread_id;
+static _Atomic long nthreads;
+
+static uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static long
+tid(void)
+{
+	if (thread_id == 0)
+		thread_id = atomic_fetch_add(&nthreads, 1) + 1;
+
+	return (thread_id);
+}
+
+static void
+add(struct trace *t, const struct event *ev)
+{
+	struct event *v;
+
+	(void)pthread_mutex_lock(&t->lock);
+	if (t->n == t->size) {
+		t->size = t->size ? t->size * 2 : TRACE_FLUSH;
+		if ((v = realloc(t->v, t->size * sizeof(*v))) == NULL) {
+			/* Reported by trace_close() */
+			t->failed = 1;
+			t->size = t->n;
+			(void)pthread_mutex_unlock(&t->lock);
+			return;
+		}
+		t->v = v;
+	}
+	t->v[t->n++] = *ev;
+	(void)pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+int
+trace_open(struct engine *eng, const char *file)
+{
+	struct trace *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	if ((t->fp = fopen(file, "w")) == NULL) {
+		perror(file);
+		free(t);
+		return (-1);
+	}
+	(void)pthread_mutex_init(&t->lock, NULL);
+	t->file = file;
+	t->pid = (long)getpid();
+	t->start = mono_ns();
+	t->statm = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	fprintf(t->fp, "{\"traceEvents\":[\n");
+	eng->trace = t;
+
+	trace_thread(eng, "committer");
+
+	return (0);
+}
+
+/*
+ * Returns the time for trace_span(), or 0 if not tracing
+ */
+uint64_t
+trace_now(const struct engine *eng)
+{
+	return ((eng->trace != NULL) ? mono_ns() : 0);
+}
+
+/*
+ * Adds a span from start to now on the calling thread, for count files
+ * if not 0
+ */
+void
+trace_span(const struct engine *eng, const char *name, uint64_t start,
+    size_t count)
+{
+	struct event ev;
+	uint64_t now;
+
+	if (eng->trace == NULL)
+		return;
+	now = mono_ns();
+	memset(&ev, 0, sizeof(ev));
+	ev.name = name;
+	ev.ph = 'X';
+	ev.tid = tid();
+	ev.ts = start - eng->trace->start;
+	ev.arg = now - start;
+	ev.count = count;
+	add(eng->trace, &ev);
+}
+
+void
+trace_counter(const struct engine *eng, const char *name, uint64_t value)
+{
+	struct event ev;
+
+	if (eng->trace == NULL)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.name = name;
+	ev.ph = 'C';
+	ev.tid = tid();
+	ev.ts = mono_ns() - eng->trace->start;
+	ev.arg = value;
+	add(eng->trace, &ev);
+}
+
+/*
+ * Names the calling thread
+ */
+void
+trace_thread(const struct engine *eng, const char *label)
+{
+	struct event ev;
+
+	if (eng->trace == NULL)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.name = "thread_name";
+	ev.label = label;
+	ev.ph = 'M';
+	ev.tid = tid();
+	add(eng->trace, &ev);
+}
+
+/*
+ * Returns the resident set size in bytes, or 0 if unknown
+ */
+static uint64_t
+rss(struct trace *t)
+{
+	struct rusage ru;
+	char buf[128];
+	unsigned long size, resident;
+	ssize_t len;
+
+	if (t->statm >= 0 &&
+	    (len = pread(t->statm, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		if (sscanf(buf, "%lu %lu", &size, &resident) == 2)
+			return ((uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE));
+	}
+	/* The peak, in KiB, where there's no procfs */
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		return ((uint64_t)ru.ru_maxrss * 1024);
+
+	return (0);
+}
+
+static void
+write_event(struct trace *t, const struct event *ev, int first)
+{
+	fprintf(t->fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%ld,"
+	    "\"tid\":%ld,\"ts\":%.3f", first ? "" : ",\n", ev->name, ev->ph,
+	    t->pid, ev->tid, ev->ts / 1e3);
+	switch (ev->ph) {
+	case 'X':
+		fprintf(t->fp, ",\"dur\":%.3f", ev->arg / 1e3);
+		if (ev->count != 0)
+			fprintf(t->fp, ",\"args\":{\"files\":%zu}", ev->count);
+		break;
+	case 'C':
+		fprintf(t->fp, ",\"args\":{\"value\":%ju}", (uintmax_t)ev->arg);
+		break;
+	case 'M':
+		fprintf(t->fp, ",\"args\":{\"name\":\"%s\"}", ev->label);
+		break;
+	}
+	fputc('}', t->fp);
+}
+
+/*
+ * Writes out the buffered events, if there are enough of them or final.
+ * Must not be called while the clock is stepped
+ */
+void
+trace_flush(const struct engine *eng, int final)
+{
+	struct trace *t = eng->trace;
+	size_t i;
+
+	if (t == NULL || (!final && t->n < TRACE_FLUSH))
+		return;
+	trace_counter(eng, "rss", rss(t));
+
+	(void)pthread_mutex_lock(&t->lock);
+	for (i = 0; i < t->n; i++)
+		write_event(t, &t->v[i], t->nwritten++ == 0);
+	t->n = 0;
+	(void)pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Writes out the trace.  Returns 0 on success, -1 on error
+ */
+int
+trace_close(struct engine *eng)
+{
+	struct trace *t = eng->trace;
+	int status = 0;
+
+	if (t == NULL)
+		return (0);
+	trace_flush(eng, 1);
+	eng->trace = NULL;
+
+	fprintf(t->fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	if (t->failed) {
+		fprintf(stderr, "%s: events lost for lack of memory\n", t->file);
+		status = -1;
+	}
+	if (fflush(t->fp) != 0 || ferror(t->fp)) {
+		perror(t->file);
+		status = -1;
+	}
+	if (fclose(t->fp) != 0 && status == 0) {
+		perror(t->file);
+		status = -1;
+	}
+	if (t->statm >= 0)
+		(void)close(t->statm);
+	(void)pthread_mutex_destroy(&t->lock);
+	free(t->v);
+	free(t);
+
+	return (status);
+}
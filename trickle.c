@@ -0,0 +1,219 @@
+/*
+ * Trickle mode
+ *
+ * DETAILS:
+ *   Spreads a big job out instead of bursting it, for live servers.  The
+ *   prepare phase runs at idle I/O priority, the host's pressure stall
+ *   information is checked every second and nothing is stamped while any
+ *   "some avg10" in /proc/pressure is above TRICKLE_PRESSURE percent, and
+ *   the number of files per chain is capped so that the run stays below the
+ *   given rate.  Without ioprio_set(2) or PSI only the rate applies.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "touch2.h"
+
+/* Pause while any resource stalls some task this % of the time */
+#define TRICKLE_PRESSURE	10.0
+
+/* Seconds between pressure checks */
+#define PRESSURE_INTERVAL	1
+
+/* Burst allowance, as a fraction of a second's worth of files */
+#define TRICKLE_BURST		0.1
+
+/* ioprio_set(2), which has no glibc wrapper */
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_IDLE	3
+
+struct trickle {
+	long		 rate;		/* files per second, 0 for no limit */
+	double		 tokens;	/* files that may go right now */
+	struct timespec	 last;		/* when tokens were last added */
+	struct timespec	 checked;	/* last pressure check */
+	/* Statistics */
+	long		 paused_usecs;	/* waiting for pressure to drop */
+	long		 throttled_usecs; /* waiting for the rate */
+};
+
+static const char *pressure_files[] = {
+	"/proc/pressure/io",
+	"/proc/pressure/cpu",
+	"/proc/pressure/memory"
+};
+
+static void
+sleep_usec(long usecs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usecs / 1000000L;
+	ts.tv_nsec = (usecs % 1000000L) * 1000;
+	(void)nanosleep(&ts, NULL);
+}
+
+/*
+ * Returns whether the host is under pressure
+ */
+static int
+under_pressure(void)
+{
+	double avg10;
+	size_t i;
+	FILE *fp;
+	int r;
+
+	for (i = 0; i < sizeof(pressure_files) / sizeof(pressure_files[0]); i++) {
+		if ((fp = fopen(pressure_files[i], "r")) == NULL)
+			continue;	/* no PSI */
+		r = fscanf(fp, "some avg10=%lf", &avg10);
+		(void)fclose(fp);
+		if (r == 1 && avg10 > TRICKLE_PRESSURE)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * rate is in files per second, 0 for no limit.
+ * Returns 0 on success, -1 on error
+ */
+int
+trickle_init(struct engine *eng, long rate)
+{
+	struct trickle *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	t->rate = rate;
+	(void)clock_gettime(CLOCK_MONOTONIC, &t->last);
+	eng->trickle = t;
+
+	return (0);
+}
+
+void
+trickle_free(struct engine *eng)
+{
+	free(eng->trickle);
+	eng->trickle = NULL;
+}
+
+/*
+ * Drops the calling thread to idle I/O priority.
+ * Returns the previous priority for trickle_unidle(), or -1
+ */
+int
+trickle_idle(const struct engine *eng)
+{
+	int prio = -1;
+
+	if (eng->trickle == NULL)
+		return (-1);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	prio = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+		perror("ioprio_set()");
+		prio = -1;
+	}
+#endif
+
+	return (prio);
+}
+
+/*
+ * Puts back the I/O priority saved by trickle_idle()
+ */
+void
+trickle_unidle(int prio)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	if (prio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    prio) < 0)
+		perror("ioprio_set()");
+#else
+	(void)prio;
+#endif
+}
+
+/*
+ * Waits until the host is not under pressure & the rate allows at least
+ * one file.  Returns how many of the want files may go now
+ */
+size_t
+trickle_wait(struct engine *eng, size_t want)
+{
+	struct trickle *t = eng->trickle;
+	struct timespec now;
+	double burst, need;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (tsdiff_usec(&t->checked, &now) >= PRESSURE_INTERVAL * 1000000L) {
+		while (under_pressure()) {
+			sleep_usec(PRESSURE_INTERVAL * 1000000L);
+			t->paused_usecs += PRESSURE_INTERVAL * 1000000L;
+		}
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		t->checked = now;
+	}
+
+	if (t->rate == 0)
+		return (want);
+
+	/* Refill, without saving up more than a short burst */
+	burst = (double)(long)(t->rate * TRICKLE_BURST);
+	if (burst < 1)
+		burst = 1;
+	t->tokens += tsdiff_usec(&t->last, &now) / 1e6 * t->rate;
+	if (t->tokens > burst)
+		t->tokens = burst;
+	t->last = now;
+
+	/* Wait for whole bursts, so that chains stay long */
+	need = ((double)want < burst) ? (double)want : burst;
+	if (t->tokens < need) {
+		long usecs = (long)((need - t->tokens) * 1e6 / t->rate) + 1;
+
+		sleep_usec(usecs);
+		t->throttled_usecs += usecs;
+		t->tokens = need;
+		(void)clock_gettime(CLOCK_MONOTONIC, &t->last);
+	}
+
+	return ((want < (size_t)t->tokens) ? want : (size_t)t->tokens);
+}
+
+/*
+ * Accounts for n files stamped
+ */
+void
+trickle_spend(struct engine *eng, size_t n)
+{
+	eng->trickle->tokens -= (double)n;
+}
+
+void
+trickle_stats(const struct engine *eng)
+{
+	const struct trickle *t = eng->trickle;
+
+	fprintf(stderr, "touch2: paused %.3fs for pressure, throttled %.3fs\n",
+	    t->paused_usecs / 1e6, t->throttled_usecs / 1e6);
+}
@@ -0,0 +1,214 @@
+/*
+ * Undo log
+ *
+ * DETAILS:
+ *   Records the ctime every file had before it was stamped, so that a run
+ *   can be rolled back with --undo.  The log is written sequentially through
+ *   a large buffer and read back with mmap(2): a header followed by records
+ *   of fixed fields and the NUL-terminated path, each padded to 8 bytes so
+ *   they can be used in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#define UNDO_MAGIC	"touch2u\n"
+#define UNDO_VERSION	1
+#define UNDO_BOM	0x01020304	/* written in host byte order */
+
+#define UNDO_BUFSIZE	(1 << 20)
+
+struct undo_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 bom;
+};
+
+struct undo_record {
+	uint64_t	 dev;
+	uint64_t	 ino;
+	int64_t		 sec;		/* previous ctime */
+	uint32_t	 nsec;
+	uint32_t	 pathlen;	/* without the NUL */
+	/* char path[pathlen + 1], padded to 8 bytes */
+};
+
+#define UNDO_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+int
+undo_open(struct engine *eng, const char *file)
+{
+	struct undo_header h;
+
+	if ((eng->undo = fopen(file, "w")) == NULL) {
+		perror(file);
+		return (-1);
+	}
+	(void)setvbuf(eng->undo, NULL, _IOFBF, UNDO_BUFSIZE);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, UNDO_MAGIC, sizeof(h.magic));
+	h.version = UNDO_VERSION;
+	h.bom = UNDO_BOM;
+	if (fwrite(&h, sizeof(h), 1, eng->undo) != 1) {
+		perror(file);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Appends the previous ctime of e.  Returns 0 on success, -1 on error
+ */
+int
+undo_append(struct engine *eng, const struct entry *e)
+{
+	static const char pad[8];
+	struct undo_record r;
+	size_t len = strlen(e->path);
+
+	r.dev = (uint64_t)e->dev;
+	r.ino = (uint64_t)e->ino;
+	r.sec = (int64_t)e->oldctime.tv_sec;
+	r.nsec = (uint32_t)e->oldctime.tv_nsec;
+	r.pathlen = (uint32_t)len;
+
+	if (fwrite(&r, sizeof(r), 1, eng->undo) != 1 ||
+	    fwrite(e->path, len, 1, eng->undo) != 1 ||
+	    fwrite(pad, UNDO_ALIGN(len + 1) - len, 1, eng->undo) != 1) {
+		perror("undo log");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+int
+undo_close(struct engine *eng)
+{
+	int status = 0;
+
+	if (eng->undo == NULL)
+		return (0);
+	if (fclose(eng->undo) != 0) {
+		perror("undo log");
+		status = -1;
+	}
+	eng->undo = NULL;
+
+	return (status);
+}
+
+/*
+ * Queues every file in the undo log with its previous ctime.
+ * Returns 0 on success, -1 on error
+ */
+int
+undo_load(struct engine *eng, const char *file)
+{
+	const struct undo_header *h;
+	const unsigned char *p, *end;
+	struct stat st;
+	void *map;
+	int fd, status = -1;
+
+	while ((fd = open(file, O_RDONLY)) < 0) {
+		if (errno != EINTR) {
+			perror(file);
+			return (-1);
+		}
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(file);
+		(void)close(fd);
+		return (-1);
+	}
+	if ((size_t)st.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s: not an undo log\n", file);
+		(void)close(fd);
+		return (-1);
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		perror(file);
+		return (-1);
+	}
+
+	h = map;
+	if (memcmp(h->magic, UNDO_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != UNDO_VERSION) {
+		fprintf(stderr, "%s: not an undo log\n", file);
+		goto end;
+	}
+	if (h->bom != UNDO_BOM) {
+		fprintf(stderr, "%s: written on a host of different byte order\n",
+		    file);
+		goto end;
+	}
+
+	p = (const unsigned char *)map + sizeof(*h);
+	end = (const unsigned char *)map + st.st_size;
+	while (p < end) {
+		const struct undo_record *r = (const void *)p;
+		struct timespec ts;
+		struct entry *e;
+		size_t left, len;
+		char *path;
+		int added;
+
+		/* pathlen + 1 mustn't wrap around on a corrupt log */
+		left = (size_t)(end - p);
+		if (left < sizeof(*r) || (left -= sizeof(*r)) <= r->pathlen ||
+		    left < UNDO_ALIGN((size_t)r->pathlen + 1)) {
+			fprintf(stderr, "%s: truncated undo log\n", file);
+			goto end;
+		}
+		len = sizeof(*r) + UNDO_ALIGN((size_t)r->pathlen + 1);
+
+		/* 0 would mean now, and clock_settime() rejects the rest */
+		if ((r->sec == 0 && r->nsec == 0) || r->nsec >= 1000000000) {
+			p += len;
+			continue;
+		}
+		if ((path = strndup((const char *)(r + 1), r->pathlen)) == NULL) {
+			perror("strndup()");
+			goto end;
+		}
+		ts.tv_sec = (time_t)r->sec;
+		ts.tv_nsec = (long)r->nsec;
+		if ((added = engine_add(eng, path, &ts)) < 0) {
+			free(path);
+			goto end;
+		}
+		/* Only restore the very same file */
+		if (added == 0) {
+			e = &eng->entries[eng->nentries - 1];
+			e->dev = (dev_t)r->dev;
+			e->ino = (ino_t)r->ino;
+		}
+
+		p += len;
+	}
+	status = 0;
+
+end:
+	(void)munmap(map, (size_t)st.st_size);
+	return (status);
+}
@@ -0,0 +1,184 @@
+/*
+ * Tree walker
+ *
+ * DETAILS:
+ *   Runs in its own thread, walking the given trees with fts(3), which
+ *   stats every entry as it goes, and pushes them into the ring so the
+ *   committer can stamp one batch while the next one is being prepared.
+ *   The filter runs here, before anything is queued, so excluded
+ *   directories are skipped without being read.  On hosts with several
+ *   CPUs the walk is shared by a thread per CPU stealing directories from
+ *   each other (pwalk.c), unless --cache needs the order of fts(3).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fts.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "touch2.h"
+
+static void *
+walk_thread(void *arg)
+{
+	struct walker *w = arg;
+	struct timespec start, end;
+	struct entry e;
+	size_t n = 0;
+	ssize_t r;
+	uint64_t t;
+	FTSENT *p;
+	FTS *fts;
+	int nthreads;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	trace_thread(w->eng, "walker");
+	t = trace_now(w->eng);
+	(void)trickle_idle(w->eng);
+
+	if ((nthreads = pwalk_threads(w->eng)) > 1 &&
+	    (r = pwalk_run(w, nthreads)) >= 0) {
+		n = (size_t)r;
+		goto end;
+	}
+
+	w->nthreads = 1;
+	if ((fts = fts_open(w->roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL) {
+		perror("fts_open()");
+		w->nerrors++;
+		goto end;
+	}
+
+	for (;;) {
+		errno = 0;
+		if ((p = fts_read(fts)) == NULL) {
+			if (errno != 0) {
+				perror("fts_read()");
+				w->nerrors++;
+			}
+			break;
+		}
+
+		if (w->eng->dircache != NULL &&
+		    (p->fts_info == FTS_DP || p->fts_info == FTS_DNR))
+			dircache_leave(w->eng, p);
+
+		switch (p->fts_info) {
+		case FTS_DP:	/* directory already visited in preorder */
+			continue;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			fprintf(stderr, "%s: %s\n", p->fts_path,
+			    strerror(p->fts_errno));
+			w->nerrors++;
+			continue;
+		case FTS_DC:
+			fprintf(stderr, "%s: directory cycle\n", p->fts_path);
+			w->nerrors++;
+			continue;
+		default:
+			break;
+		}
+
+		/* Subtrees unchanged since the last run are not even read */
+		if (p->fts_info == FTS_D && w->eng->dircache != NULL &&
+		    dircache_enter(w->eng, p)) {
+			(void)fts_set(fts, p, FTS_SKIP);
+			continue;
+		}
+
+		if (w->eng->filter != NULL) {
+			switch (filter_run(w->eng->filter, p)) {
+			case FILTER_PRUNE:
+				if (p->fts_info == FTS_D)
+					(void)fts_set(fts, p, FTS_SKIP);
+				w->npruned++;
+				continue;
+			case FILTER_SKIP:
+				w->nskipped++;
+				continue;
+			default:
+				break;
+			}
+		}
+
+		if (!engine_shard_inode(w->eng, p->fts_statp->st_ino)) {
+			w->nforeign++;
+			continue;
+		}
+
+		if ((e.path = strdup(p->fts_path)) == NULL) {
+			perror("strdup()");
+			w->nerrors++;
+			break;
+		}
+		e.mode = p->fts_statp->st_mode;
+		e.dev = p->fts_statp->st_dev;
+		e.ino = p->fts_statp->st_ino;
+		e.oldctime = p->fts_statp->st_ctim;
+		engine_target(w->eng, p->fts_statp, &e.target);
+		e.fd = -1;
+		e.error = 0;
+		e.tag = 0;
+		(void)fdcache_open(w->eng, &e);
+
+		if (w->eng->dircache != NULL)
+			dircache_note(w->eng, p, &e.target);
+		ring_push(w->ring, &e);
+		n++;
+	}
+	(void)fts_close(fts);
+
+end:
+	ring_close(w->ring);
+	trace_span(w->eng, "walk", t, n);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	w->usecs = tsdiff_usec(&start, &end);
+
+	return (NULL);
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+int
+walk_start(struct walker *w)
+{
+	sigset_t oldmask;
+	int error;
+
+	w->nerrors = 0;
+	w->nskipped = w->npruned = w->nforeign = 0;
+	w->nthreads = 0;
+	w->nsteals = 0;
+	w->usecs = 0;
+
+	/*
+	 * The thread inherits a full signal mask, so that signals are only
+	 * delivered to the committer, which blocks them inside windows
+	 */
+	if (block_signals(&oldmask) < 0)
+		return (-1);
+	error = pthread_create(&w->thread, NULL, walk_thread, w);
+	if (unblock_signals(&oldmask) < 0)
+		return (-1);
+	if (error != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+walk_join(struct walker *w)
+{
+	(void)pthread_join(w->thread, NULL);
+}
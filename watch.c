@@ -0,0 +1,385 @@
+/*
+ * Collateral timestamps
+ *
+ * DETAILS:
+ *   Whatever another process writes or chmods while the clock is stepped
+ *   gets the stepped time as its mtime & ctime.  With --watch the
+ *   filesystems touched are marked with fanotify(7), reporting file
+ *   handles, and the events are drained after every chain: a file changed
+ *   by any other process whose ctime is older than the previous drain, or
+ *   newer than now, by more than WATCH_SLACK seconds was changed while the
+ *   clock was stepped, since ctimes only come from the clock.  Going by the
+ *   ctime rather than by when the events are read also catches the writes
+ *   still in progress when the clock was restored; the files of the chain
+ *   whose ctime is the one just stamped are left alone.  The others are logged
+ *   &, with --repair, get the current time as their mtime, or as their
+ *   ctime only if they were just chmoded, like touch(1) would give them.
+ *
+ *   Needs CAP_SYS_ADMIN, a kernel with FAN_REPORT_FID (5.1) & filesystems
+ *   with file handles; the others are just not watched.  Linux only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#endif
+
+#include "touch2.h"
+
+#if defined(__linux__) && defined(FAN_REPORT_FID)
+
+/* Seconds a ctime may be off before it's taken for the stepped clock's */
+#define WATCH_SLACK	1
+
+/* What changes the times of a file, or of a directory through its entries */
+#define WATCH_EVENTS	(FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | \
+			 FAN_MOVE | FAN_ONDIR)
+
+struct watchfs {
+	dev_t		 dev;
+	int		 fd;		/* on the filesystem, -1 if not watched */
+	fsid_t		 fsid;
+};
+
+struct watch {
+	int		 fd;		/* fanotify group */
+	int		 repair;
+	pid_t		 self;
+	struct watchfs	*fss;
+	size_t		 nfss;
+	struct timespec	 since;		/* real time of the previous drain */
+	dev_t		 lastdev;	/* last file logged by the drain */
+	ino_t		 lastino;
+	/* Statistics */
+	size_t		 ncollateral;
+	size_t		 nrepaired;
+	size_t		 noverflows;
+};
+
+/*
+ * Watches the filesystems touched from now on, repairing the collateral
+ * timestamps if repair is set.  Returns 0 on success, -1 on error
+ */
+int
+watch_open(struct engine *eng, int repair)
+{
+	struct watch *w;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL) {
+		perror("calloc()");
+		return (-1);
+	}
+	/* Our own touches are events too, so the queue must not overflow */
+	if ((w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+	    FAN_UNLIMITED_QUEUE | FAN_REPORT_FID, O_RDONLY)) < 0) {
+		perror("fanotify_init()");
+		free(w);
+		return (-1);
+	}
+	w->repair = repair;
+	w->self = getpid();
+	(void)clock_gettime(CLOCK_REALTIME, &w->since);
+	eng->watch = w;
+
+	return (0);
+}
+
+/*
+ * Marks the filesystem of e.  Returns 0 on success, -1 on error
+ */
+static int
+mark(const struct engine *eng, struct watchfs *fs, const struct entry *e)
+{
+	struct watch *w = eng->watch;
+	struct statfs sfs;
+
+	if ((fs->fd = fdcache_open_fs(eng, e)) < 0)
+		return (-1);
+	if (fstatfs(fs->fd, &sfs) < 0 ||
+	    fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+	    WATCH_EVENTS, fs->fd, NULL) < 0) {
+		(void)close(fs->fd);
+		fs->fd = -1;
+		return (-1);
+	}
+	fs->fsid = sfs.f_fsid;
+
+	return (0);
+}
+
+/*
+ * Watches the filesystems of the n entries of v not watched yet
+ */
+void
+watch_note(struct engine *eng, const struct entry *v, size_t n)
+{
+	struct watch *w = eng->watch;
+	struct watchfs *fs;
+	size_t i, k;
+
+	/* Runs are sorted by target, not device, but there are few devices */
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < w->nfss; k++)
+			if (w->fss[k].dev == v[i].dev)
+				break;
+		if (k < w->nfss)
+			continue;
+
+		if ((fs = realloc(w->fss, (k + 1) * sizeof(*fs))) == NULL) {
+			perror("realloc()");
+			return;
+		}
+		w->fss = fs;
+		fs = &w->fss[w->nfss++];
+		fs->dev = v[i].dev;
+		if (mark(eng, fs, &v[i]) < 0)
+			fprintf(stderr, "%s: %s, not watching its filesystem\n",
+			    v[i].path, strerror(errno));
+	}
+}
+
+static int
+before(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec ||
+	    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+/*
+ * Repairs the times of the file open at fd, with the current time as its
+ * mtime if it was modified.  Returns 0 on success, -1 on error
+ */
+static int
+repair(int fd, const struct stat *st, int modified)
+{
+	struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, UTIME_NOW } };
+	char path[32];
+
+	/* The descriptor is O_PATH, so it goes through its /proc link */
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	if (S_ISLNK(st->st_mode))
+		return (fchownat(fd, "", (uid_t)-1, (gid_t)-1, AT_EMPTY_PATH));
+	if (modified)
+		return (utimensat(AT_FDCWD, path, times, 0));
+
+	return (chmod(path, st->st_mode & 07777));
+}
+
+/*
+ * Returns whether the file was just stamped, as one of the n entries of v
+ */
+static int
+stamped(const struct stat *st, const struct entry *v, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (v[i].ino == st->st_ino && v[i].dev == st->st_dev)
+			return (v[i].error == 0 &&
+			    v[i].target.tv_sec == st->st_ctim.tv_sec &&
+			    v[i].target.tv_nsec == st->st_ctim.tv_nsec);
+
+	return (0);
+}
+
+/*
+ * Checks the file of an event of another process, given as a file handle,
+ * for a timestamp of the stepped clock
+ */
+static void
+check(struct watch *w, const struct fanotify_event_metadata *m,
+    const struct timespec *lo, const struct timespec *hi,
+    const struct entry *v, size_t n)
+{
+	const struct fanotify_event_info_fid *info = (const void *)(m + 1);
+	struct file_handle *fh;
+	struct stat st;
+	char path[32], name[PATH_MAX];
+	ssize_t len;
+	size_t k;
+	int fd, modified, r = 0;
+
+	if (m->event_len < sizeof(*m) + sizeof(*info) + sizeof(*fh) ||
+	    info->hdr.info_type != FAN_EVENT_INFO_TYPE_FID)
+		return;
+	for (k = 0; k < w->nfss; k++)
+		if (w->fss[k].fd >= 0 &&
+		    memcmp(&w->fss[k].fsid, &info->fsid, sizeof(info->fsid)) == 0)
+			break;
+	if (k == w->nfss)
+		return;
+
+	/* Files deleted since are gone with their timestamps */
+	fh = (struct file_handle *)(uintptr_t)info->handle;
+	if ((fd = open_by_handle_at(w->fss[k].fd, fh, O_PATH | O_CLOEXEC)) < 0)
+		return;
+	if (fstat(fd, &st) < 0 ||
+	    (!before(&st.st_ctim, lo) && !before(hi, &st.st_ctim)) ||
+	    stamped(&st, v, n)) {
+		(void)close(fd);
+		return;
+	}
+
+	/* Writes come as runs of events */
+	if (st.st_dev == w->lastdev && st.st_ino == w->lastino) {
+		(void)close(fd);
+		return;
+	}
+	w->lastdev = st.st_dev;
+	w->lastino = st.st_ino;
+	w->ncollateral++;
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if ((len = readlink(path, name, sizeof(name) - 1)) < 0)
+		len = 0;
+	name[len] = '\0';
+
+	if (w->repair) {
+		modified = (m->mask & ~(FAN_ATTRIB | FAN_ONDIR)) != 0;
+		while ((r = repair(fd, &st, modified)) < 0 && errno == EINTR)
+			;
+		if (r == 0)
+			w->nrepaired++;
+	}
+	if (r < 0)
+		fprintf(stderr, "touch2: %s: changed by pid %d while the clock "
+		    "was stepped, not repaired: %s\n", name, (int)m->pid,
+		    strerror(errno));
+	else
+		fprintf(stderr, "touch2: %s: changed by pid %d while the clock "
+		    "was stepped%s\n", name, (int)m->pid,
+		    w->repair ? ", repaired" : "");
+	(void)close(fd);
+}
+
+/*
+ * Drains the events, logging & repairing the collateral timestamps but
+ * those of the n entries of v, the chain just committed.  Called with the
+ * clock restored
+ */
+void
+watch_check(struct engine *eng, const struct entry *v, size_t n)
+{
+	struct watch *w = eng->watch;
+	const struct fanotify_event_metadata *m;
+	struct timespec lo, hi;
+	char buf[8192] __attribute__((aligned(8)));
+	ssize_t len;
+
+	(void)clock_gettime(CLOCK_REALTIME, &hi);
+	lo = w->since;
+	w->since = hi;
+	w->lastdev = 0;
+	w->lastino = 0;
+	lo.tv_sec -= WATCH_SLACK;
+	hi.tv_sec += WATCH_SLACK;
+
+	for (;;) {
+		if ((len = read(w->fd, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				perror("fanotify read()");
+			break;
+		}
+		for (m = (const void *)buf; FAN_EVENT_OK(m, len);
+		    m = FAN_EVENT_NEXT(m, len)) {
+			if (m->vers != FANOTIFY_METADATA_VERSION)
+				continue;
+			if (m->mask & FAN_Q_OVERFLOW)
+				w->noverflows++;
+			else if (m->pid != w->self)
+				check(w, m, &lo, &hi, v, n);
+		}
+	}
+}
+
+void
+watch_stats(const struct engine *eng)
+{
+	const struct watch *w = eng->watch;
+
+	fprintf(stderr, "touch2: %zu files of other processes changed while "
+	    "the clock was stepped, %zu repaired\n", w->ncollateral,
+	    w->nrepaired);
+	if (w->noverflows != 0)
+		fprintf(stderr, "touch2: %zu fanotify queue overflows, some "
+		    "files may have been missed\n", w->noverflows);
+}
+
+/*
+ * Checks the last events & stops watching
+ */
+void
+watch_close(struct engine *eng)
+{
+	struct watch *w = eng->watch;
+	size_t i;
+
+	if (w == NULL)
+		return;
+	watch_check(eng, NULL, 0);
+	for (i = 0; i < w->nfss; i++)
+		if (w->fss[i].fd >= 0)
+			(void)close(w->fss[i].fd);
+	free(w->fss);
+	(void)close(w->fd);
+	free(w);
+	eng->watch = NULL;
+}
+
+#else /* !__linux__ || !FAN_REPORT_FID */
+
+int
+watch_open(struct engine *eng, int repair)
+{
+	(void)eng;
+	(void)repair;
+	fprintf(stderr, "--watch: %s\n", strerror(ENOSYS));
+
+	return (-1);
+}
+
+void
+watch_note(struct engine *eng, const struct entry *v, size_t n)
+{
+	(void)eng;
+	(void)v;
+	(void)n;
+}
+
+void
+watch_check(struct engine *eng, const struct entry *v, size_t n)
+{
+	(void)eng;
+	(void)v;
+	(void)n;
+}
+
+void
+watch_stats(const struct engine *eng)
+{
+	(void)eng;
+}
+
+void
+watch_close(struct engine *eng)
+{
+	(void)eng;
+}
+
+#endif /* __linux__ && FAN_REPORT_FID */
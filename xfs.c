@@ -0,0 +1,284 @@
+/*
+ * XFS inode scan
+ *
+ * DETAILS:
+ *   On XFS, XFS_IOC_BULKSTAT returns the attributes of every inode of the
+ *   filesystem in inode number order, read straight from the inode chunks
+ *   instead of one path lookup & stat per file.  xfs_scan() loads them into
+ *   a table that walks look the inode numbers found in directories up in,
+ *   so that they only have to read the directories.  Since the whole
+ *   filesystem is read, it is only used on the root of a mount.  It needs
+ *   CAP_SYS_ADMIN; without it, or on another filesystem, callers stat as
+ *   usual.  The ioctl structures are declared here since <xfs/xfs_fs.h>
+ *   only comes with xfsprogs.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "touch2.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+
+#define XFS_SUPER_MAGIC	0x58465342
+
+/* Inodes per ioctl */
+#define BULKSTAT_COUNT	4096
+
+/* Version 5 of the bulkstat ioctl, in Linux 5.4 & up */
+struct xfs_bulk_ireq {
+	uint64_t	ino;		/* in: first inode, out: next one */
+	uint32_t	flags;
+	uint32_t	icount;		/* in: room in the buffer */
+	uint32_t	ocount;		/* out: inodes returned */
+	uint32_t	agno;
+	uint64_t	reserved[5];
+};
+
+struct xfs_bulkstat {
+	uint64_t	bs_ino;
+	uint64_t	bs_size;
+	uint64_t	bs_blocks;
+	uint64_t	bs_xflags;
+	int64_t		bs_atime;
+	int64_t		bs_mtime;
+	int64_t		bs_ctime;
+	int64_t		bs_btime;
+	uint32_t	bs_gen;
+	uint32_t	bs_uid;
+	uint32_t	bs_gid;
+	uint32_t	bs_projectid;
+	uint32_t	bs_atime_nsec;
+	uint32_t	bs_mtime_nsec;
+	uint32_t	bs_ctime_nsec;
+	uint32_t	bs_btime_nsec;
+	uint32_t	bs_blksize;
+	uint32_t	bs_rdev;
+	uint32_t	bs_cowextsize_blks;
+	uint32_t	bs_extsize_blks;
+	uint32_t	bs_nlink;
+	uint32_t	bs_extents;
+	uint32_t	bs_aextents;
+	uint16_t	bs_version;
+	uint16_t	bs_forkoff;
+	uint16_t	bs_sick;
+	uint16_t	bs_checked;
+	uint16_t	bs_mode;
+	uint16_t	bs_pad2;
+	uint64_t	bs_extents64;
+	uint64_t	bs_pad[6];
+};
+
+struct xfs_bulkstat_req {
+	struct xfs_bulk_ireq	hdr;
+	struct xfs_bulkstat	bulkstat[];
+};
+
+#define XFS_IOC_BULKSTAT	_IOR('X', 127, struct xfs_bulkstat_req)
+
+/* What the walks need of an inode */
+struct xfs_inode {
+	uint64_t	ino;
+	int64_t		ctime;
+	uint32_t	ctime_nsec;
+	uint32_t	mode;
+};
+
+struct xfstable {
+	dev_t		 dev;
+	struct xfs_inode *v;
+	size_t		 n;
+};
+
+/*
+ * Returns whether path is the root of an XFS mount
+ */
+static int
+is_xfs_root(const char *path, int fd, dev_t *dev)
+{
+	struct statfs sfs;
+	struct stat st, parent;
+	char *up;
+
+	if (fstatfs(fd, &sfs) < 0 || sfs.f_type != XFS_SUPER_MAGIC ||
+	    fstat(fd, &st) < 0)
+		return (0);
+	if (asprintf(&up, "%s/..", path) < 0)
+		return (0);
+	if (stat(up, &parent) < 0) {
+		free(up);
+		return (0);
+	}
+	free(up);
+	*dev = st.st_dev;
+
+	return (parent.st_dev != st.st_dev || parent.st_ino == st.st_ino);
+}
+
+/*
+ * Reads every inode of the filesystem mounted at root.  Returns the table,
+ * or NULL if root is not the root of an XFS mount or bulkstat is not
+ * allowed
+ */
+struct xfstable *
+xfs_scan(const char *root)
+{
+	struct xfs_bulkstat_req *req;
+	struct xfstable *t;
+	size_t size = 0, i;
+	int fd;
+
+	if ((fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return (NULL);
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		perror("calloc()");
+		(void)close(fd);
+		return (NULL);
+	}
+	if (!is_xfs_root(root, fd, &t->dev)) {
+		(void)close(fd);
+		free(t);
+		return (NULL);
+	}
+	req = calloc(1, sizeof(*req) + BULKSTAT_COUNT * sizeof(req->bulkstat[0]));
+	if (req == NULL) {
+		perror("calloc()");
+		goto fail;
+	}
+
+	for (;;) {
+		req->hdr.icount = BULKSTAT_COUNT;
+		req->hdr.ocount = 0;
+		if (ioctl(fd, XFS_IOC_BULKSTAT, req) < 0) {
+			/* Old kernels & unprivileged users stat instead */
+			if (errno != EPERM && errno != ENOTTY &&
+			    errno != EINVAL && errno != EOPNOTSUPP)
+				perror("ioctl(XFS_IOC_BULKSTAT)");
+			goto fail;
+		}
+		if (req->hdr.ocount == 0)
+			break;
+
+		if (t->n + req->hdr.ocount > size) {
+			struct xfs_inode *v;
+
+			size = (size == 0) ? 65536 : size * 2;
+			if (size < t->n + req->hdr.ocount)
+				size = t->n + req->hdr.ocount;
+			if ((v = realloc(t->v, size * sizeof(*v))) == NULL) {
+				perror("realloc()");
+				goto fail;
+			}
+			t->v = v;
+		}
+		for (i = 0; i < req->hdr.ocount; i++) {
+			const struct xfs_bulkstat *bs = &req->bulkstat[i];
+			struct xfs_inode *x = &t->v[t->n++];
+
+			x->ino = bs->bs_ino;
+			x->ctime = bs->bs_ctime;
+			x->ctime_nsec = bs->bs_ctime_nsec;
+			x->mode = bs->bs_mode;
+		}
+	}
+	free(req);
+	(void)close(fd);
+
+	return (t);
+
+fail:
+	free(req);
+	(void)close(fd);
+	xfs_free(t);
+	return (NULL);
+}
+
+/*
+ * Fills the device, inode number, mode & ctime of st from the table.
+ * Returns 0 on success, -1 if the inode is not in it
+ */
+int
+xfs_lookup(const struct xfstable *t, ino_t ino, struct stat *st)
+{
+	size_t lo = 0, hi = t->n, mid;
+
+	/* The table is in inode order */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->v[mid].ino < (uint64_t)ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == t->n || t->v[lo].ino != (uint64_t)ino)
+		return (-1);
+
+	memset(st, 0, sizeof(*st));
+	st->st_dev = t->dev;
+	st->st_ino = ino;
+	st->st_mode = t->v[lo].mode;
+	st->st_ctim.tv_sec = (time_t)t->v[lo].ctime;
+	st->st_ctim.tv_nsec = (long)t->v[lo].ctime_nsec;
+
+	return (0);
+}
+
+dev_t
+xfs_dev(const struct xfstable *t)
+{
+	return (t->dev);
+}
+
+void
+xfs_free(struct xfstable *t)
+{
+	if (t != NULL) {
+		free(t->v);
+		free(t);
+	}
+}
+
+#else /* !__linux__ */
+
+struct xfstable *
+xfs_scan(const char *root)
+{
+	(void)root;
+	return (NULL);
+}
+
+int
+xfs_lookup(const struct xfstable *t, ino_t ino, struct stat *st)
+{
+	(void)t;
+	(void)ino;
+	(void)st;
+	return (-1);
+}
+
+dev_t
+xfs_dev(const struct xfstable *t)
+{
+	(void)t;
+	return (0);
+}
+
+void
+xfs_free(struct xfstable *t)
+{
+	(void)t;
+}
+
+#endif /* __linux__ */